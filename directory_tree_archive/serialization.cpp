@@ -101,6 +101,23 @@
 using std::string;
 using std::vector;
 
+// Reads a name of "length" bytes from "read_stream" into "name". The name is
+// read in parts, so that a corrupt length fails at the end of the stream
+// instead of asking for a huge buffer up front.
+static bool ReadName(ReadStream* read_stream,
+                     unsigned int length,
+                     string& name) {
+  name.clear();
+  char buffer[STREAM_BUFFER_SIZE];
+  while (length > 0) {
+    size_t chunk = length < STREAM_BUFFER_SIZE ? length : STREAM_BUFFER_SIZE;
+    if (read_stream->ReadBytes(buffer, chunk) != chunk) return false;
+    name.append(buffer, chunk);
+    length -= (unsigned int) chunk;
+  }
+  return true;
+}
+
 bool ArchiveDirectoryTree(const string& base_directory,
                           const string& archive_filename) {
   FileWriteStream write_stream(archive_filename);
@@ -173,9 +190,7 @@ bool SerializeFile(const string& filename,
   // Serialize file name.
   unsigned int length = (unsigned int) filename.size();
   if (!write_stream->WriteUnsignedInt32(length)) return false;
-  for (int i = 0; i < (int) length; i++) {
-    if (!write_stream->WriteByte(filename[i])) return false;
-  }
+  if (!write_stream->WriteBytes(filename.data(), length)) return false;
 
   // Serialize file contents.
   string full_name = StripLastPathComponent(base_directory) + "\\" + filename;
@@ -183,11 +198,12 @@ bool SerializeFile(const string& filename,
   unsigned int bytes = read_stream.Bytes();
   if (!write_stream->WriteUnsignedInt32(bytes)) return false;
   read_stream.Reset();
+  char buffer[STREAM_BUFFER_SIZE];
   while (bytes > 0) {
-    char byte;
-    if (!read_stream.ReadByte(byte)) return false;
-    if (!write_stream->WriteByte(byte)) return false;
-    bytes--;
+    size_t chunk = bytes < STREAM_BUFFER_SIZE ? bytes : STREAM_BUFFER_SIZE;
+    if (read_stream.ReadBytes(buffer, chunk) != chunk) return false;
+    if (!write_stream->WriteBytes(buffer, chunk)) return false;
+    bytes -= (unsigned int) chunk;
   }
   return true;
 }
@@ -196,9 +212,7 @@ bool SerializeDirectory(const string& directory_name,
                         WriteStream* write_stream) { 
   unsigned int length = (unsigned int) directory_name.size();
   write_stream->WriteUnsignedInt32(length);
-  for (int i = 0; i < (int) length; i++) {
-    write_stream->WriteByte(directory_name[i]);
-  }
+  write_stream->WriteBytes(directory_name.data(), length);
   return true;
 }
 
@@ -242,21 +256,18 @@ bool DeserializeFile(const string& base_directory, ReadStream* read_stream) {
   unsigned int length;
   if (!read_stream->ReadUnsignedInt32(length)) return false;
   string filename;
-  for(int i = 0; i < (int) length; i++) {
-    char byte;
-    if (!read_stream->ReadByte(byte)) return false;
-    filename += byte;
-  }
+  if (!ReadName(read_stream, length, filename)) return false;
   filename = base_directory + "\\" + filename;
 
   unsigned int bytes;
   if (!read_stream->ReadUnsignedInt32(bytes)) return false;
   FileWriteStream write_stream(filename);
+  char buffer[STREAM_BUFFER_SIZE];
   while (bytes > 0) {
-    char byte;
-    if (!read_stream->ReadByte(byte)) return false;
-    if (!write_stream.WriteByte(byte)) return false;
-    bytes--;
+    size_t chunk = bytes < STREAM_BUFFER_SIZE ? bytes : STREAM_BUFFER_SIZE;
+    if (read_stream->ReadBytes(buffer, chunk) != chunk) return false;
+    if (!write_stream.WriteBytes(buffer, chunk)) return false;
+    bytes -= (unsigned int) chunk;
   }
   write_stream.Flush();
   return true;
@@ -267,11 +278,7 @@ bool DeserializeDirectory(const string& base_directory,
   unsigned int length;
   if (!read_stream->ReadUnsignedInt32(length)) return false;
   string directory_name;
-  for (int i = 0; i < (int) length; i++) {
-    char byte;
-    if (!read_stream->ReadByte(byte)) return false;
-    directory_name += byte;
-  }
+  if (!ReadName(read_stream, length, directory_name)) return false;
 
   directory_name = base_directory + "\\" + directory_name;
   string command = "mkdir \"" + directory_name + "\"";
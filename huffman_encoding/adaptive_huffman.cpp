@@ -0,0 +1,177 @@
+// This file contains implementations of the classes and functions in
+// "adaptive_huffman.h".
+#include "adaptive_huffman.h"
+
+// The number of symbols before the first rebuild of an adaptive code.
+static const unsigned int kFirstRebuildPeriod = 32;
+
+// When the counts of an adaptive code add up to more than this, they are
+// halved so that the code follows changes in the data.
+static const unsigned int kMaxTotalFrequency = 1 << 16;
+
+AdaptiveHuffmanModel::AdaptiveHuffmanModel(unsigned int rebuild_interval) {
+  this->rebuild_interval_ = rebuild_interval > 0 ? rebuild_interval : 1;
+  this->period_ = kFirstRebuildPeriod;
+  if (period_ > rebuild_interval_) {
+    period_ = rebuild_interval_;
+  }
+  this->symbols_until_rebuild_ = period_;
+  for (int symbol = 0; symbol < kAdaptiveHuffmanSymbols; symbol++) {
+    frequencies_[symbol] = 1;
+  }
+  BuildLimitedCodeLengths(frequencies_, kAdaptiveHuffmanSymbols,
+                          kHuffmanLookupBits, lengths_);
+}
+
+void AdaptiveHuffmanModel::Rebuild() {
+  // Every symbol keeps a count of at least 1, so every symbol always has a
+  // code.
+  BuildLimitedCodeLengths(frequencies_, kAdaptiveHuffmanSymbols,
+                          kHuffmanLookupBits, lengths_);
+  unsigned int total = 0;
+  for (int symbol = 0; symbol < kAdaptiveHuffmanSymbols; symbol++) {
+    total += frequencies_[symbol];
+  }
+  if (total > kMaxTotalFrequency) {
+    for (int symbol = 0; symbol < kAdaptiveHuffmanSymbols; symbol++) {
+      frequencies_[symbol] = (frequencies_[symbol] + 1) / 2;
+    }
+  }
+  if (period_ < rebuild_interval_) {
+    period_ = period_ * 2 < rebuild_interval_ ? period_ * 2
+                                              : rebuild_interval_;
+  }
+  symbols_until_rebuild_ = period_;
+}
+
+AdaptiveHuffmanEncoder::AdaptiveHuffmanEncoder(unsigned int rebuild_interval)
+    : model_(rebuild_interval) {
+  this->accumulator_ = 0;
+  this->bit_count_ = 0;
+  BuildCodes();
+}
+
+void AdaptiveHuffmanEncoder::BuildCodes() {
+  BuildCanonicalCodes(model_.lengths(), kAdaptiveHuffmanSymbols, codes_);
+}
+
+void AdaptiveHuffmanEncoder::WriteSymbol(int symbol, string& output) {
+  int length = model_.lengths()[symbol];
+  accumulator_ = (accumulator_ << length) | codes_[symbol];
+  bit_count_ += length;
+  while (bit_count_ >= 8) {
+    bit_count_ -= 8;
+    output.push_back((char) (accumulator_ >> bit_count_));
+  }
+}
+
+void AdaptiveHuffmanEncoder::Encode(const char* data,
+                                    size_t size,
+                                    string& output) {
+  for (size_t i = 0; i < size; i++) {
+    int symbol = (unsigned char) data[i];
+    WriteSymbol(symbol, output);
+    if (model_.Update(symbol)) {
+      BuildCodes();
+    }
+  }
+}
+
+void AdaptiveHuffmanEncoder::Finish(string& output) {
+  WriteSymbol(kAdaptiveHuffmanEndSymbol, output);
+  if (bit_count_ > 0) {
+    output.push_back((char) (accumulator_ << (8 - bit_count_)));
+    bit_count_ = 0;
+  }
+}
+
+AdaptiveHuffmanDecoder::AdaptiveHuffmanDecoder(unsigned int rebuild_interval)
+    : model_(rebuild_interval) {
+  this->accumulator_ = 0;
+  this->bit_count_ = 0;
+  this->finished_ = false;
+  BuildTable();
+}
+
+void AdaptiveHuffmanDecoder::BuildTable() {
+  unsigned long long codes[kAdaptiveHuffmanSymbols];
+  BuildCanonicalCodes(model_.lengths(), kAdaptiveHuffmanSymbols, codes);
+  BuildDecodeTable(codes, model_.lengths(), kAdaptiveHuffmanSymbols, table_);
+}
+
+bool AdaptiveHuffmanDecoder::Decode(const char* data,
+                                    size_t size,
+                                    string& output) {
+  for (size_t i = 0; i < size; i++) {
+    if (finished_) {
+      return false;
+    }
+    // The accumulator holds the bits that have not been decoded yet in its
+    // highest bits, followed by "0"s.
+    accumulator_ |= (unsigned long long) (unsigned char) data[i]
+                    << (56 - bit_count_);
+    bit_count_ += 8;
+
+    // A lookup can be made even with fewer bits than kHuffmanLookupBits.
+    // If the code that it finds fits in the bits that are there, those bits
+    // are the whole code.
+    while (true) {
+      const HuffmanDecodeEntry& entry =
+          table_[accumulator_ >> (64 - kHuffmanLookupBits)];
+      if (entry.first_bits > bit_count_) {
+        break;
+      }
+      accumulator_ <<= entry.first_bits;
+      bit_count_ -= entry.first_bits;
+      int symbol = entry.symbols & 0xffff;
+      if (symbol == kAdaptiveHuffmanEndSymbol) {
+        // Only the padding of the last byte may follow the end.
+        finished_ = true;
+        if (bit_count_ >= 8 || accumulator_ != 0) {
+          return false;
+        }
+        break;
+      }
+      output.push_back((char) symbol);
+      if (model_.Update(symbol)) {
+        BuildTable();
+      }
+    }
+  }
+  return true;
+}
+
+void HuffmanAdaptiveEncode(ReadStream* read_stream,
+                           WriteStream* write_stream,
+                           unsigned int rebuild_interval) {
+  AdaptiveHuffmanEncoder encoder(rebuild_interval);
+  string encoded_data;
+  char buffer[STREAM_BUFFER_SIZE];
+  size_t bytes;
+  while ((bytes = read_stream->ReadBytes(buffer, STREAM_BUFFER_SIZE)) > 0) {
+    encoder.Encode(buffer, bytes, encoded_data);
+    write_stream->WriteBytes(encoded_data.data(), encoded_data.size());
+    encoded_data.clear();
+  }
+  encoder.Finish(encoded_data);
+  write_stream->WriteBytes(encoded_data.data(), encoded_data.size());
+  write_stream->Flush();
+}
+
+bool HuffmanAdaptiveDecode(ReadStream* read_stream,
+                           WriteStream* write_stream,
+                           unsigned int rebuild_interval) {
+  AdaptiveHuffmanDecoder decoder(rebuild_interval);
+  string decoded_data;
+  char buffer[STREAM_BUFFER_SIZE];
+  size_t bytes;
+  while ((bytes = read_stream->ReadBytes(buffer, STREAM_BUFFER_SIZE)) > 0) {
+    if (!decoder.Decode(buffer, bytes, decoded_data)) {
+      return false;
+    }
+    write_stream->WriteBytes(decoded_data.data(), decoded_data.size());
+    decoded_data.clear();
+  }
+  write_stream->Flush();
+  return decoder.Finished();
+}
@@ -0,0 +1,134 @@
+// Adaptive Huffman coding, which encodes and decodes data in a single pass.
+#ifndef ADAPTIVE_HUFFMAN_H_
+#define ADAPTIVE_HUFFMAN_H_
+
+#include "huffman.h"
+#include "read_write_streams.h"
+
+#include <cstddef>
+#include <string>
+
+using std::string;
+
+// The largest number of symbols between two rebuilds of an adaptive code
+// unless specified otherwise.
+const unsigned int kAdaptiveHuffmanRebuildInterval = 4096;
+
+// The symbol that ends adaptively encoded data. Symbols 0 to 255 are bytes.
+const int kAdaptiveHuffmanEndSymbol = 256;
+
+// The number of symbols of an adaptive code.
+const int kAdaptiveHuffmanSymbols = 257;
+
+// The data of an adaptive code is a plain sequence of canonical Huffman
+// codes, most significant bit first, with no header. Both sides start with
+// every symbol counted once and count every symbol that they code. The code
+// is rebuilt from the counts after 32 symbols, then after 64 more symbols,
+// and so on, with the number of symbols between rebuilds doubling until it
+// reaches the rebuild interval. The data ends with the end symbol and is
+// padded with "0"s to a whole byte. Codes are limited to kHuffmanLookupBits
+// bits, so every symbol is decoded with a single table lookup.
+class AdaptiveHuffmanModel {
+public:
+  AdaptiveHuffmanModel(unsigned int rebuild_interval);
+
+  // Counts one more occurrence of "symbol". Returns true if the code has
+  // been rebuilt as a result.
+  bool Update(int symbol) {
+    frequencies_[symbol]++;
+    if (--symbols_until_rebuild_ > 0) {
+      return false;
+    }
+    Rebuild();
+    return true;
+  }
+
+  // The code lengths of the current code, indexed by symbol.
+  const unsigned char* lengths() const {
+    return lengths_;
+  }
+
+private:
+  void Rebuild();
+
+  unsigned int frequencies_[kAdaptiveHuffmanSymbols];
+  unsigned char lengths_[kAdaptiveHuffmanSymbols];
+  unsigned int rebuild_interval_;
+  unsigned int period_;
+  unsigned int symbols_until_rebuild_;
+};
+
+// Encodes data with an adaptive code as it arrives. Every call to "Encode"
+// returns all the bits for the given data that fill whole bytes, so the
+// output trails the input by less than a byte.
+class AdaptiveHuffmanEncoder {
+public:
+  AdaptiveHuffmanEncoder(
+      unsigned int rebuild_interval = kAdaptiveHuffmanRebuildInterval);
+
+  // Encodes the "size" bytes at "data" and appends the completed bytes of
+  // the result to "output".
+  void Encode(const char* data, size_t size, string& output);
+
+  // Ends the data and appends the rest of the result to "output". No more
+  // data may be encoded afterwards.
+  void Finish(string& output);
+
+private:
+  void BuildCodes();
+  void WriteSymbol(int symbol, string& output);
+
+  AdaptiveHuffmanModel model_;
+  unsigned long long codes_[kAdaptiveHuffmanSymbols];
+  unsigned long long accumulator_;
+  int bit_count_;
+};
+
+// Decodes data that was encoded by "AdaptiveHuffmanEncoder" as it arrives.
+// Every symbol is decoded as soon as all of its bits have been given to
+// "Decode".
+class AdaptiveHuffmanDecoder {
+public:
+  AdaptiveHuffmanDecoder(
+      unsigned int rebuild_interval = kAdaptiveHuffmanRebuildInterval);
+
+  // Decodes as much as possible of the encoded data so far, which is
+  // extended by the "size" bytes at "data", and appends the decoded bytes to
+  // "output". Returns false if the data is not valid, which includes any
+  // data after the end.
+  bool Decode(const char* data, size_t size, string& output);
+
+  // Returns true if the end of the data has been decoded.
+  bool Finished() const {
+    return finished_;
+  }
+
+private:
+  void BuildTable();
+
+  AdaptiveHuffmanModel model_;
+  HuffmanDecodeTable table_;
+  unsigned long long accumulator_;
+  int bit_count_;
+  bool finished_;
+};
+
+// Encodes the contents of "read_stream" with an adaptive code and writes the
+// result to "write_stream". Unlike "HuffmanEncode", the input is not split
+// into blocks, and every byte of output is written as soon as it is known.
+// The same "rebuild_interval" must be used for decoding.
+void HuffmanAdaptiveEncode(
+    ReadStream* read_stream,
+    WriteStream* write_stream,
+    unsigned int rebuild_interval = kAdaptiveHuffmanRebuildInterval);
+
+// Decodes the contents of "read_stream", which were encoded by
+// "HuffmanAdaptiveEncode", and writes the result to "write_stream". Every
+// byte is written as soon as it is decoded. Returns false if the data in
+// "read_stream" is not valid.
+bool HuffmanAdaptiveDecode(
+    ReadStream* read_stream,
+    WriteStream* write_stream,
+    unsigned int rebuild_interval = kAdaptiveHuffmanRebuildInterval);
+
+#endif // ADAPTIVE_HUFFMAN_H_
@@ -0,0 +1,433 @@
+// This file contains implementations of the functions in "ans.h".
+#include "ans.h"
+
+#include <cmath>
+#include <vector>
+
+using std::vector;
+
+// The number of bits that hold the zero counts after a count of 0, and
+// the number of extra bits for longer runs of them.
+static const int kZeroRunBits = 4;
+static const int kLongZeroRunBits = 8;
+static const unsigned int kLongZeroRun = (1u << kZeroRunBits) - 1;
+
+// Returns the position of the highest bit set in "value", which must not be
+// 0.
+static inline int HighBit(unsigned int value) {
+  int bit = 0;
+  while (value >>= 1) {
+    bit++;
+  }
+  return bit;
+}
+
+// Returns the number of bits that hold numbers up to "value".
+static inline int CountBits(unsigned int value) {
+  return HighBit(value) + 1;
+}
+
+// Stores in "symbols" the byte of every state of a table with the counts
+// "counts". The states of every byte are spread over the table by a fixed
+// odd step, so that all the bytes have states of every size. The step is
+// coprime to the size of the table, so every state is visited once.
+static void SpreadSymbols(const unsigned short* counts,
+                          int table_log,
+                          unsigned char* symbols) {
+  unsigned int table_size = 1u << table_log;
+  unsigned int mask = table_size - 1;
+  unsigned int step = (table_size >> 1) + (table_size >> 3) + 3;
+  unsigned int position = 0;
+  for (int byte = 0; byte < 256; byte++) {
+    for (unsigned int i = 0; i < counts[byte]; i++) {
+      symbols[position] = (unsigned char) byte;
+      position = (position + step) & mask;
+    }
+  }
+}
+
+// The coding of a byte in the encoder. A state s of the encoder, from
+// 2^table_log to 2^(table_log + 1) - 1, writes the lowest (s + bits) >> 16
+// bits of itself, and the rest of it is moved by "next" to find the next
+// state in the table of states.
+struct AnsEncodeSymbol {
+  unsigned int bits;
+  int next;
+};
+
+// An entry of the decoding table for a state. The state decodes "byte" and
+// the next state is "next" plus the next "bits" bits of the input.
+struct AnsDecodeEntry {
+  unsigned short next;
+  unsigned char byte;
+  unsigned char bits;
+};
+
+// Collects bits in the reverse of the order in which they are read, so that
+// the bits of the last byte that is coded come first. The bits are written
+// 32 at a time backwards from the end of a buffer that must be large
+// enough to hold them.
+class ReverseBitWriter {
+public:
+  ReverseBitWriter(char* end) : position_(end), accumulator_(0),
+                                bit_count_(0) {}
+
+  // Puts the lowest "bits" bits of "value", which has no higher bits set,
+  // before the bits written so far. "Bits" is at most 32.
+  void WriteBits(unsigned int value, int bits) {
+    accumulator_ |= (unsigned long long) value << bit_count_;
+    bit_count_ += bits;
+    if (bit_count_ >= 32) {
+      unsigned int word = (unsigned int) accumulator_;
+      position_ -= 4;
+      position_[0] = (char) (word >> 24);
+      position_[1] = (char) (word >> 16);
+      position_[2] = (char) (word >> 8);
+      position_[3] = (char) word;
+      accumulator_ >>= 32;
+      bit_count_ -= 32;
+    }
+  }
+
+  // Puts a bit of 1 before the bits written so far and fills the first byte
+  // with "0"s before it. Returns the start of the written bytes.
+  char* Finish() {
+    WriteBits(1, 1);
+    while (bit_count_ > 0) {
+      *--position_ = (char) accumulator_;
+      accumulator_ >>= 8;
+      bit_count_ -= 8;
+    }
+    return position_;
+  }
+
+private:
+  char* position_;
+  unsigned long long accumulator_;
+  int bit_count_;
+};
+
+int AnsTableLog(const unsigned int* frequencies, unsigned int size) {
+  int distinct = 0;
+  for (int byte = 0; byte < 256; byte++) {
+    distinct += frequencies[byte] > 0;
+  }
+  if (distinct == 0) {
+    return 0;
+  }
+  int table_log = kAnsMaxTableLog;
+  while (table_log > kAnsMinTableLog && (1u << (table_log - 1)) >= size) {
+    table_log--;
+  }
+  while ((1 << table_log) < distinct) {
+    table_log++;
+  }
+  return table_log;
+}
+
+bool NormalizeAnsCounts(const unsigned int* frequencies,
+                        unsigned int size,
+                        int table_log,
+                        unsigned short* counts) {
+  unsigned int table_size = 1u << table_log;
+  unsigned int total = 0;
+  for (int byte = 0; byte < 256; byte++) {
+    counts[byte] = 0;
+    if (size > 0 && frequencies[byte] > 0) {
+      unsigned long long scaled =
+          ((unsigned long long) frequencies[byte] * table_size * 2 + size) /
+          (2ull * size);
+      counts[byte] = scaled > 0 ? (unsigned short) scaled : 1;
+      total += counts[byte];
+    }
+  }
+  // Moving a count of byte b with f occurrences from c to c - 1 costs
+  // f * log2(c / (c - 1)) bits, and from c to c + 1 saves
+  // f * log2((c + 1) / c).
+  while (total > table_size) {
+    int best = -1;
+    double best_cost = 0;
+    for (int byte = 0; byte < 256; byte++) {
+      if (counts[byte] > 1) {
+        double cost = frequencies[byte] *
+                      log2((double) counts[byte] / (counts[byte] - 1));
+        if (best < 0 || cost < best_cost) {
+          best = byte;
+          best_cost = cost;
+        }
+      }
+    }
+    counts[best]--;
+    total--;
+  }
+  if (total == 0) {
+    return false;
+  }
+  while (total < table_size) {
+    int best = -1;
+    double best_saving = 0;
+    for (int byte = 0; byte < 256; byte++) {
+      if (counts[byte] > 0) {
+        double saving = frequencies[byte] *
+                        log2((double) (counts[byte] + 1) / counts[byte]);
+        if (best < 0 || saving > best_saving) {
+          best = byte;
+          best_saving = saving;
+        }
+      }
+    }
+    counts[best]++;
+    total++;
+  }
+  return true;
+}
+
+double AnsEncodedBits(const unsigned int* frequencies,
+                      const unsigned short* counts,
+                      int table_log) {
+  double bits = 0;
+  for (int byte = 0; byte < 256; byte++) {
+    if (frequencies[byte] > 0) {
+      bits += frequencies[byte] * (table_log - log2((double) counts[byte]));
+    }
+  }
+  return bits;
+}
+
+// Calls "write(value, bits)" for every item of the scaled counts "counts",
+// in the order in which "EncodeAnsCounts" writes them.
+template <typename Write>
+static void WriteAnsCountItems(const unsigned short* counts,
+                               int table_log,
+                               Write& write) {
+  write(table_log - kAnsMinTableLog, 3);
+  unsigned int remaining = 1u << table_log;
+  int byte = 0;
+  while (remaining > 0) {
+    write(counts[byte], CountBits(remaining));
+    remaining -= counts[byte];
+    if (counts[byte] > 0) {
+      byte++;
+      continue;
+    }
+    // Some later byte has a count, so the run ends before the last byte.
+    unsigned int zeros = 0;
+    while (counts[byte + 1 + zeros] == 0) {
+      zeros++;
+    }
+    if (zeros < kLongZeroRun) {
+      write(zeros, kZeroRunBits);
+    } else {
+      write(kLongZeroRun, kZeroRunBits);
+      write(zeros - kLongZeroRun, kLongZeroRunBits);
+    }
+    byte += 1 + zeros;
+  }
+}
+
+// Writes the items of the scaled counts to a BitWriter.
+struct WriteCountItem {
+  BitWriter& writer;
+
+  WriteCountItem(BitWriter& writer) : writer(writer) {}
+
+  void operator () (unsigned int value, int bits) {
+    writer.WriteBits(value, bits);
+  }
+};
+
+// Adds up the bits that the items of the scaled counts take.
+struct CountItemBits {
+  unsigned int bits;
+
+  CountItemBits() : bits(0) {}
+
+  void operator () (unsigned int, int bits) {
+    this->bits += bits;
+  }
+};
+
+void EncodeAnsCounts(const unsigned short* counts,
+                     int table_log,
+                     BitWriter& writer) {
+  WriteCountItem write(writer);
+  WriteAnsCountItems(counts, table_log, write);
+}
+
+unsigned int AnsCountsSize(const unsigned short* counts, int table_log) {
+  CountItemBits count_bits;
+  WriteAnsCountItems(counts, table_log, count_bits);
+  return (count_bits.bits + 7) / 8;
+}
+
+bool DecodeAnsCounts(BitReader& reader,
+                     unsigned short* counts,
+                     int& table_log) {
+  table_log = reader.ReadBits(3) + kAnsMinTableLog;
+  if (table_log > kAnsMaxTableLog) {
+    return false;
+  }
+  for (int byte = 0; byte < 256; byte++) {
+    counts[byte] = 0;
+  }
+  unsigned int remaining = 1u << table_log;
+  int byte = 0;
+  while (remaining > 0) {
+    if (byte >= 256) {
+      return false;
+    }
+    unsigned int count = reader.ReadBits(CountBits(remaining));
+    if (count > remaining) {
+      return false;
+    }
+    counts[byte++] = (unsigned short) count;
+    remaining -= count;
+    if (count == 0) {
+      unsigned int zeros = reader.ReadBits(kZeroRunBits);
+      if (zeros == kLongZeroRun) {
+        zeros += reader.ReadBits(kLongZeroRunBits);
+      }
+      byte += zeros;
+    }
+  }
+  return byte <= 256 && !reader.Overrun();
+}
+
+void AnsEncode(const char* data,
+               unsigned int size,
+               const unsigned short* counts,
+               int table_log,
+               vector<char>& output) {
+  unsigned int table_size = 1u << table_log;
+  vector<unsigned char> symbols(table_size);
+  SpreadSymbols(counts, table_log, &symbols[0]);
+
+  // The states of every byte are listed together, in the order in which
+  // they appear in the table, starting at the total of the counts of the
+  // bytes before it.
+  AnsEncodeSymbol coding[256];
+  unsigned int starts[256];
+  unsigned int total = 0;
+  for (int byte = 0; byte < 256; byte++) {
+    starts[byte] = total;
+    coding[byte].bits = 0;
+    coding[byte].next = 0;
+    if (counts[byte] > 0) {
+      // A state writes the bits that bring it below 2 * count, which is one
+      // more bit for states from (2 * count) << (max_bits - 1) on.
+      int max_bits = table_log - (counts[byte] > 1
+                                      ? HighBit(counts[byte] - 1) : 0);
+      coding[byte].bits = (max_bits << 16) - (counts[byte] << max_bits);
+      coding[byte].next = (int) total - counts[byte];
+    }
+    total += counts[byte];
+  }
+  vector<unsigned short> states(table_size);
+  for (unsigned int state = 0; state < table_size; state++) {
+    states[starts[symbols[state]]++] = (unsigned short) (table_size + state);
+  }
+
+  // Every byte takes at most "table_log" bits, and the states and the first
+  // bit are written at the end.
+  size_t capacity = ((unsigned long long) size + kAnsStates) * table_log / 8 +
+                    8;
+  output.resize(capacity);
+  ReverseBitWriter writer(&output[0] + capacity);
+  const unsigned char* bytes = (const unsigned char*) data;
+  unsigned int state[kAnsStates];
+  for (int k = 0; k < kAnsStates; k++) {
+    state[k] = table_size;
+  }
+  for (unsigned int i = size; i-- > 0;) {
+    unsigned int& current = state[i % kAnsStates];
+    const AnsEncodeSymbol& symbol = coding[bytes[i]];
+    int bits = (current + symbol.bits) >> 16;
+    writer.WriteBits(current & ((1u << bits) - 1), bits);
+    current = states[(current >> bits) + symbol.next];
+  }
+  for (int k = kAnsStates - 1; k >= 0; k--) {
+    writer.WriteBits(state[k] - table_size, table_log);
+  }
+  char* start = writer.Finish();
+  output.erase(output.begin(), output.begin() + (start - &output[0]));
+}
+
+// Returns the state after the state whose entry is "entry" and reads its
+// bits from "reader", which must have at least 32 bits left.
+static inline unsigned int NextAnsState(BitReader& reader,
+                                        const AnsDecodeEntry& entry) {
+  // The bits are taken from the top of 32 bits, so that reading no bits
+  // needs no special case.
+  unsigned long long bits = reader.PeekBits(32);
+  reader.SkipBits(entry.bits);
+  return entry.next + (unsigned int) (bits >> (32 - entry.bits));
+}
+
+bool AnsDecode(const char* data,
+               size_t size,
+               const unsigned short* counts,
+               int table_log,
+               char* output,
+               unsigned int bytes) {
+  if (size == 0 || data[0] == 0) {
+    return false;
+  }
+  unsigned int table_size = 1u << table_log;
+  vector<unsigned char> symbols(table_size);
+  SpreadSymbols(counts, table_log, &symbols[0]);
+  // The states of every byte come in the order of the states of the
+  // encoder, from its count to twice its count, and each of them reads as
+  // many bits as bring it back to the size of the table.
+  unsigned int next[256];
+  for (int byte = 0; byte < 256; byte++) {
+    next[byte] = counts[byte];
+  }
+  vector<AnsDecodeEntry> table(table_size);
+  for (unsigned int state = 0; state < table_size; state++) {
+    unsigned char byte = symbols[state];
+    unsigned int encoder_state = next[byte]++;
+    int bits = table_log - HighBit(encoder_state);
+    table[state].byte = byte;
+    table[state].bits = (unsigned char) bits;
+    table[state].next =
+        (unsigned short) ((encoder_state << bits) - table_size);
+  }
+
+  BitReader reader(data, size);
+  reader.ReadBits(8 - HighBit((unsigned char) data[0]));
+  unsigned int state[kAnsStates];
+  for (int k = 0; k < kAnsStates; k++) {
+    state[k] = reader.ReadBits(table_log);
+  }
+  // The entries of all the states are looked up before any of their bits
+  // are read, as only the reads depend on each other. Two states read at
+  // most 2 * kAnsMaxTableLog bits, so 32 bits are left for the second of
+  // them after every refill.
+  const AnsDecodeEntry* entries = &table[0];
+  unsigned int i = 0;
+  for (; i + kAnsStates <= bytes; i += kAnsStates) {
+    AnsDecodeEntry current[kAnsStates];
+    for (int k = 0; k < kAnsStates; k++) {
+      current[k] = entries[state[k]];
+      output[i + k] = (char) current[k].byte;
+    }
+    for (int k = 0; k < kAnsStates; k += 2) {
+      reader.Refill();
+      state[k] = NextAnsState(reader, current[k]);
+      state[k + 1] = NextAnsState(reader, current[k + 1]);
+    }
+  }
+  for (; i < bytes; i++) {
+    unsigned int& current = state[i % kAnsStates];
+    output[i] = (char) entries[current].byte;
+    reader.Refill();
+    current = NextAnsState(reader, entries[current]);
+  }
+  // The encoder starts every state at the start of the table.
+  for (int k = 0; k < kAnsStates; k++) {
+    if (state[k] != 0) {
+      return false;
+    }
+  }
+  return !reader.Overrun();
+}
@@ -0,0 +1,90 @@
+// A table-based asymmetric numeral system coder (tANS) for bytes, which
+// codes every byte in close to the number of bits that its probability
+// calls for, even when that is well below one bit.
+#ifndef ANS_H_
+#define ANS_H_
+
+#include "bit_reader.h"
+#include "bit_writer.h"
+
+#include <cstddef>
+#include <vector>
+
+using std::vector;
+
+// The smallest and largest number of bits of a coding state. The coding
+// table has 2^table_log states, and the counts of the bytes are scaled to
+// add up to that number. Decoding takes a lookup in a table with an entry
+// for every state, which stays in the first level cache at the largest size.
+const int kAnsMinTableLog = 5;
+const int kAnsMaxTableLog = 12;
+
+// The number of coding states that take turns coding the bytes of some
+// data. Each state is updated from its own lookups, so the decoder works
+// on all of them at the same time.
+const int kAnsStates = 4;
+
+// Returns the number of bits of the coding states for "size" bytes that are
+// counted in "frequencies", a table of 256 entries indexed by byte value.
+// Small inputs get smaller tables, which take less time to build and fewer
+// bits to describe, but the table always has at least as many states as
+// there are distinct bytes. Returns 0 if no byte is counted, as there is
+// nothing to code.
+int AnsTableLog(const unsigned int* frequencies, unsigned int size);
+
+// Scales the counts of the "size" bytes in "frequencies" so that they add
+// up to 2^table_log, and stores them in "counts". Every byte that occurs
+// keeps a count of at least 1. The counts are rounded to the nearest value
+// and then moved by one at a time where that costs the fewest bits.
+// Returns false if no byte is counted, as the counts cannot add up then.
+bool NormalizeAnsCounts(const unsigned int* frequencies,
+                        unsigned int size,
+                        int table_log,
+                        unsigned short* counts);
+
+// Returns the number of bits that the bytes counted in "frequencies" are
+// expected to take when they are coded with the scaled counts "counts",
+// without the coding states that are written along with them.
+double AnsEncodedBits(const unsigned int* frequencies,
+                      const unsigned short* counts,
+                      int table_log);
+
+// Writes "table_log" and the scaled counts of the 256 byte values to
+// "writer". Each count takes as many bits as are needed to hold the part
+// of 2^table_log that the counts before it leave, and the counts stop when
+// nothing is left. A count of 0 is followed by the number of zero counts
+// that follow it.
+void EncodeAnsCounts(const unsigned short* counts,
+                     int table_log,
+                     BitWriter& writer);
+
+// Reads the scaled counts written by "EncodeAnsCounts" from "reader" into
+// "counts" and "table_log". Returns false if they are not valid.
+bool DecodeAnsCounts(BitReader& reader,
+                     unsigned short* counts,
+                     int& table_log);
+
+// Returns the number of bytes that "EncodeAnsCounts" writes.
+unsigned int AnsCountsSize(const unsigned short* counts, int table_log);
+
+// Codes the "size" bytes at "data" with the scaled counts "counts" and
+// stores the result in "output". The bytes are coded with kAnsStates
+// states in turn, from the last byte to the first, so that they are decoded
+// from the first byte to the last.
+void AnsEncode(const char* data,
+               unsigned int size,
+               const unsigned short* counts,
+               int table_log,
+               vector<char>& output);
+
+// Decodes "bytes" bytes from the "size" bytes at "data", which were coded by
+// "AnsEncode" with the same counts, and stores them in "output". Returns
+// false if the data is not valid or does not hold exactly that many bytes.
+bool AnsDecode(const char* data,
+               size_t size,
+               const unsigned short* counts,
+               int table_log,
+               char* output,
+               unsigned int bytes);
+
+#endif // ANS_H_
@@ -0,0 +1,444 @@
+// A benchmark of Huffman encoding and decoding on generated data.
+//
+//   benchmark [megabytes] [corpus...]
+//
+// Every corpus is generated from a fixed seed, so the same arguments give the
+// same data on every run and every machine. Each corpus is encoded and
+// decoded with several configurations, and for each of them the program
+// prints the encoding and decoding speed, the compression ratio, the number
+// of bytes taken by block headers and code lengths, and the peak resident
+// memory of the process so far. Corpora are run in the order given, so a
+// single corpus per run gives the peak memory of that corpus alone.
+#include "huffman.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+
+// A small pseudorandom number generator (xorshift64*) whose output does not
+// depend on the standard library.
+class Random {
+public:
+  Random(unsigned long long seed) : state_(seed) {}
+
+  unsigned long long Next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 2685821657736338717ull;
+  }
+
+  // Returns a number from 0 to "limit" - 1.
+  unsigned int Below(unsigned int limit) {
+    return (unsigned int) ((Next() >> 32) % limit);
+  }
+
+  // Returns a number from 0 to 1, excluding 1.
+  double Fraction() {
+    return (Next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+private:
+  unsigned long long state_;
+};
+
+// Picks indexes from 0 to "count" - 1 where index i is picked with a
+// probability proportional to 1 / (i + 1)^exponent.
+class ZipfSampler {
+public:
+  ZipfSampler(int count, double exponent) : cumulative_(count) {
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+      total += 1.0 / pow(i + 1.0, exponent);
+      cumulative_[i] = total;
+    }
+    for (int i = 0; i < count; i++) {
+      cumulative_[i] /= total;
+    }
+  }
+
+  int Sample(Random& random) const {
+    double value = random.Fraction();
+    int low = 0;
+    int high = (int) cumulative_.size() - 1;
+    while (low < high) {
+      int middle = (low + high) / 2;
+      if (cumulative_[middle] <= value) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    return low;
+  }
+
+private:
+  vector<double> cumulative_;
+};
+
+// Fills "data" with "size" bytes that are all equally likely.
+void GenerateRandom(size_t size, string& data) {
+  Random random(1);
+  data.resize(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (char) random.Below(256);
+  }
+}
+
+// Fills "data" with "size" bytes that follow a Zipf distribution, so that a
+// few byte values make up most of the data.
+void GenerateZipf(size_t size, string& data) {
+  Random random(2);
+  ZipfSampler sampler(256, 1.1);
+  // The byte values are shuffled so that the frequent ones are not simply
+  // the smallest ones.
+  unsigned char bytes[256];
+  for (int i = 0; i < 256; i++) {
+    bytes[i] = (unsigned char) i;
+  }
+  for (int i = 255; i > 0; i--) {
+    int j = random.Below(i + 1);
+    unsigned char byte = bytes[i];
+    bytes[i] = bytes[j];
+    bytes[j] = byte;
+  }
+  data.resize(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (char) bytes[sampler.Sample(random)];
+  }
+}
+
+// Fills "data" with "size" bytes of text that resembles English, made of
+// words that are picked with a Zipf distribution and formed into sentences
+// and lines.
+void GenerateText(size_t size, string& data) {
+  static const char* const kWords[] = {
+    "the", "of", "and", "to", "a", "in", "is", "it", "you", "that", "he",
+    "was", "for", "on", "are", "with", "as", "his", "they", "be", "at",
+    "one", "have", "this", "from", "or", "had", "by", "not", "word", "but",
+    "what", "some", "we", "can", "out", "other", "were", "all", "there",
+    "when", "up", "use", "your", "how", "said", "an", "each", "she", "which",
+    "do", "their", "time", "if", "will", "way", "about", "many", "then",
+    "them", "write", "would", "like", "so", "these", "her", "long", "make",
+    "thing", "see", "him", "two", "has", "look", "more", "day", "could",
+    "go", "come", "did", "number", "sound", "no", "most", "people", "my",
+    "over", "know", "water", "than", "call", "first", "who", "may", "down",
+    "side", "been", "now", "find", "encoding", "huffman", "block", "table",
+    "stream", "decoder", "frequency", "symbol", "compression", "quickly",
+  };
+  const int word_count = sizeof(kWords) / sizeof(kWords[0]);
+  Random random(3);
+  ZipfSampler sampler(word_count, 1.0);
+  data.clear();
+  data.reserve(size + 32);
+  bool sentence_start = true;
+  size_t line_length = 0;
+  while (data.size() < size) {
+    string word = kWords[sampler.Sample(random)];
+    if (sentence_start) {
+      word[0] = (char) (word[0] - 'a' + 'A');
+      sentence_start = false;
+    }
+    data += word;
+    line_length += word.size() + 1;
+    unsigned int punctuation = random.Below(100);
+    if (punctuation < 7) {
+      data += '.';
+      sentence_start = true;
+    } else if (punctuation < 12) {
+      data += ',';
+    }
+    if (line_length > 72) {
+      data += '\n';
+      line_length = 0;
+    } else {
+      data += ' ';
+    }
+  }
+  data.resize(size);
+}
+
+// Fills "data" with "size" bytes of binary records, as found in databases
+// and program files: little-endian counters, small numbers, flags and
+// floating point values, with runs of zeros in between.
+void GenerateBinary(size_t size, string& data) {
+  Random random(4);
+  data.clear();
+  data.reserve(size + 32);
+  unsigned int counter = 1000;
+  while (data.size() < size) {
+    counter += 1 + random.Below(4);
+    unsigned int value = random.Below(1000);
+    unsigned int flags = random.Below(4) == 0 ? 0x80000001u : 1u;
+    float measure = (float) (random.Fraction() * 100.0);
+    unsigned int fields[4] = {counter, value, flags, 0};
+    for (int field = 0; field < 4; field++) {
+      for (int byte = 0; byte < 4; byte++) {
+        data += (char) (fields[field] >> (8 * byte));
+      }
+    }
+    const unsigned char* measure_bytes = (const unsigned char*) &measure;
+    data.append((const char*) measure_bytes, sizeof(measure));
+    data.append(4 * random.Below(4), '\0');
+  }
+  data.resize(size);
+}
+
+// Fills "data" with "size" bytes of sensor readings that rarely change, as
+// in telemetry streams, where one or two byte values make up almost all of
+// the data and a Huffman code still spends a bit on every byte.
+void GenerateTelemetry(size_t size, string& data) {
+  Random random(5);
+  data.resize(size);
+  for (size_t i = 0; i < size; i++) {
+    unsigned int value = random.Below(1000);
+    if (value < 930) {
+      data[i] = 0;
+    } else if (value < 980) {
+      data[i] = (char) 0xff;
+    } else {
+      data[i] = (char) (1 + random.Below(16));
+    }
+  }
+}
+
+// Fills "data" with "size" bytes of little-endian 16-bit samples of a
+// signal that drifts slowly and has some noise, as read from a sensor. The
+// samples take a few thousand values, but their low bytes take all 256.
+void GenerateSamples(size_t size, string& data) {
+  Random random(6);
+  data.resize(size);
+  double level = 20000;
+  for (size_t i = 0; i + 1 < size; i += 2) {
+    level += (random.Fraction() - 0.5) * 4;
+    double noise = (random.Fraction() + random.Fraction() +
+                    random.Fraction() - 1.5) * 300;
+    unsigned int sample = (unsigned int) (level + noise) & 0xffff;
+    data[i] = (char) sample;
+    data[i + 1] = (char) (sample >> 8);
+  }
+  if (size % 2 == 1) {
+    data[size - 1] = 0;
+  }
+}
+
+// Fills "data" with "size" copies of the same byte.
+void GenerateSame(size_t size, string& data) {
+  data.assign(size, 'a');
+}
+
+// Fills "data" with a single byte, the smallest data that has a code.
+void GenerateSingle(size_t /* size */, string& data) {
+  data.assign(1, 'a');
+}
+
+// A corpus that the benchmark can generate.
+struct Corpus {
+  const char* name;
+  void (*generate)(size_t size, string& data);
+};
+
+const Corpus kCorpora[] = {
+  {"random", GenerateRandom},
+  {"zipf", GenerateZipf},
+  {"text", GenerateText},
+  {"binary", GenerateBinary},
+  {"telemetry", GenerateTelemetry},
+  {"samples", GenerateSamples},
+  {"same", GenerateSame},
+  {"single", GenerateSingle},
+};
+
+// A set of encoding options that is benchmarked on every corpus.
+struct Configuration {
+  const char* name;
+  HuffmanEncodeOptions options;
+  unsigned int decode_threads;
+};
+
+// Returns the configurations that are benchmarked.
+vector<Configuration> Configurations() {
+  vector<Configuration> configurations;
+  Configuration configuration;
+  configuration.decode_threads = 1;
+  configuration.options.threads = 1;
+
+  configuration.name = "default";
+  configurations.push_back(configuration);
+
+  configuration.name = "64k-blocks";
+  configuration.options.block_size = 1 << 16;
+  configurations.push_back(configuration);
+  configuration.options.block_size = kHuffmanDefaultBlockSize;
+
+  configuration.name = "interleaved";
+  configuration.options.interleaved_streams = true;
+  configurations.push_back(configuration);
+  configuration.options.interleaved_streams = false;
+
+  configuration.name = "unlimited";
+  configuration.options.max_code_length = 0;
+  configurations.push_back(configuration);
+  configuration.options.max_code_length = kHuffmanDefaultMaxCodeLength;
+
+  configuration.name = "context-16";
+  configuration.options.context_clusters = 16;
+  configurations.push_back(configuration);
+  configuration.options.context_clusters = 0;
+
+  configuration.name = "lz77-1";
+  configuration.options.match_level = 1;
+  configurations.push_back(configuration);
+
+  configuration.name = "lz77-6";
+  configuration.options.match_level = 6;
+  configurations.push_back(configuration);
+  configuration.options.match_level = 0;
+
+  configuration.name = "bwt";
+  configuration.options.block_sorting = true;
+  configurations.push_back(configuration);
+  configuration.options.block_sorting = false;
+
+  configuration.name = "ans";
+  configuration.options.ans_coding = true;
+  configurations.push_back(configuration);
+  configuration.options.ans_coding = false;
+
+  configuration.name = "wide";
+  configuration.options.wide_symbols = true;
+  configurations.push_back(configuration);
+  configuration.options.wide_symbols = false;
+
+  configuration.name = "all-threads";
+  configuration.options.threads = 0;
+  configuration.decode_threads = 0;
+  configurations.push_back(configuration);
+  return configurations;
+}
+
+// Returns the largest amount of memory, in bytes, that the process has held
+// in physical memory so far.
+size_t PeakResidentMemory() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return (size_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Returns the number of seconds since some fixed point in time.
+double Now() {
+  return chrono::duration<double>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The shortest time, in seconds, that every measurement is repeated for.
+// The fastest repetition is reported.
+const double kMinMeasureTime = 0.5;
+
+// Benchmarks "configuration" on "data" and prints a line with the results.
+// Returns false if the data does not decode to the original.
+bool RunConfiguration(const string& data, const Configuration& configuration) {
+  string encoded;
+  string decoded;
+  double encode_time = 1e30;
+  double start = Now();
+  do {
+    double begin = Now();
+    HuffmanEncodeString(data, encoded, configuration.options);
+    double time = Now() - begin;
+    encode_time = time < encode_time ? time : encode_time;
+  } while (Now() - start < kMinMeasureTime);
+
+  double decode_time = 1e30;
+  bool valid = true;
+  start = Now();
+  do {
+    double begin = Now();
+    valid = HuffmanDecodeString(encoded, decoded,
+                                configuration.decode_threads) && valid;
+    double time = Now() - begin;
+    decode_time = time < decode_time ? time : decode_time;
+  } while (Now() - start < kMinMeasureTime);
+  valid = valid && decoded == data;
+
+  size_t header_size = 0;
+  HuffmanHeaderSize(encoded.data(), encoded.size(), header_size);
+  double megabytes = data.size() / 1e6;
+  printf("  %-12s %9.1f %9.1f %8.4f %10lu %8.1f%s\n",
+         configuration.name,
+         megabytes / encode_time,
+         megabytes / decode_time,
+         (double) encoded.size() / data.size(),
+         (unsigned long) header_size,
+         PeakResidentMemory() / 1e6,
+         valid ? "" : "  DECODING FAILED");
+  return valid;
+}
+
+int main(int argc, char* argv[]) {
+  size_t megabytes = argc >= 2 ? strtoul(argv[1], NULL, 10) : 16;
+  if (megabytes == 0) {
+    fprintf(stderr, "usage: %s [megabytes] [corpus...]\n", argv[0]);
+    return 1;
+  }
+  vector<const Corpus*> corpora;
+  const int corpus_count = sizeof(kCorpora) / sizeof(kCorpora[0]);
+  for (int arg = 2; arg < argc; arg++) {
+    const Corpus* corpus = NULL;
+    for (int i = 0; i < corpus_count; i++) {
+      if (string(argv[arg]) == kCorpora[i].name) {
+        corpus = &kCorpora[i];
+      }
+    }
+    if (corpus == NULL) {
+      fprintf(stderr, "unknown corpus \"%s\"\n", argv[arg]);
+      return 1;
+    }
+    corpora.push_back(corpus);
+  }
+  if (corpora.empty()) {
+    for (int i = 0; i < corpus_count; i++) {
+      corpora.push_back(&kCorpora[i]);
+    }
+  }
+
+  vector<Configuration> configurations = Configurations();
+  bool valid = true;
+  for (size_t i = 0; i < corpora.size(); i++) {
+    string data;
+    corpora[i]->generate(megabytes << 20, data);
+    printf("%s, %lu bytes\n", corpora[i]->name, (unsigned long) data.size());
+    printf("  %-12s %9s %9s %8s %10s %8s\n", "config", "enc MB/s",
+           "dec MB/s", "ratio", "headers", "peak MB");
+    for (size_t j = 0; j < configurations.size(); j++) {
+      valid = RunConfiguration(data, configurations[j]) && valid;
+    }
+  }
+  return valid ? 0 : 1;
+}
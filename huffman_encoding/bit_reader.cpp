@@ -0,0 +1,55 @@
+// This file contains implementations of the methods in "bit_reader.h".
+#include "bit_reader.h"
+
+BitReader::BitReader(const char* data, size_t size) {
+  this->data_ = data;
+  this->size_ = size;
+  this->position_ = 0;
+  this->accumulator_ = 0;
+  this->bit_count_ = 0;
+  this->consumed_bits_ = 0;
+  this->total_bits_ = (unsigned long long) size * 8;
+  this->source_ = NULL;
+  this->buffer_ = NULL;
+}
+
+BitReader::BitReader(ReadStream* read_stream) {
+  this->buffer_ = new char[STREAM_BUFFER_SIZE];
+  this->data_ = buffer_;
+  this->size_ = 0;
+  this->position_ = 0;
+  this->accumulator_ = 0;
+  this->bit_count_ = 0;
+  this->consumed_bits_ = 0;
+  this->total_bits_ = 0;
+  this->source_ = read_stream;
+}
+
+BitReader::~BitReader() {
+  delete [] buffer_;
+}
+
+void BitReader::RefillSlow() {
+  while (bit_count_ < 56) {
+    if (position_ >= size_ && !FillBuffer()) {
+      // Past the end of the input. The accumulator is already filled with
+      // "0"s, so just pretend that another zero byte has been read.
+      bit_count_ += 8;
+      continue;
+    }
+    unsigned long long byte = (unsigned char) data_[position_++];
+    accumulator_ |= byte << (56 - bit_count_);
+    bit_count_ += 8;
+  }
+}
+
+bool BitReader::FillBuffer() {
+  if (source_ == NULL) {
+    return false;
+  }
+  size_t bytes = source_->ReadBytes(buffer_, STREAM_BUFFER_SIZE);
+  size_ = bytes;
+  position_ = 0;
+  total_bits_ += (unsigned long long) bytes * 8;
+  return bytes > 0;
+}
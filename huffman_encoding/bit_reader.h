@@ -0,0 +1,87 @@
+// A reader for sequences of bits that can look ahead several bits at once.
+#ifndef BIT_READER_H_
+#define BIT_READER_H_
+
+#include "read_write_streams.h"
+
+#include <cstddef>
+
+// Reads bits most significant bit first, matching the bit order of the
+// streams in "read_write_streams.h". Up to 56 bits are kept in a 64 bit
+// accumulator so that callers can look at the next few bits of the input
+// with "PeekBits" before deciding how many of them to consume with
+// "SkipBits". Bits past the end of the input read as "0"s.
+//
+// The bits are taken either from an in-memory buffer or from a ReadStream.
+// In the latter case the stream is read byte by byte into an internal buffer
+// of STREAM_BUFFER_SIZE bytes.
+class BitReader {
+public:
+  BitReader(const char* data, size_t size);
+  BitReader(ReadStream* read_stream);
+  ~BitReader();
+
+  // Makes sure that at least 56 bits are available in the accumulator
+  // unless the end of the input has been reached.
+  void Refill() {
+    if (position_ + 8 <= size_) {
+      // Fast path: load the next 8 bytes and keep as many whole bytes of them
+      // as fit in the accumulator.
+      const unsigned char* bytes = (const unsigned char*) data_ + position_;
+      unsigned long long word = 0;
+      for (int i = 0; i < 8; i++) {
+        word = (word << 8) | bytes[i];
+      }
+      accumulator_ |= word >> bit_count_;
+      position_ += (63 - bit_count_) >> 3;
+      bit_count_ |= 56;
+    } else {
+      RefillSlow();
+    }
+  }
+
+  // Returns the next "bits" bits of the input without consuming them.
+  // "bits" must be between 1 and 32 and no larger than the number of bits
+  // guaranteed by the last call to "Refill".
+  unsigned int PeekBits(int bits) const {
+    return (unsigned int) (accumulator_ >> (64 - bits));
+  }
+
+  // Consumes "bits" bits that have already been looked at with "PeekBits".
+  void SkipBits(int bits) {
+    accumulator_ <<= bits;
+    bit_count_ -= bits;
+    consumed_bits_ += bits;
+  }
+
+  // Reads and consumes the next "bits" bits, where "bits" is at most 32.
+  unsigned int ReadBits(int bits) {
+    if (bit_count_ < bits) {
+      Refill();
+    }
+    unsigned int value = PeekBits(bits);
+    SkipBits(bits);
+    return value;
+  }
+
+  // Returns true if more bits have been consumed than the input contains.
+  bool Overrun() const {
+    return consumed_bits_ > total_bits_;
+  }
+
+private:
+  void RefillSlow();
+  bool FillBuffer();
+
+  const char* data_;
+  size_t size_;
+  size_t position_;
+  unsigned long long accumulator_;
+  int bit_count_;
+  unsigned long long consumed_bits_;
+  unsigned long long total_bits_;
+  ReadStream* source_;
+  char* buffer_;
+};
+
+#endif // BIT_READER_H_
@@ -0,0 +1,21 @@
+// This file contains implementations of the methods in "bit_writer.h".
+#include "bit_writer.h"
+
+BitWriter::BitWriter(char* buffer) {
+  this->buffer_ = buffer;
+  this->position_ = buffer;
+  this->accumulator_ = 0;
+  this->bit_count_ = 0;
+}
+
+size_t BitWriter::Finish() {
+  while (bit_count_ >= 8) {
+    bit_count_ -= 8;
+    *position_++ = (char) (accumulator_ >> bit_count_);
+  }
+  if (bit_count_ > 0) {
+    *position_++ = (char) (accumulator_ << (8 - bit_count_));
+    bit_count_ = 0;
+  }
+  return position_ - buffer_;
+}
@@ -0,0 +1,55 @@
+// A writer for sequences of bits that packs them into whole words.
+#ifndef BIT_WRITER_H_
+#define BIT_WRITER_H_
+
+#include <cstddef>
+
+// Writes bits most significant bit first, matching the bit order of the
+// streams in "read_write_streams.h". The bits are collected in a 64 bit
+// accumulator and stored 32 at a time into a buffer that is provided by the
+// caller and must be large enough to hold all written bits.
+class BitWriter {
+public:
+  BitWriter(char* buffer);
+
+  // Writes the lowest "bits" bits of "value", where "bits" is at most 32.
+  void WriteBits(unsigned int value, int bits) {
+    accumulator_ = (accumulator_ << bits) | value;
+    bit_count_ += bits;
+    if (bit_count_ >= 32) {
+      bit_count_ -= 32;
+      unsigned int word = (unsigned int) (accumulator_ >> bit_count_);
+      position_[0] = (char) (word >> 24);
+      position_[1] = (char) (word >> 16);
+      position_[2] = (char) (word >> 8);
+      position_[3] = (char) word;
+      position_ += 4;
+    }
+  }
+
+  // Writes the lowest "bits" bits of "value", where "bits" is at most 64.
+  void WriteLongBits(unsigned long long value, int bits) {
+    if (bits > 32) {
+      WriteBits((unsigned int) (value >> 32), bits - 32);
+      bits = 32;
+    }
+    WriteBits((unsigned int) (value & 0xffffffffu), bits);
+  }
+
+  // Stores the bits that are still in the accumulator, filling the last byte
+  // with "0"s if needed. Returns the total number of bytes written.
+  size_t Finish();
+
+  // Returns the number of bits written so far.
+  size_t BitsWritten() const {
+    return (position_ - buffer_) * 8 + bit_count_;
+  }
+
+private:
+  char* buffer_;
+  char* position_;
+  unsigned long long accumulator_;
+  int bit_count_;
+};
+
+#endif // BIT_WRITER_H_
@@ -0,0 +1,368 @@
+// This file contains implementations of the functions in "bwt.h".
+#include "bwt.h"
+#include "histogram.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+using std::vector;
+
+// The number of parts of the transformed bytes whose rows are filled in at
+// the same time by the inverse transform. Equal bytes, which often follow
+// each other after the transform, then update different counters instead of
+// waiting on the previous update to the same counter.
+static const int kFillParts = 4;
+
+// The number of segments that the inverse transform walks at the same time.
+// Their rows stay in registers, while all kBwtSegments of them would not
+// fit.
+static const int kWalkSegments = 8;
+
+// Stores in "buckets" where the bucket of every symbol of the "size" symbols
+// at "text", which are less than "symbols", starts, or ends if "ends" is
+// true.
+static void FindBuckets(const int* text,
+                        int size,
+                        int symbols,
+                        vector<int>& buckets,
+                        bool ends) {
+  buckets.assign(symbols, 0);
+  for (int i = 0; i < size; i++) {
+    buckets[text[i]]++;
+  }
+  int sum = 0;
+  for (int symbol = 0; symbol < symbols; symbol++) {
+    sum += buckets[symbol];
+    buckets[symbol] = ends ? sum : sum - buckets[symbol];
+  }
+}
+
+// Returns true if position "i" of a text with the suffix types "is_s" is a
+// leftmost S-type position, which starts an LMS substring.
+static inline bool IsLms(const vector<unsigned char>& is_s, int i) {
+  return i > 0 && is_s[i] && !is_s[i - 1];
+}
+
+// Sorts the L-type and then the S-type suffixes of "text" into
+// "suffix_array" from the suffixes that have been placed there.
+static void InduceSuffixes(const int* text,
+                           int size,
+                           int symbols,
+                           const vector<unsigned char>& is_s,
+                           int* suffix_array,
+                           vector<int>& buckets) {
+  FindBuckets(text, size, symbols, buckets, false);
+  for (int i = 0; i < size; i++) {
+    int j = suffix_array[i] - 1;
+    if (j >= 0 && !is_s[j]) {
+      suffix_array[buckets[text[j]]++] = j;
+    }
+  }
+  FindBuckets(text, size, symbols, buckets, true);
+  for (int i = size - 1; i >= 0; i--) {
+    int j = suffix_array[i] - 1;
+    if (j >= 0 && is_s[j]) {
+      suffix_array[--buckets[text[j]]] = j;
+    }
+  }
+}
+
+// Computes the suffix array of the "size" symbols at "text", which are less
+// than "symbols" and end with a 0 that occurs nowhere else, with SA-IS.
+//
+// The LMS substrings are sorted by inducing from their last symbols, and
+// named by their rank. If some names repeat, the suffix array of the string
+// of names is computed recursively. Then the LMS suffixes are placed in
+// their sorted order, and all the other suffixes are induced from them.
+static void SaIs(const int* text, int size, int symbols, int* suffix_array) {
+  vector<unsigned char> is_s(size);
+  is_s[size - 1] = 1;
+  for (int i = size - 2; i >= 0; i--) {
+    is_s[i] = text[i] < text[i + 1] ||
+              (text[i] == text[i + 1] && is_s[i + 1]);
+  }
+
+  vector<int> buckets;
+  FindBuckets(text, size, symbols, buckets, true);
+  std::fill(suffix_array, suffix_array + size, -1);
+  for (int i = 1; i < size; i++) {
+    if (IsLms(is_s, i)) {
+      suffix_array[--buckets[text[i]]] = i;
+    }
+  }
+  InduceSuffixes(text, size, symbols, is_s, suffix_array, buckets);
+
+  // Move the sorted LMS substrings to the front and name them. Two of them
+  // are equal if they have the same symbols and types up to their end. As
+  // no two LMS positions are adjacent, the name of the substring at position
+  // p can be kept at index lms_count + p / 2.
+  int lms_count = 0;
+  for (int i = 0; i < size; i++) {
+    if (IsLms(is_s, suffix_array[i])) {
+      suffix_array[lms_count++] = suffix_array[i];
+    }
+  }
+  std::fill(suffix_array + lms_count, suffix_array + size, -1);
+  int names = 0;
+  int previous = -1;
+  for (int i = 0; i < lms_count; i++) {
+    int position = suffix_array[i];
+    bool differs = false;
+    for (int d = 0; d < size; d++) {
+      if (previous == -1 ||
+          text[position + d] != text[previous + d] ||
+          is_s[position + d] != is_s[previous + d]) {
+        differs = true;
+        break;
+      }
+      if (d > 0 && (IsLms(is_s, position + d) || IsLms(is_s, previous + d))) {
+        break;
+      }
+    }
+    if (differs) {
+      names++;
+      previous = position;
+    }
+    suffix_array[lms_count + position / 2] = names - 1;
+  }
+  for (int i = size - 1, j = size - 1; i >= lms_count; i--) {
+    if (suffix_array[i] >= 0) {
+      suffix_array[j--] = suffix_array[i];
+    }
+  }
+
+  // Sort the LMS suffixes by the string of their names, which is kept at
+  // the end of the suffix array.
+  int* reduced_text = suffix_array + size - lms_count;
+  if (names < lms_count) {
+    SaIs(reduced_text, lms_count, names, suffix_array);
+  } else {
+    for (int i = 0; i < lms_count; i++) {
+      suffix_array[reduced_text[i]] = i;
+    }
+  }
+
+  // Place the sorted LMS suffixes at the ends of their buckets, in the same
+  // order, and induce the rest from them.
+  for (int i = 1, j = 0; i < size; i++) {
+    if (IsLms(is_s, i)) {
+      reduced_text[j++] = i;
+    }
+  }
+  for (int i = 0; i < lms_count; i++) {
+    suffix_array[i] = reduced_text[suffix_array[i]];
+  }
+  std::fill(suffix_array + lms_count, suffix_array + size, -1);
+  FindBuckets(text, size, symbols, buckets, true);
+  for (int i = lms_count - 1; i >= 0; i--) {
+    int position = suffix_array[i];
+    suffix_array[i] = -1;
+    suffix_array[--buckets[text[position]]] = position;
+  }
+  InduceSuffixes(text, size, symbols, is_s, suffix_array, buckets);
+}
+
+void BuildSuffixArray(const unsigned char* data,
+                      unsigned int size,
+                      int* suffix_array) {
+  // The bytes are shifted up by one to make room for the sentinel, whose
+  // suffix comes first and is left out of the result.
+  vector<int> text(size + 1);
+  for (unsigned int i = 0; i < size; i++) {
+    text[i] = data[i] + 1;
+  }
+  text[size] = 0;
+  vector<int> full_array(size + 1);
+  SaIs(&text[0], size + 1, 257, &full_array[0]);
+  for (unsigned int i = 0; i < size; i++) {
+    suffix_array[i] = full_array[i + 1];
+  }
+}
+
+unsigned int BwtSegmentStart(unsigned int size, int segment) {
+  unsigned int part = size / kBwtSegments + (size % kBwtSegments != 0);
+  unsigned long long start = (unsigned long long) part * segment;
+  return start < size ? (unsigned int) start : size;
+}
+
+void BurrowsWheelerTransform(const unsigned char* data,
+                             unsigned int size,
+                             unsigned char* output,
+                             unsigned int* rows) {
+  // Segments that start at the end of the data start at the empty suffix.
+  for (int segment = 0; segment < kBwtSegments; segment++) {
+    rows[segment] = 0;
+  }
+  if (size == 0) {
+    return;
+  }
+  vector<int> suffix_array(size);
+  BuildSuffixArray(data, size, &suffix_array[0]);
+  // The empty suffix comes first and is preceded by the last byte.
+  unsigned int part = BwtSegmentStart(size, 1);
+  unsigned int position = 0;
+  output[position++] = data[size - 1];
+  for (unsigned int i = 0; i < size; i++) {
+    unsigned int suffix = suffix_array[i];
+    if (suffix % part == 0) {
+      rows[suffix / part] = i + 1;
+    }
+    if (suffix != 0) {
+      output[position++] = data[suffix - 1];
+    }
+  }
+}
+
+// Takes "rounds" steps back from each of the kWalkSegments rows in "rows"
+// through the table "previous" of the inverse transform, and stores the
+// bytes before the positions in "ends", from the last one to the first one.
+// The rows that are reached are stored back in "rows".
+static void WalkSegments(const unsigned int* previous,
+                         unsigned int* rows,
+                         char* const* ends,
+                         unsigned int rounds) {
+  unsigned int current[kWalkSegments];
+  for (int segment = 0; segment < kWalkSegments; segment++) {
+    current[segment] = rows[segment];
+  }
+  for (ptrdiff_t round = 1; round <= (ptrdiff_t) rounds; round++) {
+    for (int segment = 0; segment < kWalkSegments; segment++) {
+      unsigned int entry = previous[current[segment]];
+      ends[segment][-round] = (char) entry;
+      current[segment] = entry >> 8;
+    }
+  }
+  for (int segment = 0; segment < kWalkSegments; segment++) {
+    rows[segment] = current[segment];
+  }
+}
+
+bool InverseBurrowsWheelerTransform(const unsigned char* data,
+                                    unsigned int size,
+                                    const unsigned int* rows,
+                                    char* output) {
+  unsigned int primary_index = rows[0];
+  if (size == 0) {
+    return primary_index == 0;
+  }
+  if (primary_index < 1 || primary_index > size) {
+    return false;
+  }
+  for (int segment = 1; segment < kBwtSegments; segment++) {
+    if (rows[segment] > size) {
+      return false;
+    }
+  }
+  // The rows of the transform are the "size" bytes with the sentinel
+  // inserted at the primary index. "Previous[r]" holds the byte of row r in
+  // its lowest 8 bits, and above them the row of the suffix that starts one
+  // byte before the suffix of row r, which is found from the number of
+  // smaller bytes and of equal bytes in earlier rows. Keeping both in one
+  // entry makes every step a single memory access. The parts of the bytes
+  // start at the rows that their bytes get after the bytes of the parts
+  // before them.
+  unsigned int part_size = size / kFillParts;
+  unsigned int counts[kFillParts][256] = {{0}};
+  for (int part = 0; part < kFillParts; part++) {
+    unsigned int start = part * part_size;
+    unsigned int end = part + 1 < kFillParts ? start + part_size : size;
+    CountBytes((const char*) data + start, end - start, counts[part]);
+  }
+  unsigned int starts[kFillParts][256];
+  unsigned int sum = 1;
+  for (int byte = 0; byte < 256; byte++) {
+    for (int part = 0; part < kFillParts; part++) {
+      starts[part][byte] = sum;
+      sum += counts[part][byte];
+    }
+  }
+  vector<unsigned int> previous(size + 1);
+  previous[primary_index] = 0;
+  for (unsigned int i = 0; i < part_size; i++) {
+    for (int part = 0; part < kFillParts; part++) {
+      unsigned int position = part * part_size + i;
+      unsigned char byte = data[position];
+      previous[position + (position >= primary_index)] =
+          (starts[part][byte]++ << 8) | byte;
+    }
+  }
+  for (unsigned int position = kFillParts * part_size; position < size;
+       position++) {
+    unsigned char byte = data[position];
+    previous[position + (position >= primary_index)] =
+        (starts[kFillParts - 1][byte]++ << 8) | byte;
+  }
+
+  // Every segment is recovered from its last byte to its first one, starting
+  // at the row of the next segment, or at row 0 of the empty suffix for the
+  // last segment, and must end at its own row. The walks take turns in
+  // groups while all of them have bytes left, and the last segment is the
+  // shortest one.
+  unsigned int current[kBwtSegments];
+  char* ends[kBwtSegments];
+  for (int segment = 0; segment < kBwtSegments; segment++) {
+    current[segment] = segment + 1 < kBwtSegments ? rows[segment + 1] : 0;
+    ends[segment] = output + BwtSegmentStart(size, segment + 1);
+  }
+  unsigned int rounds = BwtSegmentStart(size, kBwtSegments) -
+                        BwtSegmentStart(size, kBwtSegments - 1);
+  for (int group = 0; group < kBwtSegments; group += kWalkSegments) {
+    WalkSegments(&previous[0], current + group, ends + group, rounds);
+  }
+  for (int segment = 0; segment < kBwtSegments; segment++) {
+    char* begin = output + BwtSegmentStart(size, segment);
+    char* position = ends[segment] - rounds;
+    unsigned int row = current[segment];
+    while (position > begin) {
+      unsigned int entry = previous[row];
+      *--position = (char) entry;
+      row = entry >> 8;
+    }
+    if (row != rows[segment]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MoveToFrontEncode(const unsigned char* data,
+                       unsigned int size,
+                       vector<unsigned short>& symbols) {
+  symbols.clear();
+  unsigned char list[256];
+  for (int byte = 0; byte < 256; byte++) {
+    list[byte] = (unsigned char) byte;
+  }
+  unsigned int run = 0;
+  for (unsigned int i = 0; i <= size; i++) {
+    if (i < size && data[i] == list[0]) {
+      run++;
+      continue;
+    }
+    if (run > 0) {
+      // Write the run in bijective base 2, where a digit of 1 adds the
+      // current power of 2 and a digit of 2 adds twice that.
+      unsigned int rest = run - 1;
+      while (true) {
+        symbols.push_back((rest & 1) ? kBwtRunB : kBwtRunA);
+        if (rest < 2) {
+          break;
+        }
+        rest = (rest - 2) / 2;
+      }
+      run = 0;
+    }
+    if (i == size) {
+      break;
+    }
+    unsigned char byte = data[i];
+    int index = 1;
+    while (list[index] != byte) {
+      index++;
+    }
+    std::copy_backward(list, list + index, list + index + 1);
+    list[0] = byte;
+    symbols.push_back((unsigned short) (index + 1));
+  }
+}
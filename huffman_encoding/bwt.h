@@ -0,0 +1,144 @@
+// The Burrows-Wheeler transform and the move-to-front coding that follows it,
+// which turn data with repeated contexts into runs of small numbers that a
+// Huffman code can code well.
+#ifndef BWT_H_
+#define BWT_H_
+
+#include <cstring>
+#include <vector>
+
+using std::vector;
+
+// The symbols of move-to-front coded data. Runs of zeros are written as
+// sequences of kBwtRunA and kBwtRunB, and any other index v from 1 to 255 as
+// the symbol v + 1.
+const int kBwtRunA = 0;
+const int kBwtRunB = 1;
+const int kBwtSymbols = 257;
+
+// The largest number of bytes that the transform is applied to at once. The
+// inverse transform keeps a row number and a byte in 32 bits for every byte.
+const unsigned int kBwtMaxSize = (1u << 24) - 1;
+
+// Computes the suffix array of the "size" bytes at "data" and stores it in
+// "suffix_array", which must have room for "size" entries. The suffixes are
+// sorted with the SA-IS algorithm of Nong, Zhang and Chan in linear time,
+// with a suffix that is a prefix of another suffix sorted first.
+void BuildSuffixArray(const unsigned char* data,
+                      unsigned int size,
+                      int* suffix_array);
+
+// The number of segments of the data whose bytes the inverse transform
+// recovers at the same time. Each step of the inverse transform looks up a
+// row that is known only after the step before it, so a single walk waits on
+// memory for every byte, while several walks wait for their lookups together.
+const int kBwtSegments = 16;
+
+// Returns the offset of segment "segment" of "size" bytes of data. The
+// segment ends where the next one starts, and the offset for kBwtSegments
+// is "size".
+unsigned int BwtSegmentStart(unsigned int size, int segment);
+
+// Applies the Burrows-Wheeler transform to the "size" bytes at "data", which
+// must be at most kBwtMaxSize, and stores the "size" transformed bytes in
+// "output". The data is taken to end with a sentinel that is smaller than
+// every byte. The transform lists the byte before every suffix of the data
+// and the sentinel, in the order of the suffixes, which is their row, except
+// for the sentinel itself. The row of the empty suffix is 0. The rows of the
+// suffixes that start at the kBwtSegments segments of the data are stored in
+// "rows". Row 0 of them is that of the whole data, where the sentinel is
+// left out, and it is at least 1 unless the data is empty.
+void BurrowsWheelerTransform(const unsigned char* data,
+                             unsigned int size,
+                             unsigned char* output,
+                             unsigned int* rows);
+
+// Undoes "BurrowsWheelerTransform" for the "size" transformed bytes at
+// "data" with the rows of the segments in "rows", and stores the original
+// data in "output". The segments are recovered at the same time. Returns
+// false if the transform is not valid.
+bool InverseBurrowsWheelerTransform(const unsigned char* data,
+                                    unsigned int size,
+                                    const unsigned int* rows,
+                                    char* output);
+
+// Replaces every one of the "size" bytes at "data" by its index in a list of
+// the 256 byte values that starts in order and has every byte moved to its
+// front after it is coded, and stores the indexes as symbols in "symbols".
+// A run of n zeros is written as the digits of n in bijective base 2, lowest
+// digit first, with kBwtRunA for the digit 1 and kBwtRunB for the digit 2.
+void MoveToFrontEncode(const unsigned char* data,
+                       unsigned int size,
+                       vector<unsigned short>& symbols);
+
+// Undoes "MoveToFrontEncode" one symbol at a time, so that symbols can be
+// decoded as they are read, and stores the bytes in a buffer of a known
+// size. The methods are defined here so that they can be inlined into the
+// decoding loop.
+class MoveToFrontDecoder {
+public:
+  MoveToFrontDecoder(unsigned char* output, unsigned int size)
+      : output_(output), size_(size), count_(0), run_(0), weight_(1) {
+    for (int byte = 0; byte < 256; byte++) {
+      list_[byte] = (unsigned char) byte;
+    }
+  }
+
+  // Returns true if the symbols so far make up all the bytes.
+  bool Done() const {
+    return count_ + run_ == size_;
+  }
+
+  // Decodes "symbol", which must be less than kBwtSymbols. Returns false if
+  // the symbols make up more bytes than there are. A run of zeros is only
+  // stored when the symbol after it or "Finish" ends it.
+  bool Decode(int symbol) {
+    if (symbol <= kBwtRunB) {
+      run_ += weight_ << symbol;
+      weight_ <<= 1;
+      return run_ <= size_ - count_;
+    }
+    if (run_ != 0) {
+      FinishRun();
+    }
+    if (count_ == size_) {
+      return false;
+    }
+    // Most indexes are small, so short moves of the list are done a byte
+    // at a time.
+    int index = symbol - 1;
+    unsigned char byte = list_[index];
+    output_[count_++] = byte;
+    if (index < 16) {
+      for (int i = index; i > 0; i--) {
+        list_[i] = list_[i - 1];
+      }
+    } else {
+      memmove(list_ + 1, list_, index);
+    }
+    list_[0] = byte;
+    return true;
+  }
+
+  // Stores the run of zeros that the last symbols ended with.
+  void Finish() {
+    FinishRun();
+  }
+
+private:
+  void FinishRun() {
+    memset(output_ + count_, list_[0], (size_t) run_);
+    count_ += (unsigned int) run_;
+    run_ = 0;
+    weight_ = 1;
+  }
+
+  unsigned char* output_;
+  unsigned int size_;
+  unsigned int count_;
+  unsigned long long run_;
+  unsigned long long weight_;
+  unsigned char list_[256];
+};
+
+#endif // BWT_H_
@@ -0,0 +1,84 @@
+// This file contains implementations of the functions in "histogram.h".
+#include "histogram.h"
+
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using std::thread;
+using std::vector;
+
+// Inputs are not split among threads into parts smaller than this.
+static const size_t kMinBytesPerThread = 1 << 20;
+
+// Counts the bytes in [data, end) into the four tables in "tables", which
+// hold 4 * 256 counters. The bytes are read 8 at a time.
+static void CountBytesInterleaved(const unsigned char* data,
+                                  const unsigned char* end,
+                                  unsigned int* tables) {
+  unsigned int* table0 = tables;
+  unsigned int* table1 = tables + 256;
+  unsigned int* table2 = tables + 512;
+  unsigned int* table3 = tables + 768;
+  while (end - data >= 8) {
+    unsigned long long word;
+    memcpy(&word, data, 8);
+    table0[word & 255]++;
+    table1[(word >> 8) & 255]++;
+    table2[(word >> 16) & 255]++;
+    table3[(word >> 24) & 255]++;
+    table0[(word >> 32) & 255]++;
+    table1[(word >> 40) & 255]++;
+    table2[(word >> 48) & 255]++;
+    table3[word >> 56]++;
+    data += 8;
+  }
+  while (data < end) {
+    table0[*data++]++;
+  }
+}
+
+void CountBytes(const char* data, size_t size, unsigned int* counts) {
+  vector<unsigned int> tables(4 * 256, 0);
+  const unsigned char* bytes = (const unsigned char*) data;
+  CountBytesInterleaved(bytes, bytes + size, &tables[0]);
+  for (int byte = 0; byte < 256; byte++) {
+    counts[byte] += tables[byte] + tables[256 + byte] +
+                    tables[512 + byte] + tables[768 + byte];
+  }
+}
+
+void CountBytesParallel(const char* data,
+                        size_t size,
+                        unsigned int* counts,
+                        unsigned int threads) {
+  if (threads == 0) {
+    threads = thread::hardware_concurrency();
+  }
+  if (threads > size / kMinBytesPerThread) {
+    threads = size / kMinBytesPerThread;
+  }
+  if (threads <= 1) {
+    CountBytes(data, size, counts);
+    return;
+  }
+
+  // Every thread counts its part into its own 256 counters.
+  vector<unsigned int> partial_counts(threads * 256, 0);
+  vector<thread> workers;
+  size_t part_size = size / threads;
+  for (unsigned int i = 0; i < threads; i++) {
+    size_t begin = i * part_size;
+    size_t part_end = (i == threads - 1) ? size : begin + part_size;
+    workers.push_back(thread(CountBytes,
+                             data + begin,
+                             part_end - begin,
+                             &partial_counts[i * 256]));
+  }
+  for (unsigned int i = 0; i < threads; i++) {
+    workers[i].join();
+    for (int byte = 0; byte < 256; byte++) {
+      counts[byte] += partial_counts[i * 256 + byte];
+    }
+  }
+}
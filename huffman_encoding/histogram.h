@@ -0,0 +1,25 @@
+// Functions for counting the number of occurrences of each byte value in
+// a buffer of binary data.
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <cstddef>
+
+// Adds the number of occurrences of each byte value among the "size" bytes
+// at "data" to "counts", which is indexed by byte value and has 256 entries.
+//
+// The bytes are counted in four separate tables that are summed at the end.
+// Consecutive equal bytes then update different counters instead of waiting
+// on the previous update to the same counter.
+void CountBytes(const char* data, size_t size, unsigned int* counts);
+
+// Does the same as "CountBytes", but splits the input into "threads" parts
+// that are counted in parallel and then merged. Inputs that are too small
+// to benefit from this are counted on the calling thread. If "threads" is 0,
+// the number of hardware threads is used.
+void CountBytesParallel(const char* data,
+                        size_t size,
+                        unsigned int* counts,
+                        unsigned int threads);
+
+#endif // HISTOGRAM_H_
@@ -2,274 +2,3641 @@
 //
 // The binary format used for Huffman encoded data is defined as follows:
 //
-// Encoded data is divided into two parts:
-//   1) Header - contains the necessary data to construct a Huffman tree.
-//   2) Body - the binary data that has been encoded with the Huffman tree
-//             encoded in the Header.
+// Encoded data is a sequence of blocks. Each block encodes a consecutive
+// part of the input independently of the other blocks, so blocks can be
+// encoded and decoded in parallel.
 //
 //               ______________
 //              |              |
-//              |    Header    |
+//              |   Block 1    |
 //              |______________|
 //              |              |
-//              |     Body     |
+//              |   Block 2    |
 //              |______________|
+//              |              |
+//              |     ....     |
+//              |______________|
+//              |              |
+//              |   Block n    |
+//              |______________|
+//
+// A block starts with a byte of flags, followed by a variable length integer
+// (size) that specifies the number of bytes of data in the block before
+// Huffman encoding and another variable length integer (payload) that
+// specifies the number of bytes in the rest of the block. A variable length
+// integer is stored 7 bits per byte, least significant bits first. The
+// highest bit of every byte is set if more bytes follow. The integers take
+// up to 10 bytes, so there is no limit on the size of the data as a whole.
+// The flags are:
+//
+//   bit 0 (least significant): set for the last block.
+//   bit 1: set if the block uses the code of the previous block. The
+//          payload then does not contain code lengths.
+//   bit 2: set if the body of the block is split into interleaved streams.
+//   bit 3: set for the block index (see below), which is always the last
+//          block and has a size of 0.
+//   bits 4 to 6: the coding method of the block.
+//   bit 7: always 0.
+//
+// The coding methods are:
+//
+//   0: a Huffman code, as described below.
+//   1: order-1 context modeling (see below).
+//   2: stored. The payload holds the bytes of the block as they are.
+//   3: LZ77 matches (see below).
+//   4: the Burrows-Wheeler transform (see below).
+//   5: an asymmetric numeral system instead of a Huffman code (see below).
+//   6: 16-bit symbols (see below).
+//
+// Flags 1 and 2 are only set with method 0, and the block index also uses
+// method 0.
+//
+//           _________________________________________________________
+//          |        |        |        |        |        |        |
+//   block: | flags  |  size ....       |payload ....     | Payload ....
+//          |________|________|________|________|________|________|__
+//
+// The payload contains the code lengths of a canonical Huffman code (unless
+// the block uses the code of the previous block) followed by a sequence of
+// bits that encodes exactly "size" bytes. This sequence is obtained by
+// concatenating the corresponding Huffman bit sequences for each byte of the
+// pre-encoded data. It is possible that this bit sequence will not completely
+// fill the last byte. In such a case the left over bits will be filled with
+// "0"s. Blocks with a size of 0 have an empty payload, except for the block
+// index.
+//
+// A block with interleaved streams splits its "size" bytes into 4 parts.
+// The first 3 parts have (size + 3) / 4 bytes each (or fewer if "size" is
+// small) and the last part has the remaining bytes. Each part is encoded
+// into its own bit sequence as described above, which is padded to whole
+// bytes on its own. After the code lengths, the payload holds 3 unsigned 32
+// bit integers in big-endian order with the number of bytes taken by the
+// bit sequences of the first 3 parts, followed by the 4 bit sequences. The
+// last bit sequence takes the rest of the payload.
+//
+//           _________________________________________________________
+//          |        |        |        |        |        |        |
+//   body:  |stream 1|stream 2|stream 3|  bits  |  bits  |  bits  | bits
+//          |  size  |  size  |  size  |   1    |   2    |   3    |  4
+//          |________|________|________|________|________|________|______
+//
+// The code lengths list the code length of every byte value from 0 to 255 in
+// order. The lengths are written as a sequence of 4 bit items, most
+// significant bits first:
+//
+//   1 - 14: the code length of the next byte value.
+//   15:     followed by 8 bits that hold the code length of the next byte
+//           value. Used for code lengths of 15 and above.
+//   0:      followed by 4 bits that hold a number r. If r is less than 15,
+//           the next r + 1 byte values do not occur in the data and have no
+//           code. If r is 15, it is followed by 8 more bits that hold a
+//           number m and the next 16 + m byte values have no code.
+//
+// If the items do not fill the last byte of the code lengths, it is padded
+// with "0"s.
 //
-// The header encodes a frequency table mapping bytes to the frequencies
-// that they occur. The encoding of the frequency table starts with 4 bytes
-// representing an unsigned 32 bit integer (n) that specifies the number of
-// entries in the table. Then follow n entries. Each entry is encoded as a
-// byte value followed by 4 bytes (representing an unsigned 32 bit integer)
-// that specify the number of occurrences of the entry's byte. The bytes
-// in the unsigned 32 bit integers are encoded using big-endian ordering. 
+// A block with order-1 context modeling codes every byte with one of several
+// codes, chosen by the byte before it in the block. The first byte of the
+// block is coded as if it followed a byte of 0. Instead of a single set of
+// code lengths, the payload starts with a byte that holds the number of
+// codes n minus 1. It is followed by the cluster map, which holds for every
+// byte value from 0 to 255 in order the index of the code for the bytes that
+// follow it, in b bits each, where b is the smallest number of bits that can
+// hold n - 1. Then come the code lengths of the n codes, one after another,
+// and then the body. The code of such a block can not be used by the next
+// block.
 //
-//           ___________________________________
-//          |        |        |        |        |
-//       n: | byte1  | byte2  | byte3  | byte4  |
-//          |________|________|________|________|
-//           ____________________________________________
-//          |        | byte1  | byte2  | byte3  | byte4  |
-// entry_1: | byte   |   #    |   #    |   #    |   #    |
-//          |________|________|________|________|________|
+// The codes themselves are not stored. Both sides assign them from the
+// code lengths in canonical order: shorter codes come first and codes of the
+// same length are ordered by byte value, with each code being the previous
+// code plus one, extended with "0"s to its length. A single distinct byte gets
+// the one bit code "0".
 //
-// .......................................................
-// .......................................................
+// A block with LZ77 matches is coded as a sequence of runs of literal bytes,
+// each followed by a copy of bytes that come earlier in the block. Its
+// payload starts with 4 sets of code lengths: those of a code for the
+// literal bytes, written as above, and those of the codes for literal run
+// lengths, match lengths and match distances, written the same way for 44
+// symbols each. They are followed by 2 unsigned 32 bit integers in
+// big-endian order that hold the number of literal bytes and the number of
+// bytes that their codes take. Then come the codes of all the literal bytes
+// of the block, padded with "0"s to a whole byte, and after them the codes
+// of the sequences, which take the rest of the payload. Every sequence has
+// the number of literal bytes in its run, then, unless the run ends the
+// block, the length of the copy minus 4 and the distance back to the bytes
+// that it copies minus 1. The copy may overlap the bytes that it produces.
+// Each of these numbers v is coded with a symbol of its code: v itself if it
+// is less than 16, or else 12 + b, where b is the position of the highest
+// bit set in v, followed by the lowest b bits of v.
 //
-//           ____________________________________________
-//          |        | byte1  | byte2  | byte3  | byte4  |
-// entry_n: | byte   |   #    |   #    |   #    |   #    |
-//          |________|________|________|________|________|
+// A block with the Burrows-Wheeler transform is coded in three steps. The
+// transform sorts all the suffixes of the bytes of the block, with shorter
+// suffixes first where one is a prefix of another, and lists the byte before
+// every suffix in that order, with the byte before the whole block being
+// left out. The empty suffix comes first, and its position in the order is
+// called its row. The transformed bytes are then coded as their indexes in
+// a list of the 256 byte values that starts in order, where each byte is
+// moved to the front of the list after it is coded. Every index v from 1 to
+// 255 is coded as the symbol v + 1. A run of n indexes of 0 is coded with
+// the digits of n in bijective base 2, lowest digit first, where the symbol
+// 0 is the digit 1 and the symbol 1 is the digit 2. The payload holds the
+// code lengths of the 257 symbols, written as above, followed by 16
+// unsigned 32 bit integers in big-endian order, and then by the codes of
+// the symbols. The block is split into 16 parts as with interleaved
+// streams, and the integers hold the rows of the suffixes that start at each
+// part, so that the parts can be recovered at the same time.
 //
-// The body starts with 4 bytes representing an unsigned 32 bit integer (n)
-// that specifies the number of bytes of data before Huffman encoding.  
-// This is followed by a sequence of bits that encodes exactly n bytes.
-// This sequence is obtained by concatenating the corresponding Huffman bit
-// sequences for each byte of the pre-encoded data. It is possible that this
-// bit sequence will not completely fill the last byte. In such a case the
-// left over bits will be filled with "0"s.
+// A block that is coded with an asymmetric numeral system has a payload
+// that starts with the scaled counts of the byte values, as a sequence of
+// items written most significant bits first. The first item holds t - 5 in
+// 3 bits, where t is from 5 to 12 and the counts add up to 2^t. Then comes
+// the count of every byte value in order, until the counts add up to
+// 2^t. Each count takes as many bits as it takes to write the part of 2^t
+// that the counts before it leave. A count of 0 is followed by 4 bits that
+// hold the number r of further byte values whose count is 0, or 15 and 8
+// more bits that hold r - 15. Byte values after the last count have a count
+// of 0. The items are padded with "0"s to a whole byte.
 //
-//           ___________________________________________________________
-//          | byte1  | byte2  | byte3  | byte4  |                       |
-//    body: |   n    |   n    |   n    |   n    |  Encoded bits .....   |
-//          |________|________|________|________|_______________________|
+// The rest of the payload holds the bits of the coded bytes. The first byte
+// of them has "0"s up to its first bit of 1, which is followed by 4 states
+// of t bits each, and then by the bits that every decoded byte reads in
+// turn. The states of the table are numbered from 0 to 2^t - 1 and each of
+// them decodes a byte. The byte values are placed at the states by taking
+// every byte value in order as many times as its count, and moving from
+// state 0 by 2^(t - 1) + 2^(t - 3) + 3 modulo 2^t each time. The decoded
+// bytes take turns among the 4 states, and decoding byte i with state s of
+// the state i modulo 4 replaces that state by n * 2^b - 2^t plus the next b
+// bits, where n is the count of the byte plus the number of states before s
+// with the same byte, and b is the number that brings n * 2^b to at least
+// 2^t but below 2^(t + 1). All 4 states end at 0 after the last byte.
+//
+// A block that is coded as 16-bit symbols takes every two bytes as one
+// symbol, with the first byte in the lowest 8 bits. If the block has an odd
+// size, its last byte is stored as it is. The payload starts with a
+// description of the code, as a sequence of items written most significant
+// bits first. The first item holds the number n of symbols with a code
+// minus 1 in 16 bits. Then come the n symbols in increasing order, each
+// followed by its code length in 5 bits, from 1 to 20. Every symbol is
+// written as its difference d from the symbol before it, or from -1 for the
+// first one, in as many "0"s as there are bits in d after its highest bit
+// of 1, followed by all the bits of d starting with that 1. A block of odd
+// size then has its last byte in 8 bits. The items are padded with "0"s to
+// a whole byte, and are followed by the codes of the symbols as with bytes,
+// where the codes are assigned to the symbols in canonical order.
+//
+// Encoded data may end with a block index, which lets a range of the
+// decoded data be decoded without the blocks before it. The payload of the
+// index holds the number of other blocks as a variable length integer,
+// followed by three variable length integers for every block in order: the
+// size of the block, the number of bytes that the whole block takes in the
+// encoded data, and the number of blocks back to the block with the code
+// lengths that the block uses, which is 0 if the block has its own code
+// lengths. The payload ends with the number of bytes that the whole index
+// block takes, as an unsigned 64 bit integer in big-endian order, so that
+// the index can be found from the end of the data.
 //
 #include "huffman.h"
+#include "ans.h"
+#include "bwt.h"
+#include "histogram.h"
+#include "lz77.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
 #include <fstream>
-#include <queue>
 #include <vector>
 
+using std::istream;
 using std::map;
-using std::priority_queue;
+using std::ostream;
 using std::string;
 using std::vector;
 
-void HuffmanEncodeFile(const string& input_file, const string& output_file) {
-  FileReadStream* read_stream = new FileReadStream(input_file);
-  FileWriteStream* write_stream = new FileWriteStream(output_file);
-  HuffmanEncode(read_stream, write_stream);
-  delete read_stream;
-  delete write_stream;
-}
-
-void HuffmanDecodeFile(const string& input_file, const string& output_file) {
-  FileReadStream* read_stream = new FileReadStream(input_file);
-  FileWriteStream* write_stream = new FileWriteStream(output_file);
-  HuffmanDecode(read_stream, write_stream);
-  delete read_stream;
-  delete write_stream;
-}
-
-void HuffmanEncodeString(const string& data, string& encoded_data) {
-  StringReadStream* read_stream = new StringReadStream(data);
-  StringWriteStream* write_stream = new StringWriteStream();
-  HuffmanEncode(read_stream, write_stream);
-  encoded_data = write_stream->GetString();
-  delete read_stream;
-  delete write_stream;
-}
-
-void HuffmanDecodeString(const string& data, string& decoded_data) {
-  StringReadStream* read_stream = new StringReadStream(data);
-  StringWriteStream* write_stream = new StringWriteStream();
-  HuffmanDecode(read_stream, write_stream);
-  decoded_data = write_stream->GetString();
-  delete read_stream;
-  delete write_stream;
-}
-
-void HuffmanEncode(ReadStream* read_stream, WriteStream* write_stream) {
-  map<char, unsigned int> frequencies = CalculateByteFrequencies(read_stream);
-  HuffmanNode* root = BuildHuffmanTree(frequencies);
-  map<char, string> encoding_table = BuildEncodingTable(root);
-  EncodeFrequencyTable(frequencies, write_stream);
-  EncodeData(read_stream, encoding_table, write_stream);
-  DeleteHuffmanTree(root);
-  write_stream->Flush();
+// Flags in the first byte of a block.
+static const unsigned char kLastBlock = 1;
+static const unsigned char kReusePreviousCode = 2;
+static const unsigned char kInterleavedStreams = 4;
+static const unsigned char kIndexBlock = 8;
+
+// The coding method of a block takes bits 4 to 6 of its first byte, and
+// bit 7 is not used.
+static const int kMethodShift = 4;
+static const unsigned char kMethodMask = 7 << kMethodShift;
+static const unsigned char kUnusedFlags = 128;
+
+// The coding methods of blocks.
+static const int kHuffmanMethod = 0;
+static const int kContextMethod = 1;
+static const int kStoredMethod = 2;
+static const int kMatchMethod = 3;
+static const int kSortedMethod = 4;
+static const int kAnsMethod = 5;
+static const int kWideMethod = 6;
+
+// Blocks smaller than this never use order-1 context modeling, as the
+// cluster map and the extra code lengths would outweigh what it saves.
+static const unsigned int kMinContextBlockSize = 1024;
+
+// Blocks smaller than this are never coded as LZ77 matches, as the extra
+// code lengths would outweigh what the matches save.
+static const unsigned int kMinMatchBlockSize = 64;
+
+// The numbers in the sequences of an LZ77 block that each have their own
+// code: literal run lengths, match lengths and match distances.
+static const int kMatchValueKinds = 3;
+
+// The number of symbols of each code of the numbers in an LZ77 block.
+// Symbols below kDirectMatchValues stand for themselves.
+static const int kMatchValueSymbols = 44;
+static const unsigned int kDirectMatchValues = 16;
+
+// The number of bytes that hold the number of literals and the size of
+// their codes in an LZ77 block.
+static const size_t kMatchSizesSize = 8;
+
+// Blocks smaller than this are never sorted, as the code lengths would
+// outweigh what the transform saves.
+static const unsigned int kMinSortedBlockSize = 1024;
+
+// The number of bytes that hold the rows of the segments of a block with
+// the Burrows-Wheeler transform.
+static const size_t kSortedRowsSize = 4 * kBwtSegments;
+
+// Blocks smaller than this are never coded as 16-bit symbols, as the
+// description of the code would outweigh what it saves.
+static const unsigned int kMinWideBlockSize = 1024;
+
+// The number of 16-bit symbols.
+static const int kWideSymbols = 1 << 16;
+
+// The longest code of a 16-bit symbol. Codes of up to kHuffmanLookupBits
+// bits are decoded with a single lookup, and longer ones with one more
+// lookup in a secondary table.
+static const int kWideMaxCodeLength = 20;
+
+// The number of bits that hold the code length of a 16-bit symbol.
+static const int kWideLengthBits = 5;
+
+// The largest number of bytes taken by a variable length integer.
+static const size_t kMaxVarintSize = 10;
+
+// The largest number of bytes in a block before its payload.
+static const size_t kMaxBlockHeaderSize = 1 + 2 * kMaxVarintSize;
+
+// The number of bytes that hold the sizes of the streams in a block with
+// interleaved streams.
+static const size_t kStreamSizesSize = 4 * (kHuffmanStreams - 1);
+
+// The number of bytes at the end of the block index that hold its size.
+static const size_t kIndexFooterSize = 8;
+
+size_t VarintSize(unsigned long long value) {
+  size_t size = 1;
+  while (value >= 128) {
+    value >>= 7;
+    size++;
+  }
+  return size;
 }
 
-void HuffmanDecode(ReadStream* read_stream, WriteStream* write_stream) {
-  map<char, unsigned int> frequencies;
-  DecodeFrequencyTable(read_stream, frequencies);
-  HuffmanNode* root = BuildHuffmanTree(frequencies);
-  DecodeData(read_stream, root, write_stream);
-  DeleteHuffmanTree(root);
-  write_stream->Flush();
+size_t StoreVarint(unsigned long long value, char* output) {
+  size_t size = 0;
+  while (value >= 128) {
+    output[size++] = (char) ((value & 127) | 128);
+    value >>= 7;
+  }
+  output[size++] = (char) value;
+  return size;
 }
 
-void EncodeFrequencyTable(map<char, unsigned int>& frequencies,
-                          WriteStream* write_stream) {
-  unsigned int elements = frequencies.size();
-  write_stream->WriteUnsignedInt32(elements);
-  for (map<char, unsigned int>::iterator it = frequencies.begin();
-      it != frequencies.end();
-      it++) {
-    write_stream->WriteByte(it->first);
-    write_stream->WriteUnsignedInt32(it->second);
+bool LoadVarint(const char* data,
+                size_t size,
+                size_t& position,
+                unsigned long long& value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (position >= size) {
+      return false;
+    }
+    unsigned char byte = data[position++];
+    value |= (unsigned long long) (byte & 127) << shift;
+    if ((byte & 128) == 0) {
+      return shift < 63 || byte <= 1;
+    }
   }
+  return false;
 }
 
-void DecodeFrequencyTable(ReadStream* read_stream,
-                          map<char, unsigned int>& frequency_table) {
-  unsigned int elements;
-  read_stream->ReadUnsignedInt32(elements);
-  for (int i = 0; i < elements; i++) {
-    char byte;
-    read_stream->ReadByte(byte);
-    unsigned int freq;
-    read_stream->ReadUnsignedInt32(freq);
-    frequency_table[byte] = freq;
+// Reads an unsigned 32 bit integer in big-endian order from "input".
+static unsigned int LoadUnsignedInt32(const char* input) {
+  unsigned int value = 0;
+  for (int i = 0; i < 4; i++) {
+    value = (value << 8) | (unsigned char) input[i];
   }
+  return value;
 }
 
-void EncodeData(ReadStream* read_stream,
-                map<char, string>& encoding_table,
-                WriteStream* write_stream) {
-  unsigned int bytes = read_stream->Bytes();
-  read_stream->Reset();
-  write_stream->WriteUnsignedInt32(bytes);
-  while (true) {
-    char byte;
-    if (!read_stream->ReadByte(byte)) {
+// The description of a block that is being encoded.
+struct EncoderBlock {
+  const char* data;
+  unsigned int size;
+  bool interleaved;
+  int max_code_length;
+  int max_clusters;
+  double min_saving;
+  unsigned int frequencies[256];
+  unsigned int stream_frequencies[kHuffmanStreams][256];
+  unsigned char lengths[256];
+  bool reuse_code;
+  unsigned int stream_sizes[kHuffmanStreams];
+  size_t payload_size;
+  size_t header_size;
+  size_t offset;
+
+  // Whether the bytes of the block are stored as they are instead of being
+  // coded.
+  bool stored;
+
+  // The order-1 context code of the block, which is used if "context" is
+  // true. "Cluster_lengths" holds 256 code lengths for each of the
+  // "clusters" codes.
+  bool context;
+  int clusters;
+  unsigned char cluster_map[256];
+  vector<unsigned char> cluster_lengths;
+  size_t context_payload_size;
+
+  // The LZ77 matches of the block, which are used if "matched" is true.
+  // "Sequences" is empty if the block is not looked for matches. The
+  // literal bytes are coded with "literal_lengths", and the numbers in the
+  // sequences with "value_lengths", whose codes take "literals_size" and
+  // "sequences_size" bytes.
+  int match_level;
+  bool matched;
+  vector<Lz77Sequence> sequences;
+  unsigned int literal_count;
+  unsigned char literal_lengths[256];
+  unsigned char value_lengths[kMatchValueKinds][kMatchValueSymbols];
+  size_t literals_size;
+  size_t sequences_size;
+  size_t match_payload_size;
+
+  // The block after the Burrows-Wheeler transform and move-to-front coding,
+  // which is used if "sorted" is true. "Sorted_symbols" is empty if the
+  // block is not sorted. "Sorted_rows" holds the rows of the segments.
+  bool block_sorting;
+  bool sorted;
+  vector<unsigned short> sorted_symbols;
+  unsigned int sorted_rows[kBwtSegments];
+  unsigned char sorted_lengths[kBwtSymbols];
+  size_t sorted_payload_size;
+
+  // The bytes of the block coded with an asymmetric numeral system, which
+  // are used if "ans" is true. "Ans_stream" is empty if the block is not
+  // coded that way.
+  bool ans_coding;
+  bool ans;
+  int ans_table_log;
+  unsigned short ans_counts[256];
+  vector<char> ans_stream;
+  size_t ans_payload_size;
+
+  // The code of the block as 16-bit symbols, which is used if "wide" is
+  // true. "Wide_symbols" lists the symbols that occur in increasing order,
+  // and is empty if the block is not coded that way, and "wide_lengths"
+  // holds their code lengths.
+  bool wide_coding;
+  bool wide;
+  vector<unsigned short> wide_symbols;
+  vector<unsigned char> wide_lengths;
+  size_t wide_payload_size;
+};
+
+// The code lengths of the block before some blocks, which the first of them
+// may use instead of its own. Only a block with a single code of bytes has
+// lengths that can be used, so "valid" is false if the block before is not
+// such a block or there is none. Only this much of a block is kept from one
+// group of blocks to the next, as whole blocks can hold megabytes.
+struct PreviousCode {
+  bool valid;
+  unsigned char lengths[256];
+
+  PreviousCode() : valid(false) {}
+};
+
+// Returns true if the next block may use the code lengths of "block", which
+// is an "EncoderBlock" or a "DecoderBlock".
+template <typename Block>
+static bool HasReusableCode(const Block& block) {
+  return block.size > 0 && !block.context && !block.stored &&
+         !block.matched && !block.sorted && !block.ans && !block.wide;
+}
+
+// Stores in "code" the code lengths of "block", as in "HasReusableCode",
+// for the block after it.
+template <typename Block>
+static void KeepPreviousCode(const Block& block, PreviousCode& code) {
+  code.valid = HasReusableCode(block);
+  if (code.valid) {
+    std::copy(block.lengths, block.lengths + 256, code.lengths);
+  }
+}
+
+// Returns the symbol that codes the number "value" in a sequence of an LZ77
+// block and stores the number of extra bits that follow it in "extra_bits".
+static inline int MatchValueSymbol(unsigned int value, int& extra_bits) {
+  if (value < kDirectMatchValues) {
+    extra_bits = 0;
+    return value;
+  }
+  extra_bits = 0;
+  while ((unsigned long long) value >> (extra_bits + 1)) {
+    extra_bits++;
+  }
+  return 12 + extra_bits;
+}
+
+// Returns the numbers of every kind in "sequence", in the order of the
+// kinds, in "values", and the number of them that are coded.
+static inline int SequenceValues(const Lz77Sequence& sequence,
+                                 unsigned int* values) {
+  values[0] = sequence.literals;
+  if (sequence.length == 0) {
+    return 1;
+  }
+  values[1] = sequence.length - kLz77MinMatch;
+  values[2] = sequence.distance - 1;
+  return kMatchValueKinds;
+}
+
+// Computes the code lengths for "symbols" symbols with the given
+// frequencies, limited to "max_code_length" bits unless it is 0. If more
+// symbols occur than codes of that length can tell apart, as the 257
+// symbols of a block with the Burrows-Wheeler transform can with a limit of
+// 8, the limit is raised to the shortest one that fits them.
+static void ComputeCodeLengths(const unsigned int* frequencies,
+                               int symbols,
+                               int max_code_length,
+                               unsigned char* lengths) {
+  if (max_code_length > 0) {
+    while (!BuildLimitedCodeLengths(frequencies, symbols, max_code_length,
+                                    lengths)) {
+      max_code_length++;
+    }
+    return;
+  }
+  HuffmanTree tree;
+  BuildHuffmanTree(frequencies, symbols, tree);
+  BuildCodeLengths(tree, symbols, lengths);
+}
+
+// Returns the number of bits needed to encode the bytes counted in
+// "frequencies" with codes of lengths "lengths", or -1 if some of those
+// bytes have no code.
+static long long EncodedBits(const unsigned int* frequencies,
+                             const unsigned char* lengths) {
+  long long bits = 0;
+  for (int byte = 0; byte < 256; byte++) {
+    if (frequencies[byte] > 0 && lengths[byte] == 0) {
+      return -1;
+    }
+    bits += (long long) frequencies[byte] * lengths[byte];
+  }
+  return bits;
+}
+
+// Returns the entropy in bits of "size" bytes that are counted in
+// "frequencies", which is the least number of bits that any code of single
+// bytes can take for them.
+static double EntropyBits(const unsigned int* frequencies, unsigned int size) {
+  double bits = 0;
+  for (int byte = 0; byte < 256; byte++) {
+    if (frequencies[byte] > 0) {
+      bits -= frequencies[byte] * log2((double) frequencies[byte] / size);
+    }
+  }
+  return bits;
+}
+
+// Returns the number of bits that hold a cluster index for "clusters"
+// clusters.
+static int ClusterBits(int clusters) {
+  int bits = 0;
+  while ((1 << bits) < clusters) {
+    bits++;
+  }
+  return bits;
+}
+
+// Groups the 256 contexts, whose byte counts are given as 256 tables of 256
+// entries in "counts", into at most "max_clusters" clusters of contexts with
+// similar counts. Stores the cluster of every context in "cluster_map" and
+// the counts of every cluster in "cluster_counts", and returns the number of
+// clusters.
+//
+// The clusters start out as the contexts with the most bytes. Then every
+// context is moved to the cluster that would code it in the fewest bits,
+// and the counts of the clusters are recomputed, a few times over.
+static int ClusterContexts(const unsigned int* counts,
+                           int max_clusters,
+                           unsigned char* cluster_map,
+                           vector<unsigned int>& cluster_counts) {
+  unsigned int totals[256];
+  vector<int> contexts;
+  for (int context = 0; context < 256; context++) {
+    totals[context] = 0;
+    for (int byte = 0; byte < 256; byte++) {
+      totals[context] += counts[context * 256 + byte];
+    }
+    cluster_map[context] = 0;
+    if (totals[context] > 0) {
+      contexts.push_back(context);
+    }
+  }
+  // Sort the contexts by decreasing number of bytes.
+  for (size_t i = 1; i < contexts.size(); i++) {
+    int context = contexts[i];
+    size_t j = i;
+    while (j > 0 && totals[contexts[j - 1]] < totals[context]) {
+      contexts[j] = contexts[j - 1];
+      j--;
+    }
+    contexts[j] = context;
+  }
+  int clusters = contexts.size() < (size_t) max_clusters ? contexts.size()
+                                                          : max_clusters;
+  if (clusters <= 1) {
+    cluster_counts.assign(256, 0);
+    for (int context = 0; context < 256; context++) {
+      for (int byte = 0; byte < 256; byte++) {
+        cluster_counts[byte] += counts[context * 256 + byte];
+      }
+    }
+    return 1;
+  }
+  for (int cluster = 0; cluster < clusters; cluster++) {
+    cluster_map[contexts[cluster]] = cluster;
+  }
+  for (size_t i = clusters; i < contexts.size(); i++) {
+    cluster_map[contexts[i]] = 0;
+  }
+
+  const int kIterations = 4;
+  vector<double> costs(clusters * 256);
+  for (int iteration = 0; iteration <= kIterations; iteration++) {
+    // Sum up the counts of the contexts in each cluster, dropping clusters
+    // that have become empty.
+    vector<int> renumber(clusters, -1);
+    int used_clusters = 0;
+    for (size_t i = 0; i < contexts.size(); i++) {
+      int& cluster = renumber[cluster_map[contexts[i]]];
+      if (cluster < 0) {
+        cluster = used_clusters++;
+      }
+    }
+    clusters = used_clusters;
+    cluster_counts.assign(clusters * 256, 0);
+    for (size_t i = 0; i < contexts.size(); i++) {
+      int context = contexts[i];
+      cluster_map[context] = renumber[cluster_map[context]];
+      for (int byte = 0; byte < 256; byte++) {
+        cluster_counts[cluster_map[context] * 256 + byte] +=
+            counts[context * 256 + byte];
+      }
+    }
+    if (iteration == kIterations) {
       break;
     }
-    string encoding = encoding_table[byte];
-    for (int i = 0; i < encoding.size(); i++) {
-      write_stream->WriteBit(encoding[i]);
+
+    // Estimate the cost of a byte in each cluster as its entropy, with 1/2
+    // added to the count of every byte so that bytes that are not in a
+    // cluster yet get a high but finite cost.
+    for (int cluster = 0; cluster < clusters; cluster++) {
+      unsigned long long total = 0;
+      for (int byte = 0; byte < 256; byte++) {
+        total += cluster_counts[cluster * 256 + byte];
+      }
+      for (int byte = 0; byte < 256; byte++) {
+        costs[cluster * 256 + byte] =
+            -log2((cluster_counts[cluster * 256 + byte] + 0.5) / (total + 128));
+      }
+    }
+    for (size_t i = 0; i < contexts.size(); i++) {
+      int context = contexts[i];
+      const unsigned int* context_counts = &counts[context * 256];
+      double best_cost = 0;
+      for (int cluster = 0; cluster < clusters; cluster++) {
+        const double* cluster_costs = &costs[cluster * 256];
+        double cost = 0;
+        for (int byte = 0; byte < 256; byte++) {
+          cost += context_counts[byte] * cluster_costs[byte];
+        }
+        if (cluster == 0 || cost < best_cost) {
+          best_cost = cost;
+          cluster_map[context] = cluster;
+        }
+      }
     }
   }
+  return clusters;
+}
+
+// Computes the order-1 context code of "block" and the size of its payload
+// with that code.
+static void PlanContextCode(EncoderBlock& block) {
+  const unsigned char* bytes = (const unsigned char*) block.data;
+  vector<unsigned int> counts(256 * 256, 0);
+  unsigned char previous = 0;
+  for (unsigned int i = 0; i < block.size; i++) {
+    counts[previous * 256 + bytes[i]]++;
+    previous = bytes[i];
+  }
+  vector<unsigned int> cluster_counts;
+  block.clusters = ClusterContexts(&counts[0], block.max_clusters,
+                                   block.cluster_map, cluster_counts);
+  block.cluster_lengths.resize(block.clusters * 256);
+  size_t size = 1 + 32 * ClusterBits(block.clusters);
+  long long bits = 0;
+  for (int cluster = 0; cluster < block.clusters; cluster++) {
+    unsigned char* lengths = &block.cluster_lengths[cluster * 256];
+    ComputeCodeLengths(&cluster_counts[cluster * 256], 256,
+                       block.max_code_length, lengths);
+    size += CodeLengthsSize(lengths, 256);
+    bits += EncodedBits(&cluster_counts[cluster * 256], lengths);
+  }
+  block.context_payload_size = size + (bits + 7) / 8;
 }
 
-void DecodeData(ReadStream* read_stream,
-                HuffmanNode* root,
-                WriteStream* write_stream) {
-  unsigned int bytes;
-  read_stream->ReadUnsignedInt32(bytes);
-  while (bytes > 0) {
-    HuffmanNode* node = root;
-    while (!node->leaf) {
-      char bit;
-      read_stream->ReadBit(bit);
-      node = (bit == 0) ? node->left : node->right;
+// Finds the LZ77 matches of "block", computes the codes of its literals and
+// of the numbers in its sequences, and the size of its payload with them.
+static void PlanMatchCode(EncoderBlock& block) {
+  FindLz77Matches(block.data, block.size, block.match_level,
+                  block.sequences);
+  unsigned int counts[kMatchValueKinds][kMatchValueSymbols] = {{0}};
+  for (int byte = 0; byte < 256; byte++) {
+    block.literal_lengths[byte] = 0;
+  }
+  unsigned int literal_counts[256] = {0};
+  long long extra_bits = 0;
+  const unsigned char* bytes = (const unsigned char*) block.data;
+  unsigned int offset = 0;
+  for (size_t i = 0; i < block.sequences.size(); i++) {
+    const Lz77Sequence& sequence = block.sequences[i];
+    // The runs are mostly short, so they are counted directly rather than
+    // with the interleaved tables of "CountBytes".
+    for (unsigned int end = offset + sequence.literals; offset < end;
+         offset++) {
+      literal_counts[bytes[offset]]++;
+    }
+    offset += sequence.length;
+    unsigned int values[kMatchValueKinds];
+    int kinds = SequenceValues(sequence, values);
+    for (int kind = 0; kind < kinds; kind++) {
+      int bits;
+      counts[kind][MatchValueSymbol(values[kind], bits)]++;
+      extra_bits += bits;
+    }
+  }
+  block.literal_count = 0;
+  for (int byte = 0; byte < 256; byte++) {
+    block.literal_count += literal_counts[byte];
+  }
+  ComputeCodeLengths(literal_counts, 256, block.max_code_length,
+                     block.literal_lengths);
+  block.literals_size =
+      (EncodedBits(literal_counts, block.literal_lengths) + 7) / 8;
+  size_t size = CodeLengthsSize(block.literal_lengths, 256) +
+                kMatchSizesSize + block.literals_size;
+  long long bits = extra_bits;
+  for (int kind = 0; kind < kMatchValueKinds; kind++) {
+    unsigned char* lengths = block.value_lengths[kind];
+    ComputeCodeLengths(counts[kind], kMatchValueSymbols,
+                       block.max_code_length, lengths);
+    size += CodeLengthsSize(lengths, kMatchValueSymbols);
+    for (int symbol = 0; symbol < kMatchValueSymbols; symbol++) {
+      bits += (long long) counts[kind][symbol] * lengths[symbol];
     }
-    write_stream->WriteByte(node->byte);
-    bytes--;
   }
+  block.sequences_size = (bits + 7) / 8;
+  block.match_payload_size = size + block.sequences_size;
 }
 
-HuffmanNode::HuffmanNode() {}
+// Applies the Burrows-Wheeler transform and move-to-front coding to
+// "block", computes the code of the resulting symbols and the size of its
+// payload with it.
+static void PlanSortedCode(EncoderBlock& block) {
+  vector<unsigned char> transformed(block.size);
+  BurrowsWheelerTransform((const unsigned char*) block.data, block.size,
+                          &transformed[0], block.sorted_rows);
+  MoveToFrontEncode(&transformed[0], block.size, block.sorted_symbols);
+  unsigned int counts[kBwtSymbols] = {0};
+  for (size_t i = 0; i < block.sorted_symbols.size(); i++) {
+    counts[block.sorted_symbols[i]]++;
+  }
+  ComputeCodeLengths(counts, kBwtSymbols, block.max_code_length,
+                     block.sorted_lengths);
+  long long bits = 0;
+  for (int symbol = 0; symbol < kBwtSymbols; symbol++) {
+    bits += (long long) counts[symbol] * block.sorted_lengths[symbol];
+  }
+  block.sorted_payload_size = CodeLengthsSize(block.sorted_lengths,
+                                              kBwtSymbols) +
+                              kSortedRowsSize + (bits + 7) / 8;
+}
 
-HuffmanNode::HuffmanNode(char byte, unsigned int freq) {
-  this->leaf = true;
-  this->byte = byte;
-  this->freq = freq;
-  this->left = NULL;
-  this->right = NULL;
+// Scales the byte counts of "block" for an asymmetric numeral system and,
+// if that is expected to take less than the code of the block, codes its
+// bytes with them and computes the size of its payload.
+static void PlanAnsCode(EncoderBlock& block) {
+  block.ans_table_log = AnsTableLog(block.frequencies, block.size);
+  if (block.ans_table_log == 0 ||
+      !NormalizeAnsCounts(block.frequencies, block.size, block.ans_table_log,
+                          block.ans_counts)) {
+    return;
+  }
+  size_t counts_size = AnsCountsSize(block.ans_counts, block.ans_table_log);
+  double bits = AnsEncodedBits(block.frequencies, block.ans_counts,
+                               block.ans_table_log) +
+                kAnsStates * block.ans_table_log;
+  long long code_size = CodeLengthsSize(block.lengths, 256) +
+      (EncodedBits(block.frequencies, block.lengths) + 7) / 8;
+  if (counts_size + bits / 8 >= code_size) {
+    return;
+  }
+  AnsEncode(block.data, block.size, block.ans_counts, block.ans_table_log,
+            block.ans_stream);
+  block.ans_payload_size = counts_size + block.ans_stream.size();
 }
 
-HuffmanNode::HuffmanNode(unsigned int freq,
-                         HuffmanNode* left,
-                         HuffmanNode* right) {
-  this->leaf = false;
-  this->byte = 0;
-  this->freq = freq;
-  this->left = left;
-  this->right = right;
+// Returns the number of bits that the description of a code of 16-bit
+// symbols takes, for the symbols "symbols" with code lengths "lengths", and
+// writes it to "writer" if it is not NULL. "Last_byte" is the last byte of a
+// block of odd size, or -1 if the size is even.
+static unsigned long long WriteWideCode(const vector<unsigned short>& symbols,
+                                        const vector<unsigned char>& lengths,
+                                        int last_byte,
+                                        BitWriter* writer) {
+  unsigned long long bits = 16;
+  if (writer != NULL) {
+    writer->WriteBits((unsigned int) symbols.size() - 1, 16);
+  }
+  int previous = -1;
+  for (size_t i = 0; i < symbols.size(); i++) {
+    unsigned int difference = symbols[i] - previous;
+    int high_bit = 0;
+    while (difference >> (high_bit + 1)) {
+      high_bit++;
+    }
+    bits += 2 * high_bit + 1 + kWideLengthBits;
+    if (writer != NULL) {
+      writer->WriteBits(0, high_bit);
+      writer->WriteBits(difference, high_bit + 1);
+      writer->WriteBits(lengths[i], kWideLengthBits);
+    }
+    previous = symbols[i];
+  }
+  if (last_byte >= 0) {
+    bits += 8;
+    if (writer != NULL) {
+      writer->WriteBits(last_byte, 8);
+    }
+  }
+  return bits;
 }
 
-bool HuffmanNodeCompare::operator () (
-    const HuffmanNode* node1,
-    const HuffmanNode* node2) {
-  
-  return node1->freq > node2->freq;
+// Counts the 16-bit symbols of "block" and, if their entropy suggests that
+// they take less than the code of the block, computes their code and the
+// size of its payload with it.
+static void PlanWideCode(EncoderBlock& block) {
+  const unsigned char* bytes = (const unsigned char*) block.data;
+  unsigned int pairs = block.size / 2;
+  vector<unsigned int> counts(kWideSymbols, 0);
+  for (unsigned int i = 0; i < pairs; i++) {
+    counts[bytes[2 * i] | (bytes[2 * i + 1] << 8)]++;
+  }
+  // Only the symbols that occur are kept from here on.
+  vector<unsigned int> frequencies;
+  double bits = 0;
+  for (int symbol = 0; symbol < kWideSymbols; symbol++) {
+    if (counts[symbol] > 0) {
+      block.wide_symbols.push_back((unsigned short) symbol);
+      frequencies.push_back(counts[symbol]);
+      bits -= counts[symbol] * log2((double) counts[symbol] / pairs);
+    }
+  }
+  block.wide_lengths.assign(block.wide_symbols.size(), 0);
+  int last_byte = block.size % 2 == 1 ? bytes[block.size - 1] : -1;
+  unsigned long long code_bits =
+      WriteWideCode(block.wide_symbols, block.wide_lengths, last_byte, NULL);
+  long long own_size = CodeLengthsSize(block.lengths, 256) +
+      (EncodedBits(block.frequencies, block.lengths) + 7) / 8;
+  if ((code_bits + bits) / 8 >= own_size) {
+    block.wide_symbols.clear();
+    return;
+  }
+  BuildLimitedCodeLengths(&frequencies[0], (int) frequencies.size(),
+                          kWideMaxCodeLength, &block.wide_lengths[0]);
+  unsigned long long body_bits = 0;
+  for (size_t i = 0; i < frequencies.size(); i++) {
+    body_bits += (unsigned long long) frequencies[i] * block.wide_lengths[i];
+  }
+  block.wide_payload_size = (code_bits + 7) / 8 + (body_bits + 7) / 8;
 }
 
-HuffmanNode* BuildHuffmanTree(map<char, unsigned int>& frequencies) {
-  priority_queue<HuffmanNode*, vector<HuffmanNode*>, HuffmanNodeCompare> que;
+// Computes the frequencies and the code lengths of every block.
+struct PlanBlocks {
+  vector<EncoderBlock>& blocks;
 
-  // Add leaf nodes.
-  for (map<char, unsigned int>::iterator it = frequencies.begin();
-       it != frequencies.end(); 
-       it++) {
-    que.push(new HuffmanNode(it->first, it->second));
+  PlanBlocks(vector<EncoderBlock>& blocks) : blocks(blocks) {}
+
+  void operator () (size_t index) {
+    EncoderBlock& block = blocks[index];
+    for (int byte = 0; byte < 256; byte++) {
+      block.frequencies[byte] = 0;
+    }
+    if (block.interleaved) {
+      // The streams are counted separately because each of them is padded
+      // to whole bytes.
+      for (int stream = 0; stream < kHuffmanStreams; stream++) {
+        unsigned int* counts = block.stream_frequencies[stream];
+        for (int byte = 0; byte < 256; byte++) {
+          counts[byte] = 0;
+        }
+        unsigned int start = HuffmanStreamStart(block.size, stream);
+        unsigned int end = HuffmanStreamStart(block.size, stream + 1);
+        CountBytes(block.data + start, end - start, counts);
+        for (int byte = 0; byte < 256; byte++) {
+          block.frequencies[byte] += counts[byte];
+        }
+      }
+    } else {
+      CountBytes(block.data, block.size, block.frequencies);
+    }
+    block.clusters = 0;
+    block.sequences.clear();
+    block.sorted_symbols.clear();
+    block.ans_stream.clear();
+    block.wide_symbols.clear();
+    bool context = block.max_clusters > 1 &&
+                   block.size >= kMinContextBlockSize;
+    bool match = block.match_level > 0 && block.size >= kMinMatchBlockSize;
+    bool sort = block.block_sorting && block.size >= kMinSortedBlockSize &&
+                block.size <= kBwtMaxSize;
+    bool wide = block.wide_coding && block.size >= kMinWideBlockSize;
+    // No code of single bytes can save more than the entropy of the bytes
+    // allows, so a block for which that saving is too small is stored
+    // without building a code, unless contexts, matches, sorting or 16-bit
+    // symbols may save more.
+    block.stored = block.size > 0 && !context && !match && !sort && !wide &&
+        8.0 * block.size - EntropyBits(block.frequencies, block.size) <
+            8.0 * block.size * block.min_saving;
+    if (block.stored) {
+      return;
+    }
+    ComputeCodeLengths(block.frequencies, 256, block.max_code_length,
+                       block.lengths);
+    if (context) {
+      PlanContextCode(block);
+    }
+    if (match) {
+      PlanMatchCode(block);
+    }
+    if (sort) {
+      PlanSortedCode(block);
+    }
+    // An empty block has no bytes to scale counts for.
+    if (block.ans_coding && block.size > 0) {
+      PlanAnsCode(block);
+    }
+    if (wide) {
+      PlanWideCode(block);
+    }
   }
+};
 
-  // Create inner nodes.
-  while (que.size() >= 2) {
-    HuffmanNode* min_freq_node1 = que.top();
-    que.pop();
-    HuffmanNode* min_freq_node2 = que.top();
-    que.pop();
-    que.push(new HuffmanNode(min_freq_node1->freq + min_freq_node2->freq,
-                             min_freq_node1,
-                             min_freq_node2));
+// Returns the number of bytes that the body of "block" takes if it is
+// encoded with codes of lengths "lengths", or -1 if some of its bytes have no
+// code. For blocks with interleaved streams, the size of every stream is
+// stored in "stream_sizes".
+static long long BodySize(const EncoderBlock& block,
+                          const unsigned char* lengths,
+                          unsigned int* stream_sizes) {
+  if (!block.interleaved) {
+    long long bits = EncodedBits(block.frequencies, lengths);
+    return bits < 0 ? -1 : (bits + 7) / 8;
+  }
+  long long size = kStreamSizesSize;
+  for (int stream = 0; stream < kHuffmanStreams; stream++) {
+    long long bits = EncodedBits(block.stream_frequencies[stream], lengths);
+    if (bits < 0) {
+      return -1;
+    }
+    stream_sizes[stream] = (bits + 7) / 8;
+    size += stream_sizes[stream];
   }
+  return size;
+}
 
-  HuffmanNode* root = que.top();
-  que.pop();
+// Decides for every block whether it uses its own code, the code of the
+// previous block, its context code, its LZ77 matches, the Burrows-Wheeler
+// transform, an asymmetric numeral system or a code of 16-bit symbols,
+// whichever is smallest including the code lengths, and computes the size
+// of its payload. Blocks that are not made smaller by any of them are
+// stored. "Previous" is the code of the block before the first one, or NULL
+// if there is none.
+static void ChooseBlockCodes(vector<EncoderBlock>& blocks,
+                             const PreviousCode* previous) {
+  const unsigned char* previous_lengths =
+      previous != NULL && previous->valid ? previous->lengths : NULL;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    EncoderBlock& block = blocks[i];
+    block.reuse_code = false;
+    block.context = false;
+    block.matched = false;
+    block.sorted = false;
+    block.ans = false;
+    block.wide = false;
+    if (i > 0) {
+      previous_lengths =
+          HasReusableCode(blocks[i - 1]) ? blocks[i - 1].lengths : NULL;
+    }
+    if (block.size == 0) {
+      block.stored = false;
+      block.payload_size = 0;
+      continue;
+    }
+    if (block.stored) {
+      block.payload_size = block.size;
+      continue;
+    }
+    long long own_size = CodeLengthsSize(block.lengths, 256) +
+        BodySize(block, block.lengths, block.stream_sizes);
+    block.payload_size = own_size;
+    if (block.clusters > 1 &&
+        (long long) block.context_payload_size < own_size) {
+      block.context = true;
+      block.payload_size = block.context_payload_size;
+    }
+    if (!block.sequences.empty() &&
+        block.match_payload_size < block.payload_size) {
+      block.matched = true;
+      block.context = false;
+      block.payload_size = block.match_payload_size;
+    }
+    if (!block.sorted_symbols.empty() &&
+        block.sorted_payload_size < block.payload_size) {
+      block.sorted = true;
+      block.matched = false;
+      block.context = false;
+      block.payload_size = block.sorted_payload_size;
+    }
+    if (!block.ans_stream.empty() &&
+        block.ans_payload_size < block.payload_size) {
+      block.ans = true;
+      block.sorted = false;
+      block.matched = false;
+      block.context = false;
+      block.payload_size = block.ans_payload_size;
+    }
+    if (!block.wide_symbols.empty() &&
+        block.wide_payload_size < block.payload_size) {
+      block.wide = true;
+      block.ans = false;
+      block.sorted = false;
+      block.matched = false;
+      block.context = false;
+      block.payload_size = block.wide_payload_size;
+    }
+    if (previous_lengths != NULL) {
+      unsigned int stream_sizes[kHuffmanStreams];
+      long long previous_size =
+          BodySize(block, previous_lengths, stream_sizes);
+      if (previous_size >= 0 &&
+          previous_size <= (long long) block.payload_size) {
+        // The block is encoded with the code of the previous block, which
+        // may itself be inherited from further back.
+        block.reuse_code = true;
+        block.context = false;
+        block.matched = false;
+        block.sorted = false;
+        block.ans = false;
+        block.wide = false;
+        block.payload_size = previous_size;
+        for (int byte = 0; byte < 256; byte++) {
+          block.lengths[byte] = previous_lengths[byte];
+        }
+        for (int stream = 0; stream < kHuffmanStreams; stream++) {
+          block.stream_sizes[stream] = stream_sizes[stream];
+        }
+      }
+    }
+    if (block.payload_size >= block.size) {
+      block.stored = true;
+      block.reuse_code = false;
+      block.context = false;
+      block.matched = false;
+      block.sorted = false;
+      block.ans = false;
+      block.wide = false;
+      block.payload_size = block.size;
+    }
+  }
+}
 
-  return root;
+// Writes the payload of "block", which uses its context code, to "output".
+static void WriteContextBlock(const EncoderBlock& block, char* output) {
+  BitWriter writer(output);
+  writer.WriteBits(block.clusters - 1, 8);
+  int cluster_bits = ClusterBits(block.clusters);
+  for (int context = 0; context < 256; context++) {
+    writer.WriteBits(block.cluster_map[context], cluster_bits);
+  }
+  vector<HuffmanCode> encoding_tables(block.clusters * 256);
+  for (int cluster = 0; cluster < block.clusters; cluster++) {
+    const unsigned char* lengths = &block.cluster_lengths[cluster * 256];
+    EncodeCodeLengths(lengths, 256, writer);
+    BuildEncodingTable(lengths, &encoding_tables[cluster * 256]);
+  }
+  EncodeContextData(block.data, block.size, &encoding_tables[0],
+                    block.cluster_map, writer);
+  writer.Finish();
 }
 
-void DeleteHuffmanTree(HuffmanNode* root) {
-  if (root == NULL) {
-    return;
-  } else {
-    DeleteHuffmanTree(root->left);
-    DeleteHuffmanTree(root->right);
-    delete root;
+// Builds the table of the canonical codes of "symbols" symbols with code
+// lengths "lengths" in "encoding_table".
+static void BuildSymbolTable(const unsigned char* lengths,
+                             int symbols,
+                             HuffmanCode* encoding_table) {
+  unsigned long long codes[kHuffmanMaxTreeSymbols];
+  BuildCanonicalCodes(lengths, symbols, codes);
+  for (int symbol = 0; symbol < symbols; symbol++) {
+    encoding_table[symbol].code = codes[symbol];
+    encoding_table[symbol].length = lengths[symbol];
   }
 }
 
-void BuildEncodingTableRecursive(HuffmanNode* root,
-                                 string encoding,
-                                 map<char, string>& encoding_table) {
-  if (root == NULL) {
-    return;
-  } else if (root->leaf) {
-    encoding_table[root->byte] = encoding;
-  } else {
-    BuildEncodingTableRecursive(
-        root->left, encoding + string(1, (char) 0), encoding_table);
-    BuildEncodingTableRecursive(
-        root->right, encoding + string(1, (char) 1), encoding_table);
+// Writes the number "value" of a sequence of an LZ77 block to "writer" with
+// the codes in "encoding_table".
+static inline void WriteMatchValue(unsigned int value,
+                                   const HuffmanCode* encoding_table,
+                                   BitWriter& writer) {
+  int extra_bits;
+  const HuffmanCode& code =
+      encoding_table[MatchValueSymbol(value, extra_bits)];
+  writer.WriteLongBits(code.code, code.length);
+  if (extra_bits > 0) {
+    writer.WriteBits(value & ((1u << extra_bits) - 1), extra_bits);
   }
 }
 
-map<char, string> BuildEncodingTable(HuffmanNode* root) {
-  map<char, string> encoding_table;
-  BuildEncodingTableRecursive(root, "", encoding_table);
-  return encoding_table;
+// Writes the payload of "block", which uses its LZ77 matches, to "output".
+static void WriteMatchBlock(const EncoderBlock& block, char* output) {
+  BitWriter writer(output);
+  EncodeCodeLengths(block.literal_lengths, 256, writer);
+  HuffmanCode value_tables[kMatchValueKinds][kMatchValueSymbols];
+  for (int kind = 0; kind < kMatchValueKinds; kind++) {
+    EncodeCodeLengths(block.value_lengths[kind], kMatchValueSymbols, writer);
+    BuildSymbolTable(block.value_lengths[kind], kMatchValueSymbols,
+                     value_tables[kind]);
+  }
+  writer.WriteBits(block.literal_count, 32);
+  writer.WriteBits((unsigned int) block.literals_size, 32);
+  char* literal_data = output + writer.Finish();
+
+  // The literals of all the sequences are written as one bit sequence, and
+  // the numbers of the sequences as another one after it.
+  HuffmanCode literal_table[256];
+  BuildEncodingTable(block.literal_lengths, literal_table);
+  BitWriter literal_writer(literal_data);
+  BitWriter sequence_writer(literal_data + block.literals_size);
+  unsigned int offset = 0;
+  for (size_t i = 0; i < block.sequences.size(); i++) {
+    const Lz77Sequence& sequence = block.sequences[i];
+    EncodeData(block.data + offset, sequence.literals, literal_table,
+               literal_writer);
+    offset += sequence.literals + sequence.length;
+    unsigned int values[kMatchValueKinds];
+    int kinds = SequenceValues(sequence, values);
+    for (int kind = 0; kind < kinds; kind++) {
+      WriteMatchValue(values[kind], value_tables[kind], sequence_writer);
+    }
+  }
+  literal_writer.Finish();
+  sequence_writer.Finish();
 }
 
-map<char, unsigned int> CalculateByteFrequencies(ReadStream* read_stream) {
-  map<char, unsigned int> freq;
-  while (true) {
-    char byte;
-    if (!read_stream->ReadByte(byte)) {
-      break;
+// Writes the payload of "block", which uses the Burrows-Wheeler transform,
+// to "output".
+static void WriteSortedBlock(const EncoderBlock& block, char* output) {
+  BitWriter writer(output);
+  EncodeCodeLengths(block.sorted_lengths, kBwtSymbols, writer);
+  for (int segment = 0; segment < kBwtSegments; segment++) {
+    writer.WriteBits(block.sorted_rows[segment], 32);
+  }
+  HuffmanCode encoding_table[kBwtSymbols];
+  BuildSymbolTable(block.sorted_lengths, kBwtSymbols, encoding_table);
+  for (size_t i = 0; i < block.sorted_symbols.size(); i++) {
+    const HuffmanCode& code = encoding_table[block.sorted_symbols[i]];
+    writer.WriteLongBits(code.code, code.length);
+  }
+  writer.Finish();
+}
+
+// Writes the payload of "block", which is coded with an asymmetric numeral
+// system, to "output".
+static void WriteAnsBlock(const EncoderBlock& block, char* output) {
+  BitWriter writer(output);
+  EncodeAnsCounts(block.ans_counts, block.ans_table_log, writer);
+  char* stream = output + writer.Finish();
+  std::copy(block.ans_stream.begin(), block.ans_stream.end(), stream);
+}
+
+// Writes the payload of "block", which is coded as 16-bit symbols, to
+// "output".
+static void WriteWideBlock(const EncoderBlock& block, char* output) {
+  const unsigned char* bytes = (const unsigned char*) block.data;
+  int last_byte = block.size % 2 == 1 ? bytes[block.size - 1] : -1;
+  BitWriter writer(output);
+  WriteWideCode(block.wide_symbols, block.wide_lengths, last_byte, &writer);
+  char* body = output + writer.Finish();
+
+  // The codes are kept with their lengths in the lowest kWideLengthBits
+  // bits, indexed by symbol.
+  int symbols = (int) block.wide_symbols.size();
+  vector<unsigned long long> codes(symbols);
+  BuildCanonicalCodes(&block.wide_lengths[0], symbols, &codes[0]);
+  vector<unsigned int> encoding_table(kWideSymbols, 0);
+  for (int i = 0; i < symbols; i++) {
+    encoding_table[block.wide_symbols[i]] =
+        (unsigned int) (codes[i] << kWideLengthBits) | block.wide_lengths[i];
+  }
+  BitWriter body_writer(body);
+  for (unsigned int i = 0; i + 1 < block.size; i += 2) {
+    unsigned int code = encoding_table[bytes[i] | (bytes[i + 1] << 8)];
+    body_writer.WriteBits(code >> kWideLengthBits,
+                          code & ((1 << kWideLengthBits) - 1));
+  }
+  body_writer.Finish();
+}
+
+// Writes every block at its offset in "output". The last block is marked as
+// the last block of the data if "last" is true.
+struct WriteBlocks {
+  vector<EncoderBlock>& blocks;
+  char* output;
+  bool last;
+
+  WriteBlocks(vector<EncoderBlock>& blocks, char* output, bool last)
+      : blocks(blocks), output(output), last(last) {}
+
+  void operator () (size_t index) {
+    EncoderBlock& block = blocks[index];
+    char* header = output + block.offset;
+    header[0] = 0;
+    if (last && index == blocks.size() - 1) {
+      header[0] |= kLastBlock;
+    }
+    if (block.reuse_code) {
+      header[0] |= kReusePreviousCode;
+    }
+    if (block.interleaved && !block.context && !block.stored &&
+        !block.matched && !block.sorted && !block.ans && !block.wide &&
+        block.size > 0) {
+      header[0] |= kInterleavedStreams;
+    }
+    int method = kHuffmanMethod;
+    if (block.context) {
+      method = kContextMethod;
+    } else if (block.stored) {
+      method = kStoredMethod;
+    } else if (block.matched) {
+      method = kMatchMethod;
+    } else if (block.sorted) {
+      method = kSortedMethod;
+    } else if (block.ans) {
+      method = kAnsMethod;
+    } else if (block.wide) {
+      method = kWideMethod;
+    }
+    header[0] |= method << kMethodShift;
+    size_t header_size = 1;
+    header_size += StoreVarint(block.size, header + header_size);
+    header_size += StoreVarint(block.payload_size, header + header_size);
+    if (block.size == 0) {
+      return;
+    }
+    if (block.stored) {
+      std::copy(block.data, block.data + block.size, header + header_size);
+      return;
+    }
+    if (block.context) {
+      WriteContextBlock(block, header + header_size);
+      return;
+    }
+    if (block.matched) {
+      WriteMatchBlock(block, header + header_size);
+      return;
+    }
+    if (block.sorted) {
+      WriteSortedBlock(block, header + header_size);
+      return;
+    }
+    if (block.ans) {
+      WriteAnsBlock(block, header + header_size);
+      return;
+    }
+    if (block.wide) {
+      WriteWideBlock(block, header + header_size);
+      return;
+    }
+
+    HuffmanCode encoding_table[256];
+    BuildEncodingTable(block.lengths, encoding_table);
+    BitWriter writer(header + header_size);
+    if (!block.reuse_code) {
+      EncodeCodeLengths(block.lengths, 256, writer);
+    }
+    if (!block.interleaved) {
+      EncodeData(block.data, block.size, encoding_table, writer);
+      writer.Finish();
+      return;
+    }
+
+    // The code lengths end on a byte boundary, so the stream sizes and the
+    // streams can be placed after them byte by byte.
+    for (int stream = 0; stream < kHuffmanStreams - 1; stream++) {
+      writer.WriteBits(block.stream_sizes[stream], 32);
+    }
+    char* stream_data = header + header_size + writer.Finish();
+    for (int stream = 0; stream < kHuffmanStreams; stream++) {
+      unsigned int start = HuffmanStreamStart(block.size, stream);
+      unsigned int end = HuffmanStreamStart(block.size, stream + 1);
+      BitWriter stream_writer(stream_data);
+      EncodeData(block.data + start, end - start, encoding_table,
+                 stream_writer);
+      stream_data += stream_writer.Finish();
+    }
+  }
+};
+
+// The description of a block that is being decoded.
+struct DecoderBlock {
+  const char* payload;
+  size_t payload_size;
+  unsigned int size;
+  unsigned char lengths[256];
+  bool interleaved;
+  const char* streams[kHuffmanStreams];
+  size_t stream_sizes[kHuffmanStreams];
+  size_t offset;
+  bool stored;
+
+  // The order-1 context code of the block, as in "EncoderBlock".
+  bool context;
+  int clusters;
+  unsigned char cluster_map[256];
+  vector<unsigned char> cluster_lengths;
+
+  // Whether the block is coded as LZ77 matches. The literals are then coded
+  // with "lengths" in the "literals_size" bytes at "literals", and the
+  // sequences take the rest of the payload after them.
+  bool matched;
+  unsigned char value_lengths[kMatchValueKinds][kMatchValueSymbols];
+  unsigned int literal_count;
+  const char* literals;
+  size_t literals_size;
+
+  // Whether the block uses the Burrows-Wheeler transform, the code lengths
+  // of its symbols and the rows of its segments.
+  bool sorted;
+  unsigned char sorted_lengths[kBwtSymbols];
+  unsigned int sorted_rows[kBwtSegments];
+
+  // Whether the block is coded with an asymmetric numeral system and the
+  // scaled counts of its bytes.
+  bool ans;
+  int ans_table_log;
+  unsigned short ans_counts[256];
+
+  // Whether the block is coded as 16-bit symbols, the symbols with a code
+  // and their code lengths as in "EncoderBlock", and the last byte of a
+  // block of odd size.
+  bool wide;
+  vector<unsigned short> wide_symbols;
+  vector<unsigned char> wide_lengths;
+  unsigned char wide_last_byte;
+};
+
+// Reads the cluster map and the code lengths of the context code of "block"
+// from its payload and moves the payload past them. Returns false if they
+// are not valid.
+static bool ParseContextCode(DecoderBlock& block) {
+  BitReader reader(block.payload, block.payload_size);
+  block.clusters = reader.ReadBits(8) + 1;
+  int cluster_bits = ClusterBits(block.clusters);
+  for (int context = 0; context < 256; context++) {
+    block.cluster_map[context] =
+        cluster_bits > 0 ? reader.ReadBits(cluster_bits) : 0;
+    if (block.cluster_map[context] >= block.clusters) {
+      return false;
+    }
+  }
+  size_t code_size = 1 + 32 * cluster_bits;
+  block.cluster_lengths.resize(block.clusters * 256);
+  for (int cluster = 0; cluster < block.clusters; cluster++) {
+    unsigned char* lengths = &block.cluster_lengths[cluster * 256];
+    if (!DecodeCodeLengths(reader, lengths, 256)) {
+      return false;
+    }
+    code_size += CodeLengthsSize(lengths, 256);
+  }
+  if (code_size > block.payload_size) {
+    return false;
+  }
+  block.payload += code_size;
+  block.payload_size -= code_size;
+  return true;
+}
+
+// Reads the code lengths and the literal sizes of "block", which uses its
+// LZ77 matches, from its payload, finds its literals and moves the payload
+// past the code lengths. Returns false if they are not valid.
+static bool ParseMatchCode(DecoderBlock& block) {
+  BitReader reader(block.payload, block.payload_size);
+  if (!DecodeCodeLengths(reader, block.lengths, 256)) {
+    return false;
+  }
+  size_t code_size = CodeLengthsSize(block.lengths, 256);
+  for (int kind = 0; kind < kMatchValueKinds; kind++) {
+    unsigned char* lengths = block.value_lengths[kind];
+    if (!DecodeCodeLengths(reader, lengths, kMatchValueSymbols)) {
+      return false;
+    }
+    code_size += CodeLengthsSize(lengths, kMatchValueSymbols);
+  }
+  block.literal_count = reader.ReadBits(32);
+  block.literals_size = reader.ReadBits(32);
+  if (reader.Overrun() || code_size + kMatchSizesSize > block.payload_size) {
+    return false;
+  }
+  block.payload += code_size;
+  block.payload_size -= code_size;
+  block.literals = block.payload + kMatchSizesSize;
+  return block.literal_count <= block.size &&
+         block.literals_size <= block.payload_size - kMatchSizesSize;
+}
+
+// Reads the code lengths and the rows of "block", which uses the
+// Burrows-Wheeler transform, from its payload and moves the payload past the
+// code lengths. Returns false if they are not valid.
+static bool ParseSortedCode(DecoderBlock& block) {
+  BitReader reader(block.payload, block.payload_size);
+  if (!DecodeCodeLengths(reader, block.sorted_lengths, kBwtSymbols)) {
+    return false;
+  }
+  for (int segment = 0; segment < kBwtSegments; segment++) {
+    block.sorted_rows[segment] = reader.ReadBits(32);
+  }
+  size_t code_size = CodeLengthsSize(block.sorted_lengths, kBwtSymbols);
+  if (reader.Overrun() || code_size + kSortedRowsSize > block.payload_size) {
+    return false;
+  }
+  block.payload += code_size;
+  block.payload_size -= code_size;
+  return true;
+}
+
+// Reads the scaled counts of "block", which is coded with an asymmetric
+// numeral system, from its payload and moves the payload past them. Returns
+// false if they are not valid.
+static bool ParseAnsCode(DecoderBlock& block) {
+  BitReader reader(block.payload, block.payload_size);
+  if (!DecodeAnsCounts(reader, block.ans_counts, block.ans_table_log)) {
+    return false;
+  }
+  size_t counts_size = AnsCountsSize(block.ans_counts, block.ans_table_log);
+  if (counts_size > block.payload_size) {
+    return false;
+  }
+  block.payload += counts_size;
+  block.payload_size -= counts_size;
+  return true;
+}
+
+// Reads the description of the code of "block", which is coded as 16-bit
+// symbols, from its payload and moves the payload past it. Returns false if
+// it is not valid.
+static bool ParseWideCode(DecoderBlock& block) {
+  BitReader reader(block.payload, block.payload_size);
+  int symbols = reader.ReadBits(16) + 1;
+  block.wide_symbols.resize(symbols);
+  block.wide_lengths.resize(symbols);
+  int previous = -1;
+  for (int i = 0; i < symbols; i++) {
+    int high_bit = 0;
+    while (reader.ReadBits(1) == 0) {
+      if (++high_bit > 16) {
+        return false;
+      }
+    }
+    unsigned int difference = 1u << high_bit;
+    if (high_bit > 0) {
+      difference |= reader.ReadBits(high_bit);
+    }
+    if (previous + difference >= (unsigned int) kWideSymbols) {
+      return false;
+    }
+    previous += difference;
+    block.wide_symbols[i] = (unsigned short) previous;
+    block.wide_lengths[i] = reader.ReadBits(kWideLengthBits);
+    if (block.wide_lengths[i] == 0 ||
+        block.wide_lengths[i] > kWideMaxCodeLength) {
+      return false;
+    }
+  }
+  int last_byte = -1;
+  if (block.size % 2 == 1) {
+    block.wide_last_byte = reader.ReadBits(8);
+    last_byte = block.wide_last_byte;
+  }
+  vector<unsigned long long> codes(symbols);
+  if (reader.Overrun() ||
+      !BuildCanonicalCodes(&block.wide_lengths[0], symbols, &codes[0])) {
+    return false;
+  }
+  size_t code_size = (WriteWideCode(block.wide_symbols, block.wide_lengths,
+                                    last_byte, NULL) + 7) / 8;
+  if (code_size > block.payload_size) {
+    return false;
+  }
+  block.payload += code_size;
+  block.payload_size -= code_size;
+  return true;
+}
+
+// Finds the streams in the body of the interleaved "block". Returns false if
+// the stream sizes do not fit in the body.
+static bool ParseStreams(DecoderBlock& block) {
+  if (block.payload_size < kStreamSizesSize) {
+    return false;
+  }
+  const char* stream_data = block.payload + kStreamSizesSize;
+  size_t remaining = block.payload_size - kStreamSizesSize;
+  for (int stream = 0; stream < kHuffmanStreams; stream++) {
+    size_t stream_size = remaining;
+    if (stream < kHuffmanStreams - 1) {
+      stream_size = LoadUnsignedInt32(block.payload + 4 * stream);
+    }
+    if (stream_size > remaining) {
+      return false;
+    }
+    block.streams[stream] = stream_data;
+    block.stream_sizes[stream] = stream_size;
+    stream_data += stream_size;
+    remaining -= stream_size;
+  }
+  return true;
+}
+
+// Reads the header of the block at "position" in the "size" bytes at "data"
+// into "block", including its code lengths, and moves "position" past the
+// block. "Previous_lengths" are the code lengths of the previous block, or
+// NULL if there is no previous block or it has none that the block may use.
+// Returns false if the block is not valid.
+static bool ParseBlock(const char* data,
+                       size_t size,
+                       size_t& position,
+                       const unsigned char* previous_lengths,
+                       DecoderBlock& block,
+                       unsigned char& flags) {
+  if (position >= size) {
+    return false;
+  }
+  flags = data[position++];
+  int method = (flags & kMethodMask) >> kMethodShift;
+  if ((flags & kUnusedFlags) || method > kWideMethod ||
+      (method != kHuffmanMethod &&
+       (flags & (kReusePreviousCode | kInterleavedStreams | kIndexBlock)))) {
+    return false;
+  }
+  unsigned long long block_size;
+  unsigned long long payload_size;
+  if (!LoadVarint(data, size, position, block_size) ||
+      !LoadVarint(data, size, position, payload_size) ||
+      block_size > 0xffffffffu ||
+      size - position < payload_size ||
+      (block_size / 8 > payload_size &&
+       (method == kHuffmanMethod || method == kContextMethod ||
+        method == kStoredMethod)) ||
+      (method == kWideMethod && block_size / 16 > payload_size)) {
+    // Every byte takes at least one bit, unless it is copied, part of a
+    // run or coded with an asymmetric numeral system, and every 16-bit
+    // symbol takes at least one bit.
+    return false;
+  }
+  if ((flags & kIndexBlock) && (block_size != 0 || !(flags & kLastBlock))) {
+    return false;
+  }
+  block.size = (unsigned int) block_size;
+  block.payload_size = payload_size;
+  block.payload = data + position;
+  position += block.payload_size;
+  block.interleaved = false;
+  block.context = false;
+  block.stored = false;
+  block.matched = false;
+  block.sorted = false;
+  block.ans = false;
+  block.wide = false;
+  if (block.size == 0) {
+    return true;
+  }
+
+  if (method == kContextMethod) {
+    block.context = true;
+    return ParseContextCode(block);
+  }
+  if (method == kStoredMethod) {
+    block.stored = true;
+    return block.payload_size == block.size;
+  }
+  if (method == kMatchMethod) {
+    block.matched = true;
+    return ParseMatchCode(block);
+  }
+  if (method == kSortedMethod) {
+    block.sorted = true;
+    return ParseSortedCode(block);
+  }
+  if (method == kAnsMethod) {
+    block.ans = true;
+    return ParseAnsCode(block);
+  }
+  if (method == kWideMethod) {
+    block.wide = true;
+    return ParseWideCode(block);
+  }
+  if (flags & kReusePreviousCode) {
+    if (previous_lengths == NULL) {
+      return false;
+    }
+    for (int byte = 0; byte < 256; byte++) {
+      block.lengths[byte] = previous_lengths[byte];
+    }
+  } else {
+    BitReader reader(block.payload, block.payload_size);
+    if (!DecodeCodeLengths(reader, block.lengths, 256)) {
+      return false;
+    }
+    size_t lengths_size = CodeLengthsSize(block.lengths, 256);
+    if (lengths_size > block.payload_size) {
+      return false;
+    }
+    block.payload += lengths_size;
+    block.payload_size -= lengths_size;
+  }
+  block.interleaved = (flags & kInterleavedStreams) != 0;
+  return !block.interleaved || ParseStreams(block);
+}
+
+// Decodes the body of "block", which uses its context code, and stores the
+// result in "output". Returns false if the body ends before all the bytes of
+// the block are decoded.
+static bool DecodeContextBlock(const DecoderBlock& block, char* output) {
+  vector<HuffmanDecodeTable> tables(block.clusters);
+  for (int cluster = 0; cluster < block.clusters; cluster++) {
+    const unsigned char* lengths = &block.cluster_lengths[cluster * 256];
+    unsigned long long codes[256];
+    BuildCanonicalCodes(lengths, 256, codes);
+    BuildDecodeTable(codes, lengths, 256, tables[cluster]);
+    // An entry may only decode two bytes if the second one is coded in the
+    // same cluster as the first one.
+    for (int index = 0; index < (1 << kHuffmanLookupBits); index++) {
+      HuffmanDecodeEntry& entry = tables[cluster][index];
+      if (entry.count == 2 &&
+          block.cluster_map[entry.symbols & 0xff] != cluster) {
+        entry.count = 1;
+        entry.bits = entry.first_bits;
+        entry.symbols &= 0xffff;
+      }
+    }
+  }
+  const HuffmanDecodeEntry* context_tables[256];
+  for (int context = 0; context < 256; context++) {
+    context_tables[context] = &tables[block.cluster_map[context]][0];
+  }
+  BitReader reader(block.payload, block.payload_size);
+  DecodeContextBytes(reader, context_tables, output, block.size);
+  return !reader.Overrun();
+}
+
+// Follows the links to secondary tables starting from "entry" until an entry
+// that decodes a symbol is reached. The bits that select the secondary tables
+// are consumed from "reader".
+static const HuffmanDecodeEntry* DecodeLongCode(
+    BitReader& reader,
+    const HuffmanDecodeEntry* table,
+    const HuffmanDecodeEntry* entry) {
+  while (entry->count == 0) {
+    reader.SkipBits(entry->bits);
+    reader.Refill();
+    entry = &table[entry->symbols + reader.PeekBits(entry->subtable_bits)];
+  }
+  return entry;
+}
+
+// Reads a number of a sequence of an LZ77 block from "reader" with the
+// decoding table "table".
+static inline unsigned int ReadMatchValue(BitReader& reader,
+                                          const HuffmanDecodeTable& table) {
+  int symbol = DecodeSymbol(reader, table);
+  if (symbol < (int) kDirectMatchValues) {
+    return symbol;
+  }
+  int extra_bits = symbol - 12;
+  return (1u << extra_bits) | reader.ReadBits(extra_bits);
+}
+
+// Decodes the body of "block", which uses its LZ77 matches, and stores the
+// result in "output". Returns false if the sequences do not add up to the
+// bytes of the block or refer to bytes outside of it.
+static bool DecodeMatchBlock(const DecoderBlock& block, char* output) {
+  unsigned long long codes[256];
+  BuildCanonicalCodes(block.lengths, 256, codes);
+  HuffmanDecodeTable literal_table;
+  BuildDecodeTable(codes, block.lengths, 256, literal_table);
+  vector<char> literals(block.literal_count + 1);
+  BitReader literal_reader(block.literals, block.literals_size);
+  DecodeBytes(literal_reader, literal_table, &literals[0],
+              block.literal_count);
+  if (literal_reader.Overrun()) {
+    return false;
+  }
+  HuffmanDecodeTable tables[kMatchValueKinds];
+  for (int kind = 0; kind < kMatchValueKinds; kind++) {
+    BuildCanonicalCodes(block.value_lengths[kind], kMatchValueSymbols, codes);
+    BuildDecodeTable(codes, block.value_lengths[kind], kMatchValueSymbols,
+                     tables[kind]);
+  }
+
+  size_t sequences_offset = kMatchSizesSize + block.literals_size;
+  BitReader reader(block.payload + sequences_offset,
+                   block.payload_size - sequences_offset);
+  const char* literal = &literals[0];
+  const char* literals_end = literal + block.literal_count;
+  char* position = output;
+  char* end = output + block.size;
+  while (true) {
+    unsigned int run = ReadMatchValue(reader, tables[0]);
+    if (run > (size_t) (end - position) ||
+        run > (size_t) (literals_end - literal)) {
+      return false;
+    }
+    std::copy(literal, literal + run, position);
+    literal += run;
+    position += run;
+    if (position == end) {
+      break;
+    }
+    unsigned long long length =
+        ReadMatchValue(reader, tables[1]) + (unsigned long long) kLz77MinMatch;
+    unsigned long long distance = ReadMatchValue(reader, tables[2]) + 1ull;
+    if (length > (size_t) (end - position) ||
+        distance > (size_t) (position - output)) {
+      return false;
+    }
+    const char* source = position - distance;
+    if (distance >= length) {
+      std::copy(source, source + length, position);
+      position += length;
+    } else {
+      // The copy overlaps the bytes that it produces, which repeats the
+      // last "distance" bytes.
+      for (char* copy_end = position + length; position < copy_end;) {
+        *position++ = *source++;
+      }
+    }
+  }
+  return literal == literals_end && !reader.Overrun();
+}
+
+// Decodes the body of "block", which uses the Burrows-Wheeler transform, and
+// stores the result in "output". Returns false if the symbols do not add up
+// to the bytes of the block or the transform is not valid.
+static bool DecodeSortedBlock(const DecoderBlock& block, char* output) {
+  unsigned long long codes[kBwtSymbols];
+  BuildCanonicalCodes(block.sorted_lengths, kBwtSymbols, codes);
+  HuffmanDecodeTable table;
+  BuildDecodeTable(codes, block.sorted_lengths, kBwtSymbols, table);
+  BitReader reader(block.payload + kSortedRowsSize,
+                   block.payload_size - kSortedRowsSize);
+
+  // Undo the move-to-front coding as the symbols are decoded. The number of
+  // symbols is not stored, so both symbols of a first level entry are only
+  // used if the bytes are not complete after the first one.
+  vector<unsigned char> transformed(block.size);
+  MoveToFrontDecoder decoder(&transformed[0], block.size);
+  while (!decoder.Done()) {
+    // A refill guarantees 56 bits, which is enough for four lookups in the
+    // first level table.
+    reader.Refill();
+    for (int i = 0; i < 4 && !decoder.Done(); i++) {
+      const HuffmanDecodeEntry* entry =
+          &table[reader.PeekBits(kHuffmanLookupBits)];
+      if (entry->count == 2) {
+        if (!decoder.Decode(entry->symbols & 0xffff)) {
+          return false;
+        }
+        if (decoder.Done()) {
+          reader.SkipBits(entry->first_bits);
+          break;
+        }
+        if (!decoder.Decode(entry->symbols >> 16)) {
+          return false;
+        }
+        reader.SkipBits(entry->bits);
+        continue;
+      }
+      if (entry->count == 0) {
+        entry = DecodeLongCode(reader, &table[0], entry);
+      }
+      if (!decoder.Decode(entry->symbols & 0xffff)) {
+        return false;
+      }
+      reader.SkipBits(entry->first_bits);
+    }
+  }
+  decoder.Finish();
+  if (reader.Overrun()) {
+    return false;
+  }
+  return InverseBurrowsWheelerTransform(&transformed[0], block.size,
+                                        block.sorted_rows, output);
+}
+
+// Decodes the body of "block", which is coded as 16-bit symbols, and stores
+// the result in "output". Returns false if the body ends before all the
+// symbols of the block are decoded.
+static bool DecodeWideBlock(const DecoderBlock& block, char* output) {
+  int symbols = (int) block.wide_symbols.size();
+  vector<unsigned long long> codes(symbols);
+  BuildCanonicalCodes(&block.wide_lengths[0], symbols, &codes[0]);
+  HuffmanDecodeTable table;
+  BuildDecodeTable(&codes[0], &block.wide_lengths[0], symbols, table);
+  // The table decodes the indexes of the symbols in the list of symbols
+  // with a code, which are replaced by the symbols themselves.
+  for (size_t index = 0; index < table.size(); index++) {
+    HuffmanDecodeEntry& entry = table[index];
+    if (entry.count == 0) {
+      continue;
+    }
+    unsigned int first = block.wide_symbols[entry.symbols & 0xffff];
+    unsigned int second = 0;
+    if (entry.count == 2) {
+      second = block.wide_symbols[entry.symbols >> 16];
+    }
+    entry.symbols = first | (second << 16);
+  }
+  BitReader reader(block.payload, block.payload_size);
+  DecodeWideSymbols(reader, table, output, block.size / 2);
+  if (block.size % 2 == 1) {
+    output[block.size - 1] = (char) block.wide_last_byte;
+  }
+  return !reader.Overrun();
+}
+
+// Decodes the body of "block" and stores the result in "output". Returns
+// false if the body ends before all the bytes of the block are decoded.
+static bool DecodeBlock(const DecoderBlock& block, char* output) {
+  if (block.size == 0) {
+    return true;
+  }
+  if (block.stored) {
+    std::copy(block.payload, block.payload + block.size, output);
+    return true;
+  }
+  if (block.context) {
+    return DecodeContextBlock(block, output);
+  }
+  if (block.matched) {
+    return DecodeMatchBlock(block, output);
+  }
+  if (block.sorted) {
+    return DecodeSortedBlock(block, output);
+  }
+  if (block.wide) {
+    return DecodeWideBlock(block, output);
+  }
+  if (block.ans) {
+    return AnsDecode(block.payload, block.payload_size, block.ans_counts,
+                     block.ans_table_log, output, block.size);
+  }
+  unsigned long long codes[256];
+  BuildCanonicalCodes(block.lengths, 256, codes);
+  HuffmanDecodeTable table;
+  BuildDecodeTable(codes, block.lengths, 256, table);
+  if (block.interleaved) {
+    return DecodeInterleavedBytes(block.streams, block.stream_sizes, table,
+                                  output, block.size);
+  }
+  BitReader reader(block.payload, block.payload_size);
+  DecodeBytes(reader, table, output, block.size);
+  return !reader.Overrun();
+}
+
+// Decodes every block at its offset in "output" and records in "valid"
+// whether all of them were valid.
+struct DecodeBlocks {
+  vector<DecoderBlock>& blocks;
+  char* output;
+  std::atomic<bool> valid;
+
+  DecodeBlocks(vector<DecoderBlock>& blocks, char* output)
+      : blocks(blocks), output(output), valid(true) {}
+
+  void operator () (size_t index) {
+    if (!DecodeBlock(blocks[index], output + blocks[index].offset)) {
+      valid = false;
+    }
+  }
+};
+
+// Parses the blocks in the "size" bytes at "data" into "blocks" and sets
+// their offsets in the decoded data, whose size is stored in "decoded_size".
+// "Previous" is the code of the block before the first one, or NULL if there
+// is none. Sets "last" if the last block of the data is found, which must
+// then be the end of "data". Returns false if some block is not valid.
+static bool ParseBlocks(const char* data,
+                        size_t size,
+                        const PreviousCode* previous,
+                        vector<DecoderBlock>& blocks,
+                        bool& last,
+                        size_t& decoded_size) {
+  blocks.clear();
+  last = false;
+  decoded_size = 0;
+  size_t position = 0;
+  const unsigned char* previous_lengths =
+      previous != NULL && previous->valid ? previous->lengths : NULL;
+  while (position < size) {
+    if (last) {
+      return false;
+    }
+    blocks.push_back(DecoderBlock());
+    DecoderBlock& block = blocks.back();
+    if (blocks.size() > 1) {
+      const DecoderBlock& before = blocks[blocks.size() - 2];
+      previous_lengths = HasReusableCode(before) ? before.lengths : NULL;
+    }
+    unsigned char flags;
+    if (!ParseBlock(data, size, position, previous_lengths, block, flags)) {
+      return false;
+    }
+    block.offset = decoded_size;
+    decoded_size += block.size;
+    last = (flags & kLastBlock) != 0;
+  }
+  return true;
+}
+
+// Decodes "blocks" in parallel on up to "threads" threads at their offsets
+// in "decoded_data", which must have room for all of them. Returns false if
+// some block is not valid.
+static bool DecodeParsedBlocks(vector<DecoderBlock>& blocks,
+                               unsigned int threads,
+                               char* decoded_data) {
+  DecodeBlocks decode_blocks(blocks, decoded_data);
+  ParallelFor(blocks.size(), threads, decode_blocks);
+  return decode_blocks.valid;
+}
+
+// The entry of a block in the block index.
+struct IndexEntry {
+  // The offsets of the block in the decoded and in the encoded data.
+  unsigned long long decoded_offset;
+  unsigned long long encoded_offset;
+  unsigned int size;
+  unsigned long long encoded_size;
+  // The number of blocks back to the block with the code lengths that the
+  // block uses, or 0 if it has its own.
+  unsigned long long code_distance;
+};
+
+// Appends the entries of "blocks", which have been laid out and follow the
+// blocks that are already in "index", to "index".
+static void AddIndexEntries(const vector<EncoderBlock>& blocks,
+                            vector<IndexEntry>& index) {
+  for (size_t i = 0; i < blocks.size(); i++) {
+    IndexEntry entry;
+    entry.decoded_offset = 0;
+    entry.encoded_offset = 0;
+    entry.code_distance = 0;
+    if (!index.empty()) {
+      const IndexEntry& previous = index.back();
+      entry.decoded_offset = previous.decoded_offset + previous.size;
+      entry.encoded_offset = previous.encoded_offset + previous.encoded_size;
+      if (blocks[i].reuse_code) {
+        entry.code_distance = previous.code_distance + 1;
+      }
+    }
+    entry.size = blocks[i].size;
+    entry.encoded_size = blocks[i].header_size + blocks[i].payload_size;
+    index.push_back(entry);
+  }
+}
+
+// Returns the number of bytes that the block index for "index" takes and
+// writes it to "output" if it is not NULL.
+static size_t WriteIndexBlock(const vector<IndexEntry>& index, char* output) {
+  size_t payload_size = VarintSize(index.size()) + kIndexFooterSize;
+  for (size_t i = 0; i < index.size(); i++) {
+    payload_size += VarintSize(index[i].size) +
+                    VarintSize(index[i].encoded_size) +
+                    VarintSize(index[i].code_distance);
+  }
+  size_t index_size = 1 + VarintSize(0) + VarintSize(payload_size) +
+                      payload_size;
+  if (output == NULL) {
+    return index_size;
+  }
+  size_t position = 0;
+  output[position++] = kIndexBlock | kLastBlock;
+  position += StoreVarint(0, output + position);
+  position += StoreVarint(payload_size, output + position);
+  position += StoreVarint(index.size(), output + position);
+  for (size_t i = 0; i < index.size(); i++) {
+    position += StoreVarint(index[i].size, output + position);
+    position += StoreVarint(index[i].encoded_size, output + position);
+    position += StoreVarint(index[i].code_distance, output + position);
+  }
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    output[position++] = (char) (index_size >> shift);
+  }
+  return index_size;
+}
+
+// Reads the size of the block index from the last kIndexFooterSize bytes of
+// the "size" bytes of encoded data, which are at "footer", into
+// "index_size". Returns false if the size is not that of a block index in
+// the data.
+static bool LoadIndexSize(const char* footer,
+                          unsigned long long size,
+                          unsigned long long& index_size) {
+  index_size = 0;
+  for (size_t i = 0; i < kIndexFooterSize; i++) {
+    index_size = (index_size << 8) | (unsigned char) footer[i];
+  }
+  // The flags, the two sizes, the number of blocks and the footer.
+  return index_size >= 4 + kIndexFooterSize && index_size <= size;
+}
+
+// Parses the block index in the "size" bytes at "data" into "index".
+// "Blocks_size" is the number of bytes that the blocks before the index
+// take, which the sizes in the index must add up to. Returns false if the
+// index is not valid.
+static bool ParseIndexBlock(const char* data,
+                            size_t size,
+                            unsigned long long blocks_size,
+                            vector<IndexEntry>& index) {
+  index.clear();
+  size_t position = 1;
+  unsigned long long block_size;
+  unsigned long long payload_size;
+  unsigned long long count;
+  if (size < 1 || (unsigned char) data[0] != (kIndexBlock | kLastBlock) ||
+      !LoadVarint(data, size, position, block_size) || block_size != 0 ||
+      !LoadVarint(data, size, position, payload_size) ||
+      payload_size != size - position ||
+      !LoadVarint(data, size - kIndexFooterSize, position, count)) {
+    return false;
+  }
+  unsigned long long decoded_offset = 0;
+  unsigned long long encoded_offset = 0;
+  for (unsigned long long i = 0; i < count; i++) {
+    IndexEntry entry;
+    unsigned long long entry_size;
+    if (!LoadVarint(data, size - kIndexFooterSize, position, entry_size) ||
+        !LoadVarint(data, size - kIndexFooterSize, position,
+                    entry.encoded_size) ||
+        !LoadVarint(data, size - kIndexFooterSize, position,
+                    entry.code_distance) ||
+        entry_size > 0xffffffffu || entry.code_distance > i ||
+        entry.encoded_size > blocks_size - encoded_offset) {
+      return false;
+    }
+    entry.size = (unsigned int) entry_size;
+    entry.decoded_offset = decoded_offset;
+    entry.encoded_offset = encoded_offset;
+    decoded_offset += entry.size;
+    encoded_offset += entry.encoded_size;
+    index.push_back(entry);
+  }
+  return position == size - kIndexFooterSize &&
+         encoded_offset == blocks_size;
+}
+
+// Finds the blocks in "index" that the "length" bytes from "offset" of the
+// decoded data overlap, from "first" up to but not including "end". Returns
+// false if the range does not lie within the decoded data.
+static bool FindRangeBlocks(const vector<IndexEntry>& index,
+                            unsigned long long offset,
+                            size_t length,
+                            size_t& first,
+                            size_t& end) {
+  unsigned long long decoded_size =
+      index.empty() ? 0 : index.back().decoded_offset + index.back().size;
+  if (offset > decoded_size || length > decoded_size - offset) {
+    return false;
+  }
+  first = 0;
+  end = 0;
+  if (length == 0) {
+    return true;
+  }
+  // The first block is the last one that starts at or before "offset", and
+  // the blocks end before the first one that starts at or after the end of
+  // the range.
+  size_t low = 0;
+  size_t high = index.size();
+  while (high - low > 1) {
+    size_t middle = low + (high - low) / 2;
+    if (index[middle].decoded_offset <= offset) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  first = low;
+  end = first + 1;
+  while (end < index.size() &&
+         index[end].decoded_offset < offset + length) {
+    end++;
+  }
+  return true;
+}
+
+// Decodes the blocks "first" up to "end" of "index", whose encoded data is
+// at "range_data", and stores the "length" bytes from "offset" of the
+// decoded data in "decoded_data". "Code_data" holds the block with the code
+// lengths that block "first" uses if it does not have its own. "Threads" is
+// used as in "HuffmanDecodeFile". Returns false if the blocks are not valid.
+static bool DecodeRangeBlocks(const vector<IndexEntry>& index,
+                              size_t first,
+                              size_t end,
+                              const char* code_data,
+                              const char* range_data,
+                              unsigned long long offset,
+                              size_t length,
+                              unsigned int threads,
+                              string& decoded_data) {
+  // The code lengths are the same all the way from the block that has them
+  // to block "first", so only that block needs to be parsed.
+  PreviousCode code;
+  bool last;
+  size_t decoded_size;
+  if (index[first].code_distance > 0) {
+    const IndexEntry& code_entry = index[first - index[first].code_distance];
+    vector<DecoderBlock> code_blocks;
+    if (!ParseBlocks(code_data, code_entry.encoded_size, NULL, code_blocks,
+                     last, decoded_size)) {
+      return false;
+    }
+    if (!code_blocks.empty()) {
+      KeepPreviousCode(code_blocks.back(), code);
+    }
+  }
+  vector<DecoderBlock> blocks;
+  size_t range_size = index[end - 1].encoded_offset +
+                      index[end - 1].encoded_size -
+                      index[first].encoded_offset;
+  if (!ParseBlocks(range_data, range_size, &code, blocks, last,
+                   decoded_size) ||
+      blocks.size() != end - first) {
+    return false;
+  }
+  for (size_t i = 0; i < blocks.size(); i++) {
+    if (blocks[i].size != index[first + i].size) {
+      return false;
+    }
+  }
+  decoded_data.resize(decoded_size);
+  if (!DecodeParsedBlocks(blocks, threads, &decoded_data[0])) {
+    decoded_data.clear();
+    return false;
+  }
+  decoded_data.erase(0, offset - index[first].decoded_offset);
+  decoded_data.resize(length);
+  return true;
+}
+
+// Sets up "block" to encode the "size" bytes at "data" with "options".
+static void SetUpBlock(const char* data,
+                       unsigned int size,
+                       const HuffmanEncodeOptions& options,
+                       EncoderBlock& block) {
+  int max_code_length = options.max_code_length;
+  if (max_code_length > 0 && max_code_length < 8) {
+    max_code_length = 8;
+  }
+  block.data = data;
+  block.size = size;
+  block.interleaved = options.interleaved_streams;
+  block.max_code_length = max_code_length;
+  block.max_clusters = options.context_clusters < 256
+                           ? options.context_clusters
+                           : 256;
+  block.min_saving = options.min_saving;
+  block.match_level = options.match_level;
+  block.matched = false;
+  block.block_sorting = options.block_sorting;
+  block.sorted = false;
+  block.ans_coding = options.ans_coding;
+  block.ans = false;
+  block.wide_coding = options.wide_symbols;
+  block.wide = false;
+}
+
+// Lays "blocks", whose codes have been chosen, out one after another and
+// returns the size of the encoded data.
+static size_t LayOutBlocks(vector<EncoderBlock>& blocks) {
+  size_t encoded_size = 0;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    blocks[i].header_size = 1 + VarintSize(blocks[i].size) +
+                            VarintSize(blocks[i].payload_size);
+    blocks[i].offset = encoded_size;
+    encoded_size += blocks[i].header_size + blocks[i].payload_size;
+  }
+  return encoded_size;
+}
+
+// Splits the "size" bytes at "data" into "blocks", chooses the code of every
+// block and lays the blocks out one after another. Returns the size of the
+// encoded data. Empty data is encoded as a single empty block. If "previous"
+// is not NULL, it holds the code of the block before the data, which the
+// first block may use, and is replaced by that of the last block of the
+// data.
+static size_t PlanEncodedBlocks(const char* data,
+                                size_t size,
+                                const HuffmanEncodeOptions& options,
+                                PreviousCode* previous,
+                                vector<EncoderBlock>& blocks) {
+  size_t block_size = options.block_size > 0 ? options.block_size : 1;
+  blocks.clear();
+  blocks.resize((size + block_size - 1) / block_size);
+  if (blocks.empty()) {
+    blocks.resize(1);
+  }
+  for (size_t i = 0; i < blocks.size(); i++) {
+    SetUpBlock(data + i * block_size,
+               (unsigned int) ((i + 1 < blocks.size())
+                                   ? block_size
+                                   : size - i * block_size),
+               options, blocks[i]);
+  }
+
+  // The frequencies and the codes are computed in parallel. Then the blocks
+  // are laid out in the output one after another, so that they can be
+  // encoded in parallel directly at their place in the output.
+  PlanBlocks plan_blocks(blocks);
+  ParallelFor(blocks.size(), options.threads, plan_blocks);
+  ChooseBlockCodes(blocks, previous);
+  if (previous != NULL) {
+    KeepPreviousCode(blocks.back(), *previous);
+  }
+  return LayOutBlocks(blocks);
+}
+
+// Encodes the "size" bytes at "data" as a sequence of blocks and appends
+// them to "encoded_data". If "last" is true, the data is the end of the
+// input and its last block is marked as such. "Previous" and "blocks" are
+// used as in "PlanEncodedBlocks". If "options.block_index" is set, the
+// blocks are added to "index", which holds the blocks before them, and the
+// index is appended after the last block.
+static void EncodeBlocks(const char* data,
+                         size_t size,
+                         bool last,
+                         const HuffmanEncodeOptions& options,
+                         PreviousCode* previous,
+                         vector<EncoderBlock>& blocks,
+                         vector<IndexEntry>& index,
+                         string& encoded_data) {
+  size_t start = encoded_data.size();
+  size_t blocks_size = PlanEncodedBlocks(data, size, options, previous,
+                                         blocks);
+  size_t index_size = 0;
+  if (options.block_index) {
+    AddIndexEntries(blocks, index);
+    if (last) {
+      index_size = WriteIndexBlock(index, NULL);
+    }
+  }
+  encoded_data.resize(start + blocks_size + index_size);
+  WriteBlocks write_blocks(blocks, &encoded_data[start],
+                           last && !options.block_index);
+  ParallelFor(blocks.size(), options.threads, write_blocks);
+  if (index_size > 0) {
+    WriteIndexBlock(index, &encoded_data[start + blocks_size]);
+  }
+}
+
+// Returns the number of blocks that are encoded together by a
+// "HuffmanEncoder", which is one block for each of "threads" threads.
+static size_t BatchBlocks(unsigned int threads) {
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+  }
+  return threads > 0 ? threads : 1;
+}
+
+// Sources of input and sinks for output of "EncodePipelined" and
+// "DecodePipelined". "Read" reads up to "bytes" bytes into "buffer" and returns
+// the number of bytes read, which is less than "bytes" only at the end of
+// the input. "Write" writes the "bytes" bytes at "data".
+struct ReadStreamSource {
+  ReadStream* read_stream;
+
+  ReadStreamSource(ReadStream* read_stream) : read_stream(read_stream) {}
+
+  size_t Read(char* buffer, size_t bytes) {
+    return read_stream->ReadBytes(buffer, bytes);
+  }
+};
+
+struct IstreamSource {
+  istream& input;
+
+  IstreamSource(istream& input) : input(input) {}
+
+  size_t Read(char* buffer, size_t bytes) {
+    input.read(buffer, bytes);
+    return input.gcount();
+  }
+};
+
+struct WriteStreamSink {
+  WriteStream* write_stream;
+
+  WriteStreamSink(WriteStream* write_stream) : write_stream(write_stream) {}
+
+  void Write(const char* data, size_t bytes) {
+    write_stream->WriteBytes(data, bytes);
+  }
+};
+
+struct OstreamSink {
+  ostream& output;
+
+  OstreamSink(ostream& output) : output(output) {}
+
+  void Write(const char* data, size_t bytes) {
+    output.write(data, bytes);
+  }
+};
+
+// The number of blocks that "EncodePipelined" and "DecodePipelined" hold in
+// memory for every one of "threads" threads: one that is being processed
+// and one that is being read or written. Two more make up for threads that
+// run ahead of the others.
+static size_t PipelineSlots(unsigned int threads) {
+  return 2 * BatchBlocks(threads) + 2;
+}
+
+// The stages of "EncodePipelined", each of which works on one block.
+template <typename Source, typename Sink>
+struct EncodeStages {
+  // A block of input and its encoded form.
+  struct Slot {
+    vector<char> data;
+    unsigned int size;
+    bool last;
+    vector<EncoderBlock> blocks;
+    string encoded_data;
+  };
+
+  Source& source;
+  Sink& sink;
+  const HuffmanEncodeOptions& options;
+  size_t block_size;
+  vector<Slot> slots;
+  // The byte that follows the block that was read last, if any.
+  char next;
+  bool has_next;
+  // The code of the block whose code was chosen last.
+  PreviousCode previous;
+  // The blocks that have been written, if "options.block_index" is set.
+  vector<IndexEntry> index;
+
+  EncodeStages(Source& source, Sink& sink, const HuffmanEncodeOptions& options)
+      : source(source),
+        sink(sink),
+        options(options),
+        block_size(options.block_size > 0 ? options.block_size : 1),
+        slots(PipelineSlots(options.threads)),
+        next(0),
+        has_next(false) {}
+
+  bool Read(size_t index, bool& last) {
+    // One byte more than a block is read, so that it is known whether a
+    // block is the last one before it is encoded. The extra byte then starts
+    // the next block.
+    Slot& slot = slots[index];
+    slot.data.resize(block_size + 1);
+    size_t filled = 0;
+    if (has_next) {
+      slot.data[0] = next;
+      filled = 1;
+    }
+    filled += source.Read(&slot.data[filled], block_size + 1 - filled);
+    last = filled <= block_size;
+    has_next = !last;
+    if (has_next) {
+      next = slot.data[block_size];
+      filled = block_size;
+    }
+    slot.size = (unsigned int) filled;
+    slot.last = last;
+    return true;
+  }
+
+  bool Process(size_t index, size_t slot_index, Pipeline& pipeline) {
+    Slot& slot = slots[slot_index];
+    slot.blocks.resize(1);
+    SetUpBlock(&slot.data[0], slot.size, options, slot.blocks[0]);
+    PlanBlocks plan_blocks(slot.blocks);
+    plan_blocks(0);
+    // A block may use the code of the block before it, so the codes are
+    // chosen in order.
+    if (!pipeline.Wait(index)) {
+      return false;
+    }
+    ChooseBlockCodes(slot.blocks, &previous);
+    KeepPreviousCode(slot.blocks[0], previous);
+    pipeline.Done(index);
+    slot.encoded_data.resize(LayOutBlocks(slot.blocks));
+    WriteBlocks write_blocks(slot.blocks, &slot.encoded_data[0],
+                             slot.last && !options.block_index);
+    write_blocks(0);
+    return true;
+  }
+
+  void Write(size_t slot_index) {
+    Slot& slot = slots[slot_index];
+    sink.Write(slot.encoded_data.data(), slot.encoded_data.size());
+    if (options.block_index) {
+      AddIndexEntries(slot.blocks, index);
+      if (slot.last) {
+        vector<char> index_block(WriteIndexBlock(index, NULL));
+        WriteIndexBlock(index, &index_block[0]);
+        sink.Write(&index_block[0], index_block.size());
+      }
+    }
+  }
+};
+
+// Encodes all the input of "source" and writes the result to "sink". One
+// thread reads the input a block at a time, "options.threads" threads
+// encode the blocks and the calling thread writes them in order, so reading,
+// encoding and writing overlap. Only "PipelineSlots" blocks are held in
+// memory at a time no matter how large the input is. The result is the same
+// as that of "HuffmanEncodeBuffer" on the whole input.
+template <typename Source, typename Sink>
+static void EncodePipelined(Source& source,
+                            Sink& sink,
+                            const HuffmanEncodeOptions& options) {
+  EncodeStages<Source, Sink> stages(source, sink, options);
+  RunPipeline(options.threads, stages.slots.size(), stages);
+}
+
+// Reads the next block from "source" as it is and appends it to "buffer".
+// Stores the flags of the block in "flags". Returns false if the input ends
+// before the end of the block or the block header is not valid.
+template <typename Source>
+static bool ReadBlock(Source& source, vector<char>& buffer,
+                      unsigned char& flags) {
+  // The header is read a byte at a time until both of its variable length
+  // integers have ended.
+  size_t start = buffer.size();
+  char byte;
+  if (source.Read(&byte, 1) != 1) {
+    return false;
+  }
+  buffer.push_back(byte);
+  for (int i = 0; i < 2; i++) {
+    do {
+      if (buffer.size() - start >= kMaxBlockHeaderSize ||
+          source.Read(&byte, 1) != 1) {
+        return false;
+      }
+      buffer.push_back(byte);
+    } while (byte & 128);
+  }
+  size_t position = start + 1;
+  unsigned long long size;
+  unsigned long long payload_size;
+  if (!LoadVarint(&buffer[0], buffer.size(), position, size) ||
+      !LoadVarint(&buffer[0], buffer.size(), position, payload_size)) {
+    return false;
+  }
+  flags = buffer[start];
+
+  // The payload grows as it is read, so that a damaged size can not cause a
+  // huge allocation before the end of the input is noticed.
+  while (payload_size > 0) {
+    size_t piece = payload_size < STREAM_BUFFER_SIZE ? payload_size
+                                                     : STREAM_BUFFER_SIZE;
+    size_t end = buffer.size();
+    buffer.resize(end + piece);
+    if (source.Read(&buffer[end], piece) != piece) {
+      return false;
+    }
+    payload_size -= piece;
+  }
+  return true;
+}
+
+// The stages of "DecodePipelined", each of which works on one block.
+template <typename Source, typename Sink>
+struct DecodeStages {
+  // A block of encoded data and its decoded form.
+  struct Slot {
+    vector<char> data;
+    vector<DecoderBlock> blocks;
+    string decoded_data;
+  };
+
+  Source& source;
+  Sink& sink;
+  vector<Slot> slots;
+  // The code of the block that was parsed last.
+  PreviousCode previous;
+
+  DecodeStages(Source& source, Sink& sink, unsigned int threads)
+      : source(source),
+        sink(sink),
+        slots(PipelineSlots(threads)) {}
+
+  bool Read(size_t index, bool& last) {
+    // The header of a block only takes a moment to parse, and the next block
+    // may need the code lengths of this one, so blocks are parsed as they
+    // are read.
+    Slot& slot = slots[index];
+    slot.data.clear();
+    unsigned char flags;
+    size_t decoded_size;
+    if (!ReadBlock(source, slot.data, flags) ||
+        !ParseBlocks(&slot.data[0], slot.data.size(), &previous,
+                     slot.blocks, last, decoded_size)) {
+      return false;
+    }
+    KeepPreviousCode(slot.blocks.back(), previous);
+    return true;
+  }
+
+  bool Process(size_t, size_t slot_index, Pipeline&) {
+    Slot& slot = slots[slot_index];
+    slot.decoded_data.resize(slot.blocks[0].size);
+    return DecodeParsedBlocks(
+        slot.blocks, 1,
+        slot.decoded_data.empty() ? NULL : &slot.decoded_data[0]);
+  }
+
+  void Write(size_t index) {
+    sink.Write(slots[index].decoded_data.data(),
+               slots[index].decoded_data.size());
+  }
+};
+
+// Decodes the blocks in "source" up to the last one and writes the result to
+// "sink". Like "EncodePipelined", one thread reads the blocks, "threads"
+// threads decode them and the calling thread writes them in order. Returns
+// false if the input is not valid, in which case part of the result may
+// already have been written.
+template <typename Source, typename Sink>
+static bool DecodePipelined(Source& source, Sink& sink, unsigned int threads) {
+  DecodeStages<Source, Sink> stages(source, sink, threads);
+  return RunPipeline(threads, stages.slots.size(), stages);
+}
+
+HuffmanEncodeOptions::HuffmanEncodeOptions() {
+  this->block_size = kHuffmanDefaultBlockSize;
+  this->threads = 0;
+  this->interleaved_streams = false;
+  this->max_code_length = kHuffmanDefaultMaxCodeLength;
+  this->context_clusters = 0;
+  this->min_saving = kHuffmanDefaultMinSaving;
+  this->block_index = false;
+  this->match_level = 0;
+  this->block_sorting = false;
+  this->ans_coding = false;
+  this->wide_symbols = false;
+}
+
+void HuffmanEncodeFile(const string& input_file,
+                       const string& output_file,
+                       const HuffmanEncodeOptions& options) {
+  ifstream input_stream(input_file.c_str(), std::ifstream::binary);
+  ofstream output_stream(output_file.c_str(), std::ofstream::binary);
+  HuffmanEncodeStream(input_stream, output_stream, options);
+}
+
+bool HuffmanDecodeFile(const string& input_file,
+                       const string& output_file,
+                       unsigned int threads) {
+  ifstream input_stream(input_file.c_str(), std::ifstream::binary);
+  ofstream output_stream(output_file.c_str(), std::ofstream::binary);
+  return HuffmanDecodeStream(input_stream, output_stream, threads);
+}
+
+void HuffmanEncodeStream(istream& input,
+                         ostream& output,
+                         const HuffmanEncodeOptions& options) {
+  IstreamSource source(input);
+  OstreamSink sink(output);
+  EncodePipelined(source, sink, options);
+  output.flush();
+}
+
+bool HuffmanDecodeStream(istream& input,
+                         ostream& output,
+                         unsigned int threads) {
+  IstreamSource source(input);
+  OstreamSink sink(output);
+  bool valid = DecodePipelined(source, sink, threads);
+  output.flush();
+  if (!valid) {
+    return false;
+  }
+  // Nothing may follow the last block.
+  char byte;
+  return source.Read(&byte, 1) == 0;
+}
+
+void HuffmanEncodeString(const string& data,
+                         string& encoded_data,
+                         const HuffmanEncodeOptions& options) {
+  HuffmanEncodeBuffer(data.data(), data.size(), encoded_data, options);
+}
+
+bool HuffmanDecodeString(const string& data,
+                         string& decoded_data,
+                         unsigned int threads) {
+  return HuffmanDecodeBuffer(data.data(), data.size(), decoded_data, threads);
+}
+
+void HuffmanEncode(ReadStream* read_stream,
+                   WriteStream* write_stream,
+                   const HuffmanEncodeOptions& options) {
+  ReadStreamSource source(read_stream);
+  WriteStreamSink sink(write_stream);
+  EncodePipelined(source, sink, options);
+  write_stream->Flush();
+}
+
+void HuffmanEncodeBuffer(const char* data,
+                         size_t size,
+                         string& encoded_data,
+                         const HuffmanEncodeOptions& options) {
+  vector<EncoderBlock> blocks;
+  vector<IndexEntry> index;
+  encoded_data.clear();
+  EncodeBlocks(data, size, true, options, NULL, blocks, index, encoded_data);
+}
+
+bool HuffmanEncodeBuffer(const char* data,
+                         size_t size,
+                         char* encoded_data,
+                         size_t capacity,
+                         size_t& encoded_size,
+                         const HuffmanEncodeOptions& options) {
+  vector<EncoderBlock> blocks;
+  size_t blocks_size = PlanEncodedBlocks(data, size, options, NULL, blocks);
+  vector<IndexEntry> index;
+  size_t index_size = 0;
+  if (options.block_index) {
+    AddIndexEntries(blocks, index);
+    index_size = WriteIndexBlock(index, NULL);
+  }
+  encoded_size = blocks_size + index_size;
+  if (encoded_size > capacity) {
+    return false;
+  }
+  WriteBlocks write_blocks(blocks, encoded_data, !options.block_index);
+  ParallelFor(blocks.size(), options.threads, write_blocks);
+  if (options.block_index) {
+    WriteIndexBlock(index, encoded_data + blocks_size);
+  }
+  return true;
+}
+
+size_t HuffmanMaxEncodedSize(size_t size,
+                             const HuffmanEncodeOptions& options) {
+  // Every block takes at most as many bytes as it holds, plus its header,
+  // since blocks that coding does not make smaller are stored.
+  size_t block_size = options.block_size > 0 ? options.block_size : 1;
+  size_t blocks = size > 0 ? (size + block_size - 1) / block_size : 1;
+  size_t largest_block = size < block_size ? size : block_size;
+  size_t largest_header = 1 + 2 * VarintSize(largest_block);
+  size_t max_size = size + blocks * largest_header;
+  if (options.block_index) {
+    max_size += 1 + VarintSize(0) + kMaxVarintSize + VarintSize(blocks) +
+                blocks * (VarintSize(largest_block) +
+                          VarintSize(largest_block + largest_header) +
+                          VarintSize(blocks)) +
+                kIndexFooterSize;
+  }
+  return max_size;
+}
+
+bool HuffmanDecode(ReadStream* read_stream, WriteStream* write_stream) {
+  ReadStreamSource source(read_stream);
+  WriteStreamSink sink(write_stream);
+  if (!DecodePipelined(source, sink, 1)) {
+    return false;
+  }
+  write_stream->Flush();
+  return true;
+}
+
+bool HuffmanDecodeBuffer(const char* data,
+                         size_t size,
+                         string& decoded_data,
+                         unsigned int threads) {
+  // The headers are read one after another to find where every block
+  // starts in the input and in the output. Then the blocks are decoded in
+  // parallel.
+  decoded_data.clear();
+  vector<DecoderBlock> blocks;
+  bool last;
+  size_t decoded_size;
+  if (!ParseBlocks(data, size, NULL, blocks, last, decoded_size) || !last) {
+    return false;
+  }
+  decoded_data.resize(decoded_size);
+  if (!DecodeParsedBlocks(blocks, threads,
+                          decoded_size > 0 ? &decoded_data[0] : NULL)) {
+    decoded_data.clear();
+    return false;
+  }
+  return true;
+}
+
+bool HuffmanDecodeBuffer(const char* data,
+                         size_t size,
+                         char* decoded_data,
+                         size_t decoded_size,
+                         unsigned int threads) {
+  vector<DecoderBlock> blocks;
+  bool last;
+  size_t parsed_size;
+  if (!ParseBlocks(data, size, NULL, blocks, last, parsed_size) || !last ||
+      parsed_size != decoded_size) {
+    return false;
+  }
+  return DecodeParsedBlocks(blocks, threads, decoded_data);
+}
+
+bool HuffmanDecodedSize(const char* data, size_t size, size_t& decoded_size) {
+  // Only the headers are read, but they are checked in full.
+  vector<DecoderBlock> blocks;
+  bool last;
+  return ParseBlocks(data, size, NULL, blocks, last, decoded_size) && last;
+}
+
+bool HuffmanHeaderSize(const char* data, size_t size, size_t& header_size) {
+  vector<DecoderBlock> blocks;
+  bool last;
+  size_t decoded_size;
+  if (!ParseBlocks(data, size, NULL, blocks, last, decoded_size) || !last) {
+    return false;
+  }
+  // Parsing leaves the payload of every block with just its coded bytes,
+  // except for the stream sizes of blocks with interleaved streams.
+  header_size = size;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    // The payload of an empty block is the block index.
+    if (blocks[i].size > 0) {
+      header_size -= blocks[i].payload_size;
+    }
+    if (blocks[i].interleaved) {
+      header_size += kStreamSizesSize;
+    }
+    if (blocks[i].matched) {
+      header_size += kMatchSizesSize;
+    }
+    if (blocks[i].sorted) {
+      header_size += kSortedRowsSize;
+    }
+  }
+  return true;
+}
+
+bool HuffmanDecodeRange(const char* data,
+                        size_t size,
+                        unsigned long long offset,
+                        size_t length,
+                        string& decoded_data,
+                        unsigned int threads) {
+  decoded_data.clear();
+  unsigned long long index_size;
+  vector<IndexEntry> index;
+  size_t first;
+  size_t end;
+  if (size < kIndexFooterSize ||
+      !LoadIndexSize(data + size - kIndexFooterSize, size, index_size) ||
+      !ParseIndexBlock(data + size - index_size, index_size,
+                       size - index_size, index) ||
+      !FindRangeBlocks(index, offset, length, first, end)) {
+    return false;
+  }
+  if (first == end) {
+    return true;
+  }
+  const IndexEntry& code_entry = index[first - index[first].code_distance];
+  return DecodeRangeBlocks(index, first, end,
+                           data + code_entry.encoded_offset,
+                           data + index[first].encoded_offset, offset,
+                           length, threads, decoded_data);
+}
+
+// Reads the "size" bytes at "position" in "input" into "buffer". Returns
+// false if they can not be read.
+static bool ReadAt(istream& input,
+                   unsigned long long position,
+                   char* buffer,
+                   size_t size) {
+  input.seekg(position);
+  input.read(buffer, size);
+  return input && (size_t) input.gcount() == size;
+}
+
+bool HuffmanDecodeFileRange(const string& input_file,
+                            unsigned long long offset,
+                            size_t length,
+                            string& decoded_data,
+                            unsigned int threads) {
+  decoded_data.clear();
+  ifstream input(input_file.c_str(), std::ifstream::binary);
+  input.seekg(0, std::ios::end);
+  std::streamoff file_size = input.tellg();
+  if (!input || file_size < (std::streamoff) kIndexFooterSize) {
+    return false;
+  }
+  unsigned long long size = file_size;
+  char footer[kIndexFooterSize];
+  unsigned long long index_size;
+  if (!ReadAt(input, size - kIndexFooterSize, footer, kIndexFooterSize) ||
+      !LoadIndexSize(footer, size, index_size)) {
+    return false;
+  }
+  vector<char> index_data(index_size);
+  vector<IndexEntry> index;
+  size_t first;
+  size_t end;
+  if (!ReadAt(input, size - index_size, &index_data[0], index_size) ||
+      !ParseIndexBlock(&index_data[0], index_size, size - index_size,
+                       index) ||
+      !FindRangeBlocks(index, offset, length, first, end)) {
+    return false;
+  }
+  if (first == end) {
+    return true;
+  }
+
+  // Only the blocks in the range are read, and the block with their code
+  // lengths if they do not have their own.
+  const IndexEntry& code_entry = index[first - index[first].code_distance];
+  vector<char> code_data;
+  if (index[first].code_distance > 0) {
+    code_data.resize(code_entry.encoded_size);
+    if (!ReadAt(input, code_entry.encoded_offset, &code_data[0],
+                code_data.size())) {
+      return false;
+    }
+  }
+  vector<char> range_data(index[end - 1].encoded_offset +
+                          index[end - 1].encoded_size -
+                          index[first].encoded_offset);
+  if (!ReadAt(input, index[first].encoded_offset, &range_data[0],
+              range_data.size())) {
+    return false;
+  }
+  return DecodeRangeBlocks(index, first, end,
+                           code_data.empty() ? NULL : &code_data[0],
+                           &range_data[0], offset, length, threads,
+                           decoded_data);
+}
+
+// The state of a "HuffmanEncoder" that uses the types of this file.
+struct HuffmanEncoderState {
+  PreviousCode previous;
+  vector<EncoderBlock> blocks;
+  vector<IndexEntry> index;
+};
+
+HuffmanEncoder::HuffmanEncoder(const HuffmanEncodeOptions& options)
+    : options_(options) {
+  size_t block_size = options.block_size > 0 ? options.block_size : 1;
+  this->batch_size_ = block_size * BatchBlocks(options.threads);
+  this->state_ = new HuffmanEncoderState;
+}
+
+HuffmanEncoder::~HuffmanEncoder() {
+  delete state_;
+}
+
+void HuffmanEncoder::Feed(const char* data, size_t size, string& output) {
+  pending_.insert(pending_.end(), data, data + size);
+  // Whole batches are encoded only once some input follows them, since the
+  // last block of the data is encoded differently.
+  if (pending_.size() > batch_size_) {
+    EncodePending((pending_.size() - 1) / batch_size_ * batch_size_, false,
+                  output);
+  }
+}
+
+void HuffmanEncoder::Flush(string& output) {
+  if (!pending_.empty()) {
+    EncodePending(pending_.size(), false, output);
+  }
+}
+
+void HuffmanEncoder::Finish(string& output) {
+  EncodePending(pending_.size(), true, output);
+  state_->previous.valid = false;
+  state_->index.clear();
+}
+
+void HuffmanEncoder::EncodePending(size_t size, bool last, string& output) {
+  EncodeBlocks(pending_.empty() ? NULL : &pending_[0], size, last, options_,
+               &state_->previous, state_->blocks, state_->index, output);
+  pending_.erase(pending_.begin(), pending_.begin() + size);
+}
+
+// Finds the blocks at the start of the "size" bytes at "data" that have
+// arrived in full and stores their total size in "whole_size". The search
+// stops after the last block of the data. Returns false if a block header
+// is not valid.
+static bool FindWholeBlocks(const char* data,
+                            size_t size,
+                            size_t& whole_size) {
+  whole_size = 0;
+  size_t position = 0;
+  while (position < size) {
+    size_t start = position;
+    unsigned char flags = data[position++];
+    unsigned long long block_size;
+    unsigned long long payload_size;
+    if (!LoadVarint(data, size, position, block_size) ||
+        !LoadVarint(data, size, position, payload_size)) {
+      // The rest of the header may not have arrived yet.
+      return size - start < kMaxBlockHeaderSize;
+    }
+    if (payload_size > size - position) {
+      return true;
+    }
+    position += payload_size;
+    whole_size = position;
+    if (flags & kLastBlock) {
+      return true;
+    }
+  }
+  return true;
+}
+
+// The state of a "HuffmanDecoder" that uses the types of this file.
+struct HuffmanDecoderState {
+  PreviousCode previous;
+  vector<DecoderBlock> blocks;
+};
+
+HuffmanDecoder::HuffmanDecoder(unsigned int threads) {
+  this->threads_ = threads;
+  this->state_ = new HuffmanDecoderState;
+  this->first_ = true;
+  this->last_ = false;
+  this->valid_ = true;
+}
+
+HuffmanDecoder::~HuffmanDecoder() {
+  delete state_;
+}
+
+bool HuffmanDecoder::Feed(const char* data, size_t size, string& output) {
+  // Nothing may follow the last block.
+  if (last_ && size > 0) {
+    valid_ = false;
+  }
+  if (!valid_) {
+    return false;
+  }
+  pending_.insert(pending_.end(), data, data + size);
+  size_t whole_size;
+  if (!FindWholeBlocks(pending_.empty() ? NULL : &pending_[0],
+                       pending_.size(), whole_size)) {
+    valid_ = false;
+    return false;
+  }
+  if (whole_size == 0) {
+    return true;
+  }
+  size_t decoded_size;
+  bool last;
+  size_t start = output.size();
+  if (!ParseBlocks(&pending_[0], whole_size, first_ ? NULL : &state_->previous,
+                   state_->blocks, last, decoded_size)) {
+    valid_ = false;
+    return false;
+  }
+  output.resize(start + decoded_size);
+  if (!DecodeParsedBlocks(state_->blocks, threads_,
+                          decoded_size > 0 ? &output[start] : NULL)) {
+    output.resize(start);
+    valid_ = false;
+    return false;
+  }
+  KeepPreviousCode(state_->blocks.back(), state_->previous);
+  pending_.erase(pending_.begin(), pending_.begin() + whole_size);
+  first_ = false;
+  last_ = last;
+  if (last_ && !pending_.empty()) {
+    valid_ = false;
+    return false;
+  }
+  return true;
+}
+
+bool HuffmanDecoder::Finish() {
+  bool valid = valid_ && last_ && pending_.empty();
+  pending_.clear();
+  first_ = true;
+  last_ = false;
+  valid_ = true;
+  return valid;
+}
+
+// Returns the number of 4 bit items that the code lengths take in their
+// serialized form and writes them to "writer" if it is not NULL.
+static unsigned int WriteCodeLengths(const unsigned char* lengths,
+                                     int symbols,
+                                     BitWriter* writer) {
+  unsigned int items = 0;
+  int symbol = 0;
+  while (symbol < symbols) {
+    if (lengths[symbol] == 0) {
+      int run = 1;
+      while (run < 271 &&
+             symbol + run < symbols &&
+             lengths[symbol + run] == 0) {
+        run++;
+      }
+      if (run < 16) {
+        if (writer != NULL) {
+          writer->WriteBits(0, 4);
+          writer->WriteBits(run - 1, 4);
+        }
+        items += 2;
+      } else {
+        if (writer != NULL) {
+          writer->WriteBits(0, 4);
+          writer->WriteBits(15, 4);
+          writer->WriteBits(run - 16, 8);
+        }
+        items += 4;
+      }
+      symbol += run;
+    } else if (lengths[symbol] < 15) {
+      if (writer != NULL) {
+        writer->WriteBits(lengths[symbol], 4);
+      }
+      items += 1;
+      symbol++;
+    } else {
+      if (writer != NULL) {
+        writer->WriteBits(15, 4);
+        writer->WriteBits(lengths[symbol], 8);
+      }
+      items += 3;
+      symbol++;
+    }
+  }
+  if (items % 2 == 1 && writer != NULL) {
+    writer->WriteBits(0, 4);
+  }
+  return items;
+}
+
+void EncodeCodeLengths(const unsigned char* lengths,
+                       int symbols,
+                       BitWriter& writer) {
+  WriteCodeLengths(lengths, symbols, &writer);
+}
+
+unsigned int CodeLengthsSize(const unsigned char* lengths, int symbols) {
+  return (WriteCodeLengths(lengths, symbols, NULL) + 1) / 2;
+}
+
+bool DecodeCodeLengths(BitReader& reader,
+                       unsigned char* lengths,
+                       int symbols) {
+  unsigned int items = 0;
+  int symbol = 0;
+  while (symbol < symbols) {
+    unsigned int item = reader.ReadBits(4);
+    items++;
+    if (item == 0) {
+      unsigned int run = reader.ReadBits(4);
+      items++;
+      if (run == 15) {
+        unsigned int long_run = reader.ReadBits(8);
+        items += 2;
+        run += long_run;
+      }
+      if (symbol + (int) run >= symbols) {
+        return false;
+      }
+      for (unsigned int i = 0; i <= run; i++) {
+        lengths[symbol++] = 0;
+      }
+    } else if (item < 15) {
+      lengths[symbol++] = item;
+    } else {
+      unsigned int length = reader.ReadBits(8);
+      if (length > 64) {
+        return false;
+      }
+      items += 2;
+      lengths[symbol++] = length;
+    }
+  }
+  if (items % 2 == 1) {
+    // Skip the padding.
+    reader.ReadBits(4);
+  }
+  if (reader.Overrun()) {
+    return false;
+  }
+  vector<unsigned long long> codes(symbols);
+  return BuildCanonicalCodes(lengths, symbols, &codes[0]);
+}
+
+bool BuildCanonicalCodes(const unsigned char* lengths,
+                         int symbols,
+                         unsigned long long* codes) {
+  // Count the codes of each length. The number of codes that are still
+  // available at the current length must never drop below zero.
+  unsigned int counts[256] = {0};
+  for (int symbol = 0; symbol < symbols; symbol++) {
+    counts[lengths[symbol]]++;
+  }
+  long long available = 1;
+  unsigned long long next_codes[256];
+  unsigned long long code = 0;
+  for (int length = 1; length < 256; length++) {
+    available = 2 * available - counts[length];
+    if (available < 0) {
+      return false;
+    }
+    if (available > symbols) {
+      // There is room for all remaining symbols from here on.
+      available = symbols;
+    }
+    next_codes[length] = code;
+    code = (code + counts[length]) << 1;
+  }
+
+  for (int symbol = 0; symbol < symbols; symbol++) {
+    int length = lengths[symbol];
+    codes[symbol] = length > 0 ? next_codes[length]++ : 0;
+  }
+  return true;
+}
+
+void BuildEncodingTable(const unsigned char* lengths,
+                        HuffmanCode* encoding_table) {
+  unsigned long long codes[256];
+  BuildCanonicalCodes(lengths, 256, codes);
+  for (int byte = 0; byte < 256; byte++) {
+    encoding_table[byte].code = codes[byte];
+    encoding_table[byte].length = lengths[byte];
+  }
+}
+
+void EncodeContextData(const char* data,
+                       unsigned int size,
+                       const HuffmanCode* encoding_tables,
+                       const unsigned char* cluster_map,
+                       BitWriter& writer) {
+  const unsigned char* bytes = (const unsigned char*) data;
+  unsigned char previous = 0;
+  for (unsigned int i = 0; i < size; i++) {
+    const HuffmanCode& code =
+        encoding_tables[cluster_map[previous] * 256 + bytes[i]];
+    if (code.length <= 32) {
+      writer.WriteBits((unsigned int) code.code, code.length);
+    } else {
+      writer.WriteLongBits(code.code, code.length);
+    }
+    previous = bytes[i];
+  }
+}
+
+void EncodeData(const char* data,
+                unsigned int size,
+                const HuffmanCode* encoding_table,
+                BitWriter& writer) {
+  const unsigned char* bytes = (const unsigned char*) data;
+  for (unsigned int i = 0; i < size; i++) {
+    const HuffmanCode& code = encoding_table[bytes[i]];
+    if (code.length <= 32) {
+      writer.WriteBits((unsigned int) code.code, code.length);
+    } else {
+      writer.WriteLongBits(code.code, code.length);
+    }
+  }
+}
+
+void DecodeBytes(BitReader& reader,
+                 const HuffmanDecodeTable& table,
+                 char* output,
+                 unsigned int bytes) {
+  char* end = output + bytes;
+  while (output < end) {
+    // A refill guarantees 56 bits, which is enough for four lookups in the
+    // first level table.
+    reader.Refill();
+    for (int i = 0; i < 4 && output < end; i++) {
+      const HuffmanDecodeEntry* entry =
+          &table[reader.PeekBits(kHuffmanLookupBits)];
+      if (entry->count == 2 && end - output >= 2) {
+        output[0] = (char) entry->symbols;
+        output[1] = (char) (entry->symbols >> 16);
+        reader.SkipBits(entry->bits);
+        output += 2;
+        continue;
+      }
+      if (entry->count == 0) {
+        entry = DecodeLongCode(reader, &table[0], entry);
+      }
+      *output++ = (char) entry->symbols;
+      reader.SkipBits(entry->first_bits);
+    }
+  }
+}
+
+void DecodeWideSymbols(BitReader& reader,
+                       const HuffmanDecodeTable& table,
+                       char* output,
+                       unsigned int symbols) {
+  char* end = output + 2 * (size_t) symbols;
+  while (output < end) {
+    reader.Refill();
+    for (int i = 0; i < 4 && output < end; i++) {
+      const HuffmanDecodeEntry* entry =
+          &table[reader.PeekBits(kHuffmanLookupBits)];
+      if (entry->count == 2 && end - output >= 4) {
+        // Both symbols are in the order of their bytes.
+        output[0] = (char) entry->symbols;
+        output[1] = (char) (entry->symbols >> 8);
+        output[2] = (char) (entry->symbols >> 16);
+        output[3] = (char) (entry->symbols >> 24);
+        reader.SkipBits(entry->bits);
+        output += 4;
+        continue;
+      }
+      if (entry->count == 0) {
+        entry = DecodeLongCode(reader, &table[0], entry);
+      }
+      output[0] = (char) entry->symbols;
+      output[1] = (char) (entry->symbols >> 8);
+      reader.SkipBits(entry->first_bits);
+      output += 2;
+    }
+  }
+}
+
+int DecodeSymbol(BitReader& reader, const HuffmanDecodeTable& table) {
+  reader.Refill();
+  const HuffmanDecodeEntry* entry =
+      &table[reader.PeekBits(kHuffmanLookupBits)];
+  if (entry->count == 0) {
+    entry = DecodeLongCode(reader, &table[0], entry);
+  }
+  reader.SkipBits(entry->first_bits);
+  return entry->symbols & 0xffff;
+}
+
+void DecodeContextBytes(BitReader& reader,
+                        const HuffmanDecodeEntry* const* context_tables,
+                        char* output,
+                        unsigned int bytes) {
+  char* end = output + bytes;
+  unsigned char previous = 0;
+  while (output < end) {
+    reader.Refill();
+    for (int i = 0; i < 4 && output < end; i++) {
+      const HuffmanDecodeEntry* table = context_tables[previous];
+      const HuffmanDecodeEntry* entry =
+          &table[reader.PeekBits(kHuffmanLookupBits)];
+      if (entry->count == 2 && end - output >= 2) {
+        output[0] = (char) entry->symbols;
+        output[1] = (char) (entry->symbols >> 16);
+        reader.SkipBits(entry->bits);
+        previous = (unsigned char) output[1];
+        output += 2;
+        continue;
+      }
+      if (entry->count == 0) {
+        entry = DecodeLongCode(reader, table, entry);
+      }
+      previous = (unsigned char) entry->symbols;
+      *output++ = (char) previous;
+      reader.SkipBits(entry->first_bits);
+    }
+  }
+}
+
+// Decodes one or two symbols with the first level entry of "table" that
+// matches the next bits in "reader" and stores them at "output". Returns the
+// position after the stored symbols. There must be room for two symbols at
+// "output" and at least kHuffmanLookupBits bits in "reader".
+static inline char* DecodeSymbols(BitReader& reader,
+                                  const HuffmanDecodeTable& table,
+                                  char* output) {
+  const HuffmanDecodeEntry* entry =
+      &table[reader.PeekBits(kHuffmanLookupBits)];
+  if (entry->count == 2) {
+    output[0] = (char) entry->symbols;
+    output[1] = (char) (entry->symbols >> 16);
+    reader.SkipBits(entry->bits);
+    return output + 2;
+  }
+  if (entry->count == 0) {
+    entry = DecodeLongCode(reader, &table[0], entry);
+  }
+  output[0] = (char) entry->symbols;
+  reader.SkipBits(entry->first_bits);
+  return output + 1;
+}
+
+bool DecodeInterleavedBytes(const char* const* streams,
+                            const size_t* stream_sizes,
+                            const HuffmanDecodeTable& table,
+                            char* output,
+                            unsigned int bytes) {
+  // The loop below is written out for kHuffmanStreams == 4.
+  BitReader reader0(streams[0], stream_sizes[0]);
+  BitReader reader1(streams[1], stream_sizes[1]);
+  BitReader reader2(streams[2], stream_sizes[2]);
+  BitReader reader3(streams[3], stream_sizes[3]);
+  BitReader* readers[kHuffmanStreams] = {
+    &reader0, &reader1, &reader2, &reader3
+  };
+  char* outputs[kHuffmanStreams];
+  char* ends[kHuffmanStreams];
+  for (int stream = 0; stream < kHuffmanStreams; stream++) {
+    outputs[stream] = output + HuffmanStreamStart(bytes, stream);
+    ends[stream] = output + HuffmanStreamStart(bytes, stream + 1);
+  }
+  char* output0 = outputs[0];
+  char* output1 = outputs[1];
+  char* output2 = outputs[2];
+  char* output3 = outputs[3];
+
+  // Every round decodes up to 8 bytes per stream from a single refill, so
+  // the rounds go on while every stream has at least 8 bytes left. The last
+  // stream is the shortest one.
+  while (ends[3] - output3 >= 8 &&
+         ends[0] - output0 >= 8 &&
+         ends[1] - output1 >= 8 &&
+         ends[2] - output2 >= 8) {
+    reader0.Refill();
+    reader1.Refill();
+    reader2.Refill();
+    reader3.Refill();
+    for (int i = 0; i < 4; i++) {
+      output0 = DecodeSymbols(reader0, table, output0);
+      output1 = DecodeSymbols(reader1, table, output1);
+      output2 = DecodeSymbols(reader2, table, output2);
+      output3 = DecodeSymbols(reader3, table, output3);
+    }
+  }
+  outputs[0] = output0;
+  outputs[1] = output1;
+  outputs[2] = output2;
+  outputs[3] = output3;
+
+  // The remaining bytes of each stream are decoded one stream at a time.
+  bool valid = true;
+  for (int stream = 0; stream < kHuffmanStreams; stream++) {
+    DecodeBytes(*readers[stream], table, outputs[stream],
+                ends[stream] - outputs[stream]);
+    if (readers[stream]->Overrun()) {
+      valid = false;
+    }
+  }
+  return valid;
+}
+
+unsigned int HuffmanStreamStart(unsigned int bytes, int stream) {
+  unsigned int part = bytes / kHuffmanStreams + (bytes % kHuffmanStreams != 0);
+  unsigned long long start = (unsigned long long) part * stream;
+  return start < bytes ? (unsigned int) start : bytes;
+}
+
+// Fills the part of a decoding table that starts at index "offset" and is
+// indexed by "table_bits" bits. "Symbols" lists the symbols whose codes start
+// with the "consumed" bits that lead to this part of the table. Codes that do
+// not fit in "table_bits" more bits get their own secondary tables, which are
+// appended to the end of "table".
+static void BuildDecodeTableLevel(const unsigned long long* codes,
+                                  const unsigned char* lengths,
+                                  const vector<int>& symbols,
+                                  int consumed,
+                                  size_t offset,
+                                  int table_bits,
+                                  HuffmanDecodeTable& table) {
+  map<unsigned int, vector<int> > long_codes;
+  for (size_t i = 0; i < symbols.size(); i++) {
+    int symbol = symbols[i];
+    int bits = lengths[symbol] - consumed;
+    if (bits > table_bits) {
+      unsigned int prefix = (unsigned int)
+          ((codes[symbol] >> (bits - table_bits)) & ((1u << table_bits) - 1));
+      long_codes[prefix].push_back(symbol);
+      continue;
+    }
+    unsigned int suffix = (unsigned int)
+        (codes[symbol] & ((1ull << bits) - 1));
+    unsigned int first = suffix << (table_bits - bits);
+    unsigned int last = first + (1u << (table_bits - bits));
+    for (unsigned int index = first; index < last; index++) {
+      HuffmanDecodeEntry& entry = table[offset + index];
+      entry.symbols = symbol;
+      entry.bits = bits;
+      entry.first_bits = bits;
+      entry.count = 1;
+      entry.subtable_bits = 0;
+    }
+  }
+
+  for (map<unsigned int, vector<int> >::iterator it = long_codes.begin();
+       it != long_codes.end();
+       it++) {
+    int max_length = 0;
+    for (size_t i = 0; i < it->second.size(); i++) {
+      if (lengths[it->second[i]] > max_length) {
+        max_length = lengths[it->second[i]];
+      }
+    }
+    int subtable_bits = max_length - consumed - table_bits;
+    if (subtable_bits > kHuffmanLookupBits) {
+      subtable_bits = kHuffmanLookupBits;
+    }
+    // Bit patterns that are not the prefix of any code decode to symbol 0
+    // without consuming bits, so that invalid data can not lead outside of
+    // the table.
+    HuffmanDecodeEntry empty = {0, 0, 0, 1, 0};
+    size_t subtable_offset = table.size();
+    table.resize(subtable_offset + (1u << subtable_bits), empty);
+    HuffmanDecodeEntry& entry = table[offset + it->first];
+    entry.symbols = subtable_offset;
+    entry.bits = table_bits;
+    entry.first_bits = 0;
+    entry.count = 0;
+    entry.subtable_bits = subtable_bits;
+    BuildDecodeTableLevel(codes, lengths, it->second, consumed + table_bits,
+                          subtable_offset, subtable_bits, table);
+  }
+}
+
+void BuildDecodeTable(const unsigned long long* codes,
+                      const unsigned char* lengths,
+                      int symbols,
+                      HuffmanDecodeTable& table) {
+  vector<int> used_symbols;
+  for (int symbol = 0; symbol < symbols; symbol++) {
+    if (lengths[symbol] > 0) {
+      used_symbols.push_back(symbol);
+    }
+  }
+
+  const unsigned int size = 1u << kHuffmanLookupBits;
+  HuffmanDecodeEntry empty = {0, 0, 0, 1, 0};
+  table.assign(size, empty);
+  BuildDecodeTableLevel(codes, lengths, used_symbols, 0, 0,
+                        kHuffmanLookupBits, table);
+
+  // Combine pairs of short codes that fit together in the first level table,
+  // so that a single lookup decodes both of them.
+  vector<HuffmanDecodeEntry> single(table.begin(), table.begin() + size);
+  for (unsigned int index = 0; index < size; index++) {
+    const HuffmanDecodeEntry& first = single[index];
+    if (first.count != 1) {
+      continue;
+    }
+    const HuffmanDecodeEntry& second =
+        single[(index << first.first_bits) & (size - 1)];
+    if (second.count != 1 ||
+        first.first_bits + second.first_bits > kHuffmanLookupBits) {
+      continue;
+    }
+    HuffmanDecodeEntry& entry = table[index];
+    entry.symbols = first.symbols | (second.symbols << 16);
+    entry.bits = first.first_bits + second.first_bits;
+    entry.count = 2;
+  }
+}
+
+bool HuffmanNodeCompare::operator () (const HuffmanNode& node1,
+                                      const HuffmanNode& node2) const {
+  if (node1.freq != node2.freq) {
+    return node1.freq < node2.freq;
+  }
+  return node1.symbol < node2.symbol;
+}
+
+// An item in a list of the package-merge algorithm. An item is either a
+// symbol ("symbol" is not negative) or a package of two items of the list
+// for the next longer code length ("symbol" is -1).
+struct PackageMergeItem {
+  unsigned long long weight;
+  int symbol;
+};
+
+// A functor for ordering package-merge items by smallest weight first.
+struct PackageMergeItemCompare {
+  bool operator () (const PackageMergeItem& item1,
+                    const PackageMergeItem& item2) const {
+    return item1.weight < item2.weight;
+  }
+};
+
+bool BuildLimitedCodeLengths(const unsigned int* frequencies,
+                             int symbols,
+                             int max_length,
+                             unsigned char* lengths) {
+  // A Huffman code is the best code of all, so if it is short enough it is
+  // also the best limited code. Package-merge is only needed otherwise.
+  if (symbols <= kHuffmanMaxTreeSymbols) {
+    HuffmanTree tree;
+    BuildHuffmanTree(frequencies, symbols, tree);
+    BuildCodeLengths(tree, symbols, lengths);
+    int longest = 0;
+    for (int symbol = 0; symbol < symbols; symbol++) {
+      longest = lengths[symbol] > longest ? lengths[symbol] : longest;
+    }
+    if (longest <= max_length) {
+      return true;
+    }
+  }
+
+  vector<PackageMergeItem> leaves;
+  for (int symbol = 0; symbol < symbols; symbol++) {
+    lengths[symbol] = 0;
+    if (frequencies[symbol] > 0) {
+      PackageMergeItem leaf = {frequencies[symbol], symbol};
+      leaves.push_back(leaf);
+    }
+  }
+  if (leaves.empty()) {
+    return true;
+  }
+  if (leaves.size() == 1) {
+    lengths[leaves[0].symbol] = 1;
+    return true;
+  }
+  if (max_length < 64 && leaves.size() > (1ull << max_length)) {
+    return false;
+  }
+
+  // Sort the symbols by weight, keeping symbols of equal weight in order.
+  std::stable_sort(leaves.begin(), leaves.end(), PackageMergeItemCompare());
+
+  // "lists[d]" holds the items for codes that are at least d + 1 bits
+  // shorter than "max_length". The list for the longest codes holds just the
+  // symbols. Every other list merges the symbols with the packages of
+  // consecutive pairs of items of the list before it.
+  vector<vector<PackageMergeItem> > lists(max_length);
+  lists[max_length - 1] = leaves;
+  for (int depth = max_length - 2; depth >= 0; depth--) {
+    const vector<PackageMergeItem>& previous = lists[depth + 1];
+    vector<PackageMergeItem>& list = lists[depth];
+    list.reserve(leaves.size() + previous.size() / 2);
+    size_t leaf = 0;
+    size_t pair = 0;
+    while (leaf < leaves.size() || pair + 1 < previous.size()) {
+      if (pair + 1 < previous.size() &&
+          (leaf == leaves.size() ||
+           previous[pair].weight + previous[pair + 1].weight <
+               leaves[leaf].weight)) {
+        PackageMergeItem package =
+            {previous[pair].weight + previous[pair + 1].weight, -1};
+        list.push_back(package);
+        pair += 2;
+      } else {
+        list.push_back(leaves[leaf++]);
+      }
+    }
+  }
+
+  // The first 2n - 2 items of the shortest code list make up the solution.
+  // Every symbol among them gets one more bit, and every package among them
+  // selects two more items of the next list.
+  size_t selected = 2 * leaves.size() - 2;
+  for (int depth = 0; depth < max_length; depth++) {
+    size_t packages = 0;
+    for (size_t i = 0; i < selected; i++) {
+      if (lists[depth][i].symbol < 0) {
+        packages++;
+      } else {
+        lengths[lists[depth][i].symbol]++;
+      }
+    }
+    selected = 2 * packages;
+  }
+  return true;
+}
+
+void BuildHuffmanTree(const unsigned int* frequencies,
+                      int symbols,
+                      HuffmanTree& tree) {
+  HuffmanNode* nodes = tree.nodes;
+  int leaves = 0;
+  for (int symbol = 0; symbol < symbols; symbol++) {
+    if (frequencies[symbol] > 0) {
+      HuffmanNode leaf = {frequencies[symbol], symbol, -1, -1};
+      nodes[leaves++] = leaf;
+    }
+  }
+  std::sort(nodes, nodes + leaves, HuffmanNodeCompare());
+
+  // Every inner node is created from the two nodes of smallest frequency
+  // that have no parent yet. The leaves are sorted and inner nodes are
+  // created in order of increasing frequency, so those two nodes are always
+  // at the front of the remaining leaves or inner nodes.
+  int size = leaves;
+  int leaf = 0;
+  int inner = leaves;
+  while (size < 2 * leaves - 1) {
+    int children[2];
+    for (int child = 0; child < 2; child++) {
+      if (leaf < leaves &&
+          (inner == size || nodes[leaf].freq <= nodes[inner].freq)) {
+        children[child] = leaf++;
+      } else {
+        children[child] = inner++;
+      }
+    }
+    HuffmanNode node = {nodes[children[0]].freq + nodes[children[1]].freq,
+                        -1, children[0], children[1]};
+    nodes[size++] = node;
+  }
+  tree.leaves = leaves;
+  tree.size = size;
+}
+
+void BuildCodeLengths(const HuffmanTree& tree,
+                      int symbols,
+                      unsigned char* lengths) {
+  for (int symbol = 0; symbol < symbols; symbol++) {
+    lengths[symbol] = 0;
+  }
+  if (tree.leaves <= 1) {
+    if (tree.leaves == 1) {
+      lengths[tree.nodes[0].symbol] = 1;
+    }
+    return;
+  }
+  // Every node comes before its parent, so going backwards from the root
+  // visits every inner node before its children.
+  unsigned char depths[2 * kHuffmanMaxTreeSymbols - 1];
+  depths[tree.size - 1] = 0;
+  for (int index = tree.size - 1; index >= tree.leaves; index--) {
+    const HuffmanNode& node = tree.nodes[index];
+    depths[node.left] = depths[index] + 1;
+    depths[node.right] = depths[index] + 1;
+  }
+  for (int index = 0; index < tree.leaves; index++) {
+    lengths[tree.nodes[index].symbol] = depths[index];
+  }
+}
+
+void CalculateByteFrequencies(const char* data,
+                              size_t size,
+                              unsigned long long* frequencies) {
+  for (int byte = 0; byte < 256; byte++) {
+    frequencies[byte] = 0;
+  }
+  // The counters of "CountBytesParallel" have 32 bits, so the data is
+  // counted in parts that can not overflow them.
+  const size_t kPartSize = 1u << 31;
+  for (size_t start = 0; start < size; start += kPartSize) {
+    unsigned int counts[256] = {0};
+    size_t part_size = size - start < kPartSize ? size - start : kPartSize;
+    CountBytesParallel(data + start, part_size, counts, 0);
+    for (int byte = 0; byte < 256; byte++) {
+      frequencies[byte] += counts[byte];
     }
-    freq[byte]++;
   }
-  return freq;
 }
@@ -2,117 +2,599 @@
 #ifndef HUFFMAN_H_
 #define HUFFMAN_H_
 
+#include "ans.h"
+#include "bit_reader.h"
+#include "bit_writer.h"
+#include "bwt.h"
+#include "lz77.h"
 #include "read_write_streams.h"
 
+#include <istream>
 #include <map>
+#include <ostream>
 #include <string>
+#include <vector>
 
+using std::istream;
 using std::map;
+using std::ostream;
 using std::string;
+using std::vector;
 
 struct HuffmanNode;
+struct HuffmanTree;
+struct HuffmanCode;
+struct HuffmanDecodeEntry;
+struct HuffmanEncoderState;
+struct HuffmanDecoderState;
+
+// The number of bits that are looked at in a single step of decoding with a
+// Huffman decoding table. Codes that are longer than this are resolved with
+// additional lookups in secondary tables.
+const int kHuffmanLookupBits = 11;
+
+// A Huffman decoding table. The first 2^kHuffmanLookupBits entries are
+// indexed by the next kHuffmanLookupBits bits of the encoded data. They are
+// followed by the secondary tables for longer codes.
+typedef vector<HuffmanDecodeEntry> HuffmanDecodeTable;
+
+// The number of input bytes that are encoded in a single block unless
+// specified otherwise.
+const unsigned int kHuffmanDefaultBlockSize = 1 << 20;
+
+// The longest code that is assigned to a byte unless specified otherwise.
+// Codes of this length are decoded with a single table lookup.
+const int kHuffmanDefaultMaxCodeLength = kHuffmanLookupBits;
+
+// The number of bit streams in a block that is encoded with interleaved
+// streams.
+const int kHuffmanStreams = 4;
+
+// The smallest part of a block that coding must be expected to save for the
+// block to be coded unless specified otherwise.
+const double kHuffmanDefaultMinSaving = 0.01;
+
+// The largest number of symbols in a "HuffmanTree": the 256 byte values and
+// one extra symbol, such as the end symbol of adaptive codes.
+const int kHuffmanMaxTreeSymbols = 257;
+
+// Options that control how data is encoded. The constructor sets every
+// option to its default value.
+struct HuffmanEncodeOptions {
+  // The number of input bytes in each block. Every block is coded
+  // independently of the others and can be encoded and decoded on its own
+  // thread.
+  unsigned int block_size;
+
+  // The number of threads that encode blocks in parallel. If 0, the number
+  // of hardware threads is used.
+  unsigned int threads;
+
+  // If true, every block is split into kHuffmanStreams parts that are
+  // encoded as separate bit streams. This costs a few bytes per block but
+  // lets the decoder work on all the streams at the same time.
+  bool interleaved_streams;
+
+  // The maximum length of a code in bits. If 0, the lengths are not limited
+  // and the codes are taken from a plain Huffman tree. Values below 8 are
+  // treated as 8 so that all 256 byte values can get a code. Codes with
+  // more symbols, such as the 257 of "block_sorting", are allowed the
+  // fewest bits more that all of their symbols need.
+  int max_code_length;
+
+  // The largest number of codes in a block with order-1 context modeling,
+  // where each byte is coded with a code chosen by the byte before it. The
+  // contexts given by the 256 possible previous bytes are grouped into at
+  // most this many clusters that share a code. A block uses context
+  // modeling only if that makes it smaller. Every cluster needs its own
+  // decoding table, so decoding is slower with many clusters. If 0 or 1,
+  // context modeling is not used. At most 256.
+  int context_clusters;
+
+  // The smallest part of a block, from 0 to 1, that coding must be expected
+  // to save for the block to be coded. The saving is estimated from the
+  // entropy of the bytes of the block before any code is built, and blocks
+  // with a smaller saving are stored as they are, which takes little time
+  // to encode and decode. Blocks that a code would not make smaller are
+  // stored in any case.
+  double min_saving;
+
+  // If true, the encoded data ends with an index of its blocks, so that any
+  // range of the decoded data can be decoded from just the blocks that hold
+  // it (see "HuffmanDecodeRange"). The index takes a few bytes per block.
+  bool block_index;
+
+  // The effort level of the LZ77 match finder, from 1 to kLz77MaxLevel, or 0
+  // to code bytes one at a time only. With matching, repeated strings in a
+  // block are coded as copies of their earlier occurrence in the same block,
+  // and a block uses them if that makes it smaller. Higher levels look
+  // harder for long matches and take more time to encode, while decoding
+  // takes about the same time at every level. Level 1 is the fastest, but
+  // every match still has to be found, counted and coded, so on data with
+  // many short repeats it encodes several times slower than no matching.
+  // Blocks are then only stored if no code makes them smaller, as the
+  // entropy of their bytes says little about their repeats.
+  int match_level;
+
+  // If true, every block is also tried with the Burrows-Wheeler transform,
+  // followed by move-to-front coding of the transformed bytes and a code for
+  // the resulting indexes and runs of zeros, as in bzip2, and uses that if
+  // it makes the block smaller. This suits text with many repeated
+  // contexts. Sorting the suffixes of a block takes far longer than coding
+  // it otherwise, but the blocks are still sorted in parallel. Decoding
+  // such a block is several times slower than decoding a Huffman coded one:
+  // a byte of a large block takes a lookup in a table of four bytes per byte
+  // of the block, which rarely hits the cache. On a single thread, blocks of
+  // a megabyte of source text decode at about 100 MB/s, and blocks of less
+  // repetitive data at about 60 MB/s, as they need more symbols per byte.
+  // Blocks of more than kBwtMaxSize bytes are not transformed.
+  bool block_sorting;
+
+  // If true, every block whose bytes are expected to take fewer bits with a
+  // table-based asymmetric numeral system than with its Huffman code is
+  // also coded that way, and uses that if it makes the block smaller. A
+  // Huffman code spends at least one bit on every byte, while such a coder
+  // spends close to the entropy of the bytes, which saves the most when a
+  // few byte values make up most of the data. Decoding takes a table lookup
+  // per byte as with a Huffman code.
+  bool ans_coding;
+
+  // If true, every block of at least a kilobyte is also coded as
+  // 16-bit symbols, where every two bytes, the first one being the lowest,
+  // form one symbol with a code of its own, and uses that if it makes the
+  // block smaller. This suits 16-bit samples and UTF-16 text, whose bytes
+  // mean little on their own. Only the symbols that occur are listed with
+  // the code, and codes are at most 20 bits long, so that every symbol is
+  // decoded with at most two table lookups. Blocks should have an even
+  // size, so that every block starts at the first byte of a symbol.
+  bool wide_symbols;
+
+  HuffmanEncodeOptions();
+};
 
 // Encodes the contents of "input_file" and stores the result in "output_file".
-// The encoding is done using a Huffman encoding scheme.
-void HuffmanEncodeFile(const string& input_file, const string& output_file);
+// The encoding is done using a Huffman encoding scheme. The file is read,
+// encoded and written a few blocks at a time, with one thread reading,
+// "options.threads" threads encoding and one writing, so the disk is kept
+// busy while the blocks are encoded and the file does not need to fit in
+// memory.
+void HuffmanEncodeFile(
+    const string& input_file,
+    const string& output_file,
+    const HuffmanEncodeOptions& options = HuffmanEncodeOptions());
 
 // Decodes the contents of "input_file" and stores the result in "output_file".
 // It is assumed that "input_file" is the result of a Huffman encoding scheme.
-void HuffmanDecodeFile(const string& input_file, const string& output_file);
+// Blocks are decoded in parallel on up to "threads" threads, or on as many
+// threads as the hardware has if "threads" is 0. Like the encoding, the
+// decoding is done a few blocks at a time, while the blocks before them are
+// written and the blocks after them are read. Returns false if the contents of
+// "input_file" are not valid, in which case "output_file" may hold part of
+// the decoded data.
+bool HuffmanDecodeFile(const string& input_file,
+                       const string& output_file,
+                       unsigned int threads = 0);
+
+// Encodes everything that can be read from "input" and writes the result to
+// "output". The input is read exactly once, a block at a time, so it can be
+// a pipe such as the standard input. At most two blocks of
+// "options.block_size" bytes per thread, and two more, are held in memory
+// at a time.
+void HuffmanEncodeStream(
+    istream& input,
+    ostream& output,
+    const HuffmanEncodeOptions& options = HuffmanEncodeOptions());
+
+// Decodes the data that is read from "input" and writes the result to
+// "output". "Input" must contain nothing after the encoded data. Blocks are
+// read and decoded a few at a time, with "threads" used as in
+// "HuffmanDecodeFile". Returns false if the data is not valid, in which case
+// part of the decoded data may already have been written.
+bool HuffmanDecodeStream(istream& input,
+                         ostream& output,
+                         unsigned int threads = 0);
 
 // Encodes "input_data" and stores the result in "encoded_data". The encoding
 // is done using a Huffman encoding scheme. The built-in string type is used to
 // store arbitrary binary data with each character encoding a single byte of
 // data.
-void HuffmanEncodeString(const string& input_data, string& encoded_data); 
+void HuffmanEncodeString(
+    const string& input_data,
+    string& encoded_data,
+    const HuffmanEncodeOptions& options = HuffmanEncodeOptions());
 
 // Decodes "input_data" and stores the result in "decoded_data". It is
 // assumed that "input_data" is the result of a Huffman encoding scheme.
 // The built-in string type is used to store arbitrary binary data with
-// each character encoding a single byte of data.
-void HuffmanDecodeString(const string& input_data, string& decoded_data);
+// each character encoding a single byte of data. "Threads" is used as in
+// "HuffmanDecodeFile". Returns false if "input_data" is not valid.
+bool HuffmanDecodeString(const string& input_data,
+                         string& decoded_data,
+                         unsigned int threads = 0);
 
 // Encodes the contents of "read_stream" and writes the results in
 // "write_stream". The encoding is done using a Huffman encoding scheme. 
-void HuffmanEncode(ReadStream* read_stream, WriteStream* write_stream);
+// "Read_stream" is read from start to end exactly once, a few blocks at a
+// time, so its contents do not need to fit in memory.
+void HuffmanEncode(
+    ReadStream* read_stream,
+    WriteStream* write_stream,
+    const HuffmanEncodeOptions& options = HuffmanEncodeOptions());
+
+// Encodes the "size" bytes at "data" and stores the result in
+// "encoded_data", with the same result as "HuffmanEncode". Both the
+// frequency tables and the encoded blocks are computed from the same
+// buffer.
+void HuffmanEncodeBuffer(
+    const char* data,
+    size_t size,
+    string& encoded_data,
+    const HuffmanEncodeOptions& options = HuffmanEncodeOptions());
+
+// Encodes the "size" bytes at "data" into the buffer of "capacity" bytes at
+// "encoded_data", without any intermediate copy, and stores the number of
+// bytes written in "encoded_size". Returns false if the encoded data does not
+// fit, in which case "encoded_size" is the capacity that is needed and
+// nothing is written. A buffer of "HuffmanMaxEncodedSize" bytes always
+// suffices.
+bool HuffmanEncodeBuffer(
+    const char* data,
+    size_t size,
+    char* encoded_data,
+    size_t capacity,
+    size_t& encoded_size,
+    const HuffmanEncodeOptions& options = HuffmanEncodeOptions());
+
+// Returns the largest number of bytes that "size" bytes of data can take
+// when they are encoded with "options". Only the block size and the block
+// index of the options matter.
+size_t HuffmanMaxEncodedSize(
+    size_t size,
+    const HuffmanEncodeOptions& options = HuffmanEncodeOptions());
 
 // Decodes the contents of "read_stream" and writes the result in
 // "write_stream". It is assumed that the data in "read_stream" is the
-// result of a Huffman encoding scheme.
-void HuffmanDecode(ReadStream* read_stream, WriteStream* write_stream);
-
-// Takes a mapping from byte value to frequency of occurrence, serializes it and
-// writes it to "write_stream".
-void EncodeFrequencyTable(map<char, unsigned int>& frequencies,
-                          WriteStream* write_stream);
-
-// Reads in a serialized form of a mapping from byte value to frequency of
-// occurrence from "read_stream" and stores the mapping in "frequencies".
-void DecodeFrequencyTable(ReadStream* read_stream,
-                          map<char, unsigned int>& frequencies);
-
-// Encodes all the bytes from "read_stream" by using the mappings in
-// "encoding_table" and writes the result in "write_stream". "Encoding_table"
-// is a mapping from byte value to a string of "0"s and "1"s representing the
-// sequence of bits in the encoding for the given byte.
-void EncodeData(ReadStream* read_stream,
-                map<char, string>& encoding_table,
-                WriteStream* write_stream);
-
-// Decodes the binary contents of "read_stream" assuming it is encoded with
-// the Huffman tree with root "root". The result of the decoding is written
-// to "write_stream".
-void DecodeData(ReadStream* read_stream,
-                HuffmanNode* root,
-                WriteStream* write_stream);
-
-// Builds a Huffman tree from a table mapping bytes to their number of
-// occurrences.
-HuffmanNode* BuildHuffmanTree(map<char, unsigned int>& frequencies);
-
-// Deallocates the memory used for the Huffman tree rooted at "root".
-void DeleteHuffmanTree(HuffmanNode* root);
-
-// Computes the encoding table corresponding to the Huffman tree rooted at
-// "root". An encoding table is a mapping from byte value to a string of "0"s
-// and "1"s representing the sequence of bits for the given byte.
-map<char, string> BuildEncodingTable(HuffmanNode* root);
-
-// Computes the encoding table corresponding to the Huffman tree rooted at
-// "root" by recursively traversing the tree and storing the history of left
-// and right branches in "encoding". An encoding table is a mapping from byte
-// value to a string of "0"s and "1"s representing the sequence of bits for the
-// given byte.
-void BuildEncodingTableRecursive(HuffmanNode* root,
-                                 string encoding,
-                                 map<char, string>& encoding_table);
-
-// Reads in all the bytes from "read_stream" and returns a frequency table
-// that maps each encountered byte to the number of times it occurs.
-map<char, unsigned int> CalculateByteFrequencies(ReadStream* read_stream);
+// result of a Huffman encoding scheme. The blocks are decoded one at a time
+// while the next ones are read. Returns false if the data in "read_stream"
+// is not valid, in which case part of the decoded data may already have
+// been written.
+bool HuffmanDecode(ReadStream* read_stream, WriteStream* write_stream);
+
+// Decodes the "size" bytes at "data" and stores the result in
+// "decoded_data". "Threads" is used as in "HuffmanDecodeFile". Returns false
+// if the data is not valid.
+bool HuffmanDecodeBuffer(const char* data,
+                         size_t size,
+                         string& decoded_data,
+                         unsigned int threads = 0);
+
+// Decodes the "size" bytes at "data" directly into the buffer at
+// "decoded_data", which must hold exactly "decoded_size" bytes, the size that
+// "HuffmanDecodedSize" gives. "Threads" is used as in "HuffmanDecodeFile".
+// Returns false if the data is not valid or does not decode to
+// "decoded_size" bytes, in which case part of the buffer may have been
+// written.
+bool HuffmanDecodeBuffer(const char* data,
+                         size_t size,
+                         char* decoded_data,
+                         size_t decoded_size,
+                         unsigned int threads = 0);
+
+// Reads the block headers of the "size" bytes of encoded data at "data" and
+// stores the number of bytes that the data decodes to in "decoded_size".
+// Returns false if the headers are not valid.
+bool HuffmanDecodedSize(const char* data, size_t size, size_t& decoded_size);
+
+// Computes how many of the "size" bytes of encoded data at "data" are taken
+// by block headers, code lengths and stream sizes rather than by encoded
+// bytes, and stores the result in "header_size". Returns false if the data
+// is not valid.
+bool HuffmanHeaderSize(const char* data, size_t size, size_t& header_size);
+
+// Decodes the "length" bytes that start at byte "offset" of the decoded data
+// from the "size" bytes of encoded data at "data", which must have been
+// encoded with "block_index" set, and stores them in "decoded_data". Only
+// the blocks that hold the range are decoded, along with the code lengths
+// of the block whose code the first of them uses. "Threads" is used as in
+// "HuffmanDecodeFile". Returns false if the data has no valid block index,
+// the range does not lie within the decoded data or the blocks that hold it
+// are not valid.
+bool HuffmanDecodeRange(const char* data,
+                        size_t size,
+                        unsigned long long offset,
+                        size_t length,
+                        string& decoded_data,
+                        unsigned int threads = 0);
+
+// Decodes a range of the data encoded in "input_file" as in
+// "HuffmanDecodeRange". Only the block index and the blocks that are needed
+// are read from the file, so the time taken depends on the length of the
+// range and not on the size of the file.
+bool HuffmanDecodeFileRange(const string& input_file,
+                            unsigned long long offset,
+                            size_t length,
+                            string& decoded_data,
+                            unsigned int threads = 0);
+
+// Encodes data that arrives a piece at a time, such as the messages of a
+// connection, into the same blocks as "HuffmanEncodeBuffer". The input is
+// collected until it fills a batch of one block per thread, which is then
+// encoded right away, and the first block of a batch may use the code of
+// the block before it. The encoder keeps its buffers from one call to the
+// next, so feeding it does not allocate memory once they have grown to the
+// size of a batch.
+class HuffmanEncoder {
+public:
+  HuffmanEncoder(const HuffmanEncodeOptions& options = HuffmanEncodeOptions());
+  ~HuffmanEncoder();
+
+  // Adds the "size" bytes at "data" to the input and appends the blocks that
+  // they complete, if any, to "output".
+  void Feed(const char* data, size_t size, string& output);
+
+  // Encodes the input that has not been encoded yet, even if it does not
+  // fill a block, and appends it to "output", so that everything fed so far
+  // can be decoded from the output. The data is not ended, and more data may
+  // be fed afterwards.
+  void Flush(string& output);
+
+  // Encodes the input that has not been encoded yet as the end of the data
+  // and appends it to "output". The encoder can then be fed new data, which
+  // is encoded independently of the data before it.
+  void Finish(string& output);
+
+private:
+  HuffmanEncoder(const HuffmanEncoder&);
+  HuffmanEncoder& operator = (const HuffmanEncoder&);
+
+  // Encodes the first "size" bytes of the input that has not been encoded
+  // yet, appends them to "output" and removes them from the input.
+  void EncodePending(size_t size, bool last, string& output);
+
+  HuffmanEncodeOptions options_;
+  size_t batch_size_;
+  vector<char> pending_;
+  HuffmanEncoderState* state_;
+};
+
+// Decodes encoded data that arrives a piece at a time. Every block is
+// decoded as soon as all of it has arrived, with "threads" used as in
+// "HuffmanDecodeFile" for the blocks that arrive together. Like the encoder,
+// the decoder keeps its buffers from one call to the next.
+class HuffmanDecoder {
+public:
+  HuffmanDecoder(unsigned int threads = 0);
+  ~HuffmanDecoder();
+
+  // Adds the "size" bytes at "data" to the encoded data and appends the
+  // decoded bytes of the blocks that they complete, if any, to "output".
+  // Returns false if the encoded data is not valid, in which case every
+  // later call fails as well until "Finish" is called.
+  bool Feed(const char* data, size_t size, string& output);
+
+  // Returns true if the encoded data has ended with its last block and
+  // nothing follows it. The decoder can then be fed new encoded data.
+  bool Finish();
+
+private:
+  HuffmanDecoder(const HuffmanDecoder&);
+  HuffmanDecoder& operator = (const HuffmanDecoder&);
+
+  unsigned int threads_;
+  vector<char> pending_;
+  HuffmanDecoderState* state_;
+  bool first_;
+  bool last_;
+  bool valid_;
+};
+
+// Returns the number of bytes that "StoreVarint" writes for "value".
+size_t VarintSize(unsigned long long value);
+
+// Writes "value" to "output" as a variable length integer of 7 bits per
+// byte, lowest bits first, with the highest bit of every byte but the last
+// one set. Returns the number of bytes written.
+size_t StoreVarint(unsigned long long value, char* output);
+
+// Reads a variable length integer at "position" in the "size" bytes at
+// "data" into "value" and moves "position" past it. Returns false if the
+// integer does not end before the end of the data or does not fit in 64
+// bits.
+bool LoadVarint(const char* data,
+                size_t size,
+                size_t& position,
+                unsigned long long& value);
+
+// Serializes the code lengths of "symbols" symbols and writes them to
+// "writer". A code length of 0 marks a symbol that is not used.
+void EncodeCodeLengths(const unsigned char* lengths,
+                       int symbols,
+                       BitWriter& writer);
+
+// Reads in the serialized code lengths of "symbols" symbols from "reader"
+// and stores them in "lengths". Returns false if the code lengths can not be
+// read or do not describe a valid prefix code.
+bool DecodeCodeLengths(BitReader& reader,
+                       unsigned char* lengths,
+                       int symbols);
+
+// Returns the number of bytes that "EncodeCodeLengths" writes for "lengths".
+unsigned int CodeLengthsSize(const unsigned char* lengths, int symbols);
+
+// Assigns canonical Huffman codes to "symbols" symbols with the given code
+// lengths and stores them in "codes". Shorter codes come before longer ones
+// and codes of the same length are ordered by symbol. Each code is stored in
+// the lowest "lengths[s]" bits of "codes[s]". Returns false if there are too
+// many codes of some length for them to form a prefix code.
+bool BuildCanonicalCodes(const unsigned char* lengths,
+                         int symbols,
+                         unsigned long long* codes);
+
+// Builds the table of 256 canonical codes, indexed by byte value, for the
+// bytes with code lengths "lengths".
+void BuildEncodingTable(const unsigned char* lengths,
+                        HuffmanCode* encoding_table);
+
+// Encodes the "size" bytes at "data" with the codes in "encoding_table" (as
+// built by "BuildEncodingTable") and writes the result to "writer".
+void EncodeData(const char* data,
+                unsigned int size,
+                const HuffmanCode* encoding_table,
+                BitWriter& writer);
+
+// Encodes the "size" bytes at "data" with order-1 context codes and writes
+// the result to "writer". Every byte is coded with the codes in
+// "encoding_tables" at index 256 * c, where c is the entry of "cluster_map"
+// for the byte before it. The first byte is taken to follow a byte of 0.
+void EncodeContextData(const char* data,
+                       unsigned int size,
+                       const HuffmanCode* encoding_tables,
+                       const unsigned char* cluster_map,
+                       BitWriter& writer);
+
+// Decodes "bytes" bytes from the bits in "reader", which were encoded by
+// "EncodeContextData", and stores them in "output". "Context_tables" holds
+// the decoding table for the bytes that follow each byte value.
+void DecodeContextBytes(BitReader& reader,
+                        const HuffmanDecodeEntry* const* context_tables,
+                        char* output,
+                        unsigned int bytes);
+
+// Decodes "bytes" bytes from the bits in "reader" with the decoding table
+// "table" and stores them in "output".
+void DecodeBytes(BitReader& reader,
+                 const HuffmanDecodeTable& table,
+                 char* output,
+                 unsigned int bytes);
+
+// Decodes "symbols" 16-bit symbols from the bits in "reader" with the
+// decoding table "table", whose entries hold the symbols themselves, and
+// stores each of them in two bytes of "output", lowest bits first.
+void DecodeWideSymbols(BitReader& reader,
+                       const HuffmanDecodeTable& table,
+                       char* output,
+                       unsigned int symbols);
+
+// Decodes a single symbol from the bits in "reader" with the decoding table
+// "table" and returns it.
+int DecodeSymbol(BitReader& reader, const HuffmanDecodeTable& table);
+
+// Decodes "bytes" bytes from kHuffmanStreams separate bit streams with the
+// decoding table "table" and stores them in "output". Stream i holds the
+// "stream_sizes[i]" bytes at "streams[i]" and decodes the part of "output"
+// that starts at "HuffmanStreamStart(bytes, i)". The lookups in different
+// streams do not depend on each other, so they are interleaved. Returns false
+// if some stream ends before all of its bytes are decoded.
+bool DecodeInterleavedBytes(const char* const* streams,
+                            const size_t* stream_sizes,
+                            const HuffmanDecodeTable& table,
+                            char* output,
+                            unsigned int bytes);
+
+// Returns the offset of the part of "bytes" bytes that is encoded in
+// stream "stream" of an interleaved block. The part ends where the next
+// one starts, and the offset for stream kHuffmanStreams is "bytes".
+unsigned int HuffmanStreamStart(unsigned int bytes, int stream);
+
+// Builds a decoding table for the codes described by "codes" and "lengths".
+// Both arrays are indexed by symbol and have "symbols" entries. "codes[s]"
+// holds the bits of the code of symbol s in its lowest "lengths[s]" bits.
+// Symbols with a code length of 0 are left out of the table.
+void BuildDecodeTable(const unsigned long long* codes,
+                      const unsigned char* lengths,
+                      int symbols,
+                      HuffmanDecodeTable& table);
+
+// Computes code lengths of at most "max_length" bits that minimize the size
+// of the encoded data for "symbols" symbols with the number of occurrences
+// "frequencies" and stores them in "lengths". Both arrays are indexed by
+// symbol. Symbols that do not occur get a code length of 0, and a single
+// symbol that occurs gets a code length of 1. The lengths are found with the
+// package-merge algorithm. Returns false if more than 2^max_length symbols
+// occur, so that no such code exists.
+bool BuildLimitedCodeLengths(const unsigned int* frequencies,
+                             int symbols,
+                             int max_length,
+                             unsigned char* lengths);
+
+// Builds a Huffman tree in "tree" for "symbols" symbols, at most
+// kHuffmanMaxTreeSymbols, with the number of occurrences "frequencies",
+// which is indexed by symbol. Symbols that do not occur are left out of the
+// tree. The leaves are sorted by frequency and merged with two queues, one
+// of leaves and one of inner nodes, which are both in order of increasing
+// frequency, so the tree is built in linear time after sorting and without
+// allocating memory.
+void BuildHuffmanTree(const unsigned int* frequencies,
+                      int symbols,
+                      HuffmanTree& tree);
+
+// Computes the code length of every symbol in "tree" and stores it in
+// "lengths", which is indexed by symbol and has "symbols" entries. Symbols
+// that are not in the tree get a code length of 0. A tree with a single leaf
+// gives its symbol a code length of 1.
+void BuildCodeLengths(const HuffmanTree& tree,
+                      int symbols,
+                      unsigned char* lengths);
+
+// Fills "frequencies", a table of 256 entries indexed by byte value, with
+// the number of times each byte value occurs among the "size" bytes at
+// "data". Large inputs are counted on several threads.
+void CalculateByteFrequencies(const char* data,
+                              size_t size,
+                              unsigned long long* frequencies);
 
 // A structure that models a Huffman tree node. The same structure is used
-// both for leaf nodes and inner nodes of the Huffman tree.
+// both for leaf nodes and inner nodes of the Huffman tree. Leaf nodes hold
+// their symbol and have no children ("left" and "right" are -1). Inner nodes
+// have a "symbol" of -1 and hold the indexes of their children in the nodes
+// of the tree.
 struct HuffmanNode {
-  bool leaf;
-  char byte;
-  unsigned int freq;
-  HuffmanNode* left;
-  HuffmanNode* right;
+  unsigned long long freq;
+  int symbol;
+  int left;
+  int right;
+};
 
-  HuffmanNode();
+// A functor for ordering Huffman nodes by smallest frequency first, and
+// nodes of equal frequency by symbol.
+struct HuffmanNodeCompare {
+  bool operator () (const HuffmanNode& node1, const HuffmanNode& node2) const;
+};
 
-  // Leaf node constructor.
-  HuffmanNode(char byte, unsigned int freq);
+// A Huffman tree that is stored in a fixed array of nodes. The first
+// "leaves" nodes are the leaves in order of increasing frequency. They are
+// followed by the inner nodes in the order in which they were created, so
+// every node comes before its parent and the root is the last node.
+struct HuffmanTree {
+  HuffmanNode nodes[2 * kHuffmanMaxTreeSymbols - 1];
+  int leaves;
+  int size;
+};
 
-  // Inner node constructor.
-  HuffmanNode(unsigned int freq, HuffmanNode* left, HuffmanNode* right);
+// The Huffman code of a single byte. "Code" holds the bits of the code in its
+// lowest "length" bits.
+struct HuffmanCode {
+  unsigned long long code;
+  unsigned int length;
 };
 
-// A functor for comparing two Huffman nodes. The comparison is done by largest
-// frequency first.
-struct HuffmanNodeCompare {
-  bool operator () (const HuffmanNode* node1, const HuffmanNode* node2);
+// An entry of a Huffman decoding table. An entry either decodes one or two
+// symbols ("count" is 1 or 2) or points to a secondary table ("count" is 0).
+//
+// For decoded symbols, "symbols" holds the first symbol in its lower 16 bits
+// and the second symbol (if any) in its upper 16 bits, "bits" is the total
+// number of bits taken by the decoded symbols and "first_bits" is the number
+// of bits taken by the first symbol alone.
+//
+// For secondary tables, "symbols" is the index in the decoding table at which
+// the secondary table starts, "bits" is the number of bits to skip before
+// looking it up and "subtable_bits" is the number of bits used to index it.
+struct HuffmanDecodeEntry {
+  unsigned int symbols;
+  unsigned char bits;
+  unsigned char first_bits;
+  unsigned char count;
+  unsigned char subtable_bits;
 };
 
 #endif // HUFFMAN_H_
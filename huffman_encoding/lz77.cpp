@@ -0,0 +1,200 @@
+// This file contains implementations of the functions in "lz77.h".
+#include "lz77.h"
+
+#include <cstring>
+#include <vector>
+
+using std::vector;
+
+// The number of bits of the hash of kLz77MinMatch bytes.
+static const int kHashBits = 16;
+
+// Marks the end of a hash chain.
+static const unsigned int kNoPosition = 0xffffffffu;
+
+// The settings of an effort level of the match finder. At most
+// "chain_length" candidates are compared for every position, and the search
+// stops as soon as a match of "nice_length" bytes is found. "Lazy" is true if
+// a match that is shorter than that is deferred when the next position has a
+// longer one.
+struct Lz77Level {
+  int chain_length;
+  unsigned int nice_length;
+  bool lazy;
+};
+
+// The settings of levels 1 to kLz77MaxLevel.
+static const Lz77Level kLevels[kLz77MaxLevel] = {
+  {1, 16, false},
+  {4, 32, false},
+  {8, 32, false},
+  {8, 32, true},
+  {16, 64, true},
+  {32, 128, true},
+  {64, 128, true},
+  {256, 256, true},
+  {1024, 1024, true},
+};
+
+// Returns the hash of the kLz77MinMatch bytes at "data".
+static inline unsigned int Hash(const unsigned char* data) {
+  unsigned int word;
+  memcpy(&word, data, 4);
+  return (word * 2654435761u) >> (32 - kHashBits);
+}
+
+// Returns the number of bytes, up to "limit", that are the same at "data"
+// and "match". The bytes are compared 8 at a time while possible.
+static inline unsigned int MatchLength(const unsigned char* data,
+                                       const unsigned char* match,
+                                       unsigned int limit) {
+  unsigned int length = 0;
+  while (limit - length >= 8) {
+    unsigned long long word1;
+    unsigned long long word2;
+    memcpy(&word1, data + length, 8);
+    memcpy(&word2, match + length, 8);
+    if (word1 != word2) {
+      break;
+    }
+    length += 8;
+  }
+  while (length < limit && data[length] == match[length]) {
+    length++;
+  }
+  return length;
+}
+
+// The hash chains of the positions of some data that have been seen so far.
+// "Head" holds the latest position for every hash and "previous" the
+// position before every position with the same hash. Level 1 keeps no
+// chains and only uses "head".
+class Lz77Chains {
+public:
+  Lz77Chains(const unsigned char* data,
+             unsigned int size,
+             const Lz77Level& level)
+      : data_(data),
+        size_(size),
+        level_(level),
+        head_(1 << kHashBits, kNoPosition) {
+    if (level.chain_length > 1) {
+      previous_.resize(size);
+    }
+  }
+
+  // Adds "position", which must have kLz77MinMatch bytes after it, to the
+  // chains.
+  void Insert(unsigned int position) {
+    unsigned int& head = head_[Hash(data_ + position)];
+    if (!previous_.empty()) {
+      previous_[position] = head;
+    }
+    head = position;
+  }
+
+  // Returns the length of the longest match for the data at "position"
+  // among the positions in the chains, or 0 if there is none of at least
+  // kLz77MinMatch bytes, and stores its distance in "distance".
+  unsigned int FindMatch(unsigned int position, unsigned int& distance) {
+    const unsigned char* current = data_ + position;
+    unsigned int limit = size_ - position;
+    unsigned int best = kLz77MinMatch - 1;
+    unsigned int candidate = head_[Hash(current)];
+    for (int chain = level_.chain_length;
+         chain > 0 && candidate != kNoPosition;
+         chain--) {
+      const unsigned char* match = data_ + candidate;
+      // A longer match must also differ from the best one at its end.
+      if (match[best] == current[best]) {
+        unsigned int length = MatchLength(current, match, limit);
+        if (length > best) {
+          best = length;
+          distance = position - candidate;
+          if (length >= level_.nice_length || length == limit) {
+            break;
+          }
+        }
+      }
+      if (previous_.empty()) {
+        break;
+      }
+      candidate = previous_[candidate];
+    }
+    return best >= kLz77MinMatch ? best : 0;
+  }
+
+private:
+  const unsigned char* data_;
+  unsigned int size_;
+  const Lz77Level& level_;
+  vector<unsigned int> head_;
+  vector<unsigned int> previous_;
+};
+
+void FindLz77Matches(const char* data,
+                     unsigned int size,
+                     int level,
+                     vector<Lz77Sequence>& sequences) {
+  sequences.clear();
+  if (level < 1) {
+    level = 1;
+  } else if (level > kLz77MaxLevel) {
+    level = kLz77MaxLevel;
+  }
+  const Lz77Level& settings = kLevels[level - 1];
+  const unsigned char* bytes = (const unsigned char*) data;
+  Lz77Chains chains(bytes, size, settings);
+
+  // Matches can only start where kLz77MinMatch bytes are left.
+  unsigned int end = size >= kLz77MinMatch ? size - kLz77MinMatch + 1 : 0;
+  unsigned int literal_start = 0;
+  unsigned int position = 0;
+  unsigned int misses = 0;
+  while (position < end) {
+    unsigned int distance;
+    unsigned int length = chains.FindMatch(position, distance);
+    chains.Insert(position);
+    if (length == 0) {
+      if (level == 1) {
+        // The more positions in a row have no match, the less likely the
+        // next one is to have one, so the step grows by one every 64
+        // misses.
+        position += 1 + (misses++ >> 6);
+      } else {
+        position++;
+      }
+      continue;
+    }
+    if (settings.lazy) {
+      while (length < settings.nice_length && position + 1 < end) {
+        unsigned int next_distance;
+        unsigned int next_length =
+            chains.FindMatch(position + 1, next_distance);
+        if (next_length <= length) {
+          break;
+        }
+        chains.Insert(position + 1);
+        position++;
+        length = next_length;
+        distance = next_distance;
+      }
+    }
+    Lz77Sequence sequence = {position - literal_start, length, distance};
+    sequences.push_back(sequence);
+    if (level > 1) {
+      unsigned int match_end = position + length < end ? position + length
+                                                       : end;
+      for (unsigned int i = position + 1; i < match_end; i++) {
+        chains.Insert(i);
+      }
+    }
+    position += length;
+    literal_start = position;
+    misses = 0;
+  }
+  if (size > 0) {
+    Lz77Sequence sequence = {size - literal_start, 0, 0};
+    sequences.push_back(sequence);
+  }
+}
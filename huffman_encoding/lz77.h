@@ -0,0 +1,46 @@
+// An LZ77 match finder that splits data into literals and copies of earlier
+// data, so that repeated strings can be coded far smaller than their bytes.
+#ifndef LZ77_H_
+#define LZ77_H_
+
+#include <vector>
+
+using std::vector;
+
+// The shortest match that is looked for. Shorter repeats cost more to code
+// as a copy than as literals.
+const unsigned int kLz77MinMatch = 4;
+
+// The highest effort level of the match finder.
+const int kLz77MaxLevel = 9;
+
+// A run of literal bytes followed by a copy of earlier data. The copy
+// repeats "length" bytes that start "distance" bytes before it, where
+// "length" is at least kLz77MinMatch, except in the last sequence of some
+// data, which has no copy and a "length" of 0. Its run of literals may be
+// empty.
+struct Lz77Sequence {
+  unsigned int literals;
+  unsigned int length;
+  unsigned int distance;
+};
+
+// Splits the "size" bytes at "data" into sequences of literals and copies
+// that reproduce the data when applied in order, and stores them in
+// "sequences". Copies only refer to data within the "size" bytes.
+//
+// Candidate matches are found through chains of earlier positions with the
+// same hash of their next kLz77MinMatch bytes. "Level" goes from 1 to
+// kLz77MaxLevel and sets how long the chains that are followed may get, and
+// from level 4 on a match is deferred by a byte if the next position has a
+// longer one. Level 1 only looks at the latest position with the same hash
+// and skips ahead faster the longer it finds no match. It passes over data
+// without repeats about as fast as counting the bytes, but every match it
+// finds costs far more time than a byte, so it is much slower on data with
+// many short repeats.
+void FindLz77Matches(const char* data,
+                     unsigned int size,
+                     int level,
+                     vector<Lz77Sequence>& sequences);
+
+#endif // LZ77_H_
@@ -1,7 +1,14 @@
 #include "huffman.h"
+#include <cstdlib>
 #include <iostream>
 #include <string>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <stdio.h>
+#endif
+
 using namespace std;
 
 void CompressStringTest() {
@@ -17,20 +24,131 @@ void CompressStringTest() {
   } else {
     cout << "The strings are not equal." << endl;
   }
+
+  // An empty string is a single empty block, which every optional coding
+  // must leave alone.
+  HuffmanEncodeOptions options;
+  options.ans_coding = true;
+  string empty_compressed;
+  string empty_decompressed = input;
+  HuffmanEncodeString("", empty_compressed, options);
+  if (HuffmanDecodeString(empty_compressed, empty_decompressed) &&
+      empty_decompressed.empty()) {
+    cout << "The empty strings are equal." << endl;
+  } else {
+    cout << "The empty strings are not equal." << endl;
+  }
+
+  // Random bytes use all 257 symbols of the Burrows-Wheeler transform,
+  // which do not fit in codes of the shortest limit of 8 bits.
+  options = HuffmanEncodeOptions();
+  options.block_sorting = true;
+  options.max_code_length = 8;
+  options.min_saving = 0;
+  string random_input;
+  srand(1);
+  for (int i = 0; i < 200000; i++) {
+    random_input += (char) rand();
+  }
+  string random_compressed;
+  string random_decompressed;
+  HuffmanEncodeString(random_input, random_compressed, options);
+  if (HuffmanDecodeString(random_compressed, random_decompressed) &&
+      random_decompressed == random_input) {
+    cout << "The random strings are equal." << endl;
+  } else {
+    cout << "The random strings are not equal." << endl;
+  }
+
+  // Every byte value equally often has the most entropy that bytes can
+  // have, but each byte follows from the one before it, so a context code
+  // must still make the data smaller.
+  options = HuffmanEncodeOptions();
+  options.context_clusters = 16;
+  string context_input;
+  for (int i = 0; i < 2000; i++) {
+    for (int byte = 0; byte < 256; byte++) {
+      context_input += (char) byte;
+    }
+  }
+  string context_compressed;
+  string context_decompressed;
+  HuffmanEncodeString(context_input, context_compressed, options);
+  if (HuffmanDecodeString(context_compressed, context_decompressed) &&
+      context_decompressed == context_input &&
+      context_compressed.size() < context_input.size()) {
+    cout << "The context strings are equal and smaller." << endl;
+  } else {
+    cout << "The context strings are not equal or not smaller." << endl;
+  }
 }
 
-void CompressFileTest(const string& input_file, const string& output_file) {
+void CompressFileTest(const string& input_file,
+                      const string& output_file,
+                      unsigned int threads) {
   string compressed_file = input_file + "__compressed";
-  HuffmanEncodeFile(input_file, compressed_file);
-  HuffmanDecodeFile(compressed_file, output_file);
+  HuffmanEncodeOptions options;
+  options.threads = threads;
+  HuffmanEncodeFile(input_file, compressed_file, options);
+  HuffmanDecodeFile(compressed_file, output_file, threads);
+}
+
+// Makes the standard input and output pass binary data through unchanged.
+void SetBinaryMode() {
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  ios::sync_with_stdio(false);
+}
+
+// Encodes the standard input to the standard output on "threads" threads,
+// or on as many threads as the hardware has if "threads" is 0. Only a few
+// blocks of "block_size" bytes of input per thread are held in memory at a
+// time, so the input can be of any size.
+int EncodePipe(unsigned int block_size, unsigned int threads) {
+  SetBinaryMode();
+  HuffmanEncodeOptions options;
+  if (block_size > 0) {
+    options.block_size = block_size;
+  }
+  options.threads = threads;
+  HuffmanEncodeStream(cin, cout, options);
+  return cout ? 0 : 1;
+}
+
+// Decodes the standard input to the standard output on "threads" threads,
+// as in "EncodePipe".
+int DecodePipe(unsigned int threads) {
+  SetBinaryMode();
+  if (!HuffmanDecodeStream(cin, cout, threads)) {
+    cerr << "The input is not valid Huffman encoded data." << endl;
+    return 1;
+  }
+  return cout ? 0 : 1;
 }
 
 // A small driver program that demonstrates the Huffman encoding API.
+//
+//   main <input file> <output file> [threads]   encodes and decodes a file
+//   main -c [block size [threads]] < in > out   encodes the standard input
+//   main -d [threads] < in > out                decodes the standard input
+//   main                                        encodes and decodes a string
+//
+// A block size or thread count of 0 selects the default.
 int main(int argc, char* argv[]) {
-  if (argc == 3) {
+  if (argc >= 2 && string(argv[1]) == "-c") {
+    unsigned int block_size = argc >= 3 ? strtoul(argv[2], NULL, 10) : 0;
+    unsigned int threads = argc >= 4 ? strtoul(argv[3], NULL, 10) : 0;
+    return EncodePipe(block_size, threads);
+  } else if ((argc == 2 || argc == 3) && string(argv[1]) == "-d") {
+    unsigned int threads = argc == 3 ? strtoul(argv[2], NULL, 10) : 0;
+    return DecodePipe(threads);
+  } else if (argc == 3 || argc == 4) {
     string input_file = argv[1];
     string output_file = argv[2];
-    CompressFileTest(input_file, output_file);
+    unsigned int threads = argc == 4 ? strtoul(argv[3], NULL, 10) : 0;
+    CompressFileTest(input_file, output_file, threads);
   } else {
     CompressStringTest();
   }
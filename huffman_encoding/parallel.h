@@ -0,0 +1,235 @@
+// A helper for running independent pieces of work on several threads.
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Calls "function(i)" for every i in [0, count) with each call made on one
+// of up to "threads" threads. The calls are handed out in increasing order of
+// i to threads as they become free. If "threads" is 0, the number of hardware
+// threads is used. Returns after all calls have completed.
+template <typename Function>
+void ParallelFor(size_t count, unsigned int threads, Function& function);
+
+template <typename Function>
+void ParallelForWorker(size_t count,
+                       std::atomic<size_t>* next,
+                       Function* function) {
+  while (true) {
+    size_t index = (*next)++;
+    if (index >= count) {
+      break;
+    }
+    (*function)(index);
+  }
+}
+
+template <typename Function>
+void ParallelFor(size_t count, unsigned int threads, Function& function) {
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+  }
+  if (threads > count) {
+    threads = count;
+  }
+  if (threads <= 1) {
+    for (size_t index = 0; index < count; index++) {
+      function(index);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (unsigned int i = 1; i < threads; i++) {
+    workers.push_back(std::thread(ParallelForWorker<Function>,
+                                  count, &next, &function));
+  }
+  ParallelForWorker(count, &next, &function);
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+}
+
+// The state that the threads of "RunPipeline" share. "Stages.Process" uses
+// it to do the parts of its work that must be done in the order of the
+// items, such as those that depend on the item before.
+class Pipeline {
+public:
+  Pipeline(size_t slots)
+      : slots_(slots),
+        read_(0),
+        claimed_(0),
+        turn_(0),
+        written_(0),
+        end_((size_t) -1),
+        failed_(false),
+        processed_(slots, false) {}
+
+  // Waits until "Done" has been called for every item before item "index".
+  // Returns false if the pipeline has stopped because some item was not
+  // valid.
+  bool Wait(size_t index) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (turn_ != index && !failed_) {
+      changed_.wait(lock);
+    }
+    return !failed_;
+  }
+
+  // Lets the item after item "index" through "Wait".
+  void Done(size_t index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    turn_ = index + 1;
+    changed_.notify_all();
+  }
+
+  template <typename Stages>
+  friend bool RunPipeline(unsigned int threads, size_t slots, Stages& stages);
+
+  template <typename Stages>
+  friend void PipelineReader(Pipeline* pipeline, Stages* stages);
+
+  template <typename Stages>
+  friend void PipelineWorker(Pipeline* pipeline, Stages* stages);
+
+private:
+  size_t slots_;
+  // The number of items that have been read, claimed by a worker, let
+  // through "Wait" and written.
+  size_t read_;
+  size_t claimed_;
+  size_t turn_;
+  size_t written_;
+  // The number of items, once the last one has been read.
+  size_t end_;
+  bool failed_;
+  // Whether the item in every slot has been processed.
+  std::vector<bool> processed_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+};
+
+// Runs a pipeline over a sequence of items, such as the blocks of a file,
+// that are read in order, processed in parallel and written in order. Each
+// item in the pipeline takes one of "slots" slots, which is used again once
+// the item has been written, so the memory used stays the same no matter how
+// many items there are, and reading, processing and writing all go on at
+// the same time.
+//
+// "stages.Read(slot, last)" reads the next item into slot "slot" and sets
+// "last" if it is the last item. It is called in order on a thread of its
+// own. "stages.Process(index, slot, pipeline)" processes item "index" in
+// slot "slot" and is called on up to "threads" threads in parallel, or on as
+// many threads as the hardware has if "threads" is 0. "stages.Write(slot)"
+// writes the item in slot "slot" and is called in order on the calling
+// thread. "Read" and "Process" return false if the item is not valid, which
+// stops the pipeline. Returns false if some item was not valid, in which
+// case the items before it may have been written.
+template <typename Stages>
+bool RunPipeline(unsigned int threads, size_t slots, Stages& stages);
+
+template <typename Stages>
+void PipelineReader(Pipeline* pipeline, Stages* stages) {
+  for (size_t index = 0; ; index++) {
+    {
+      std::unique_lock<std::mutex> lock(pipeline->mutex_);
+      while (index >= pipeline->written_ + pipeline->slots_ &&
+             !pipeline->failed_) {
+        pipeline->changed_.wait(lock);
+      }
+      if (pipeline->failed_) {
+        return;
+      }
+    }
+    bool last = false;
+    bool valid = stages->Read(index % pipeline->slots_, last);
+    std::lock_guard<std::mutex> lock(pipeline->mutex_);
+    if (!valid) {
+      pipeline->failed_ = true;
+    } else {
+      pipeline->read_ = index + 1;
+      if (last) {
+        pipeline->end_ = index + 1;
+      }
+    }
+    pipeline->changed_.notify_all();
+    if (!valid || last) {
+      return;
+    }
+  }
+}
+
+template <typename Stages>
+void PipelineWorker(Pipeline* pipeline, Stages* stages) {
+  while (true) {
+    size_t index;
+    {
+      std::unique_lock<std::mutex> lock(pipeline->mutex_);
+      while (pipeline->claimed_ == pipeline->read_ &&
+             pipeline->claimed_ != pipeline->end_ && !pipeline->failed_) {
+        pipeline->changed_.wait(lock);
+      }
+      if (pipeline->claimed_ == pipeline->end_ || pipeline->failed_) {
+        return;
+      }
+      index = pipeline->claimed_++;
+    }
+    bool valid = stages->Process(index, index % pipeline->slots_, *pipeline);
+    std::lock_guard<std::mutex> lock(pipeline->mutex_);
+    if (!valid) {
+      pipeline->failed_ = true;
+    } else {
+      pipeline->processed_[index % pipeline->slots_] = true;
+    }
+    pipeline->changed_.notify_all();
+  }
+}
+
+template <typename Stages>
+bool RunPipeline(unsigned int threads, size_t slots, Stages& stages) {
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+  Pipeline pipeline(slots);
+  std::vector<std::thread> workers;
+  workers.push_back(std::thread(PipelineReader<Stages>, &pipeline, &stages));
+  for (unsigned int i = 0; i < threads; i++) {
+    workers.push_back(std::thread(PipelineWorker<Stages>, &pipeline,
+                                  &stages));
+  }
+  for (size_t index = 0; ; index++) {
+    size_t slot = index % slots;
+    {
+      std::unique_lock<std::mutex> lock(pipeline.mutex_);
+      while (!pipeline.processed_[slot] && !pipeline.failed_) {
+        pipeline.changed_.wait(lock);
+      }
+      if (pipeline.failed_) {
+        break;
+      }
+    }
+    stages.Write(slot);
+    std::lock_guard<std::mutex> lock(pipeline.mutex_);
+    pipeline.processed_[slot] = false;
+    pipeline.written_ = index + 1;
+    pipeline.changed_.notify_all();
+    if (pipeline.written_ == pipeline.end_) {
+      break;
+    }
+  }
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  return !pipeline.failed_;
+}
+
+#endif // PARALLEL_H_
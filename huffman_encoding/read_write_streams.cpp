@@ -1,13 +1,74 @@
 #include "read_write_streams.h"
 
+#include <cstring>
 #include <string>
 
 using std::string;
 
-StringReadStream::StringReadStream(string byte_string) {
+// Returns the "bits" bits, at most STREAM_MAX_BITS, that start at bit
+// "bit_index" of "bytes", the first bit being the most significant one.
+// The bytes that hold them are loaded at once.
+static unsigned long long LoadBits(const char* bytes,
+                                   unsigned long long bit_index,
+                                   int bits) {
+  const unsigned char* data = (const unsigned char*) bytes + (bit_index >> 3);
+  int skip = (int) (bit_index & 7);
+  int count = (skip + bits + 7) >> 3;
+  unsigned long long value = 0;
+  for (int i = 0; i < count; i++) {
+    value = (value << 8) | data[i];
+  }
+  value >>= count * 8 - skip - bits;
+  return value & ((1ULL << bits) - 1);
+}
+
+// Stores the lowest "bits" bits of "value", at most STREAM_MAX_BITS, at bit
+// "bit_index" of "bytes", the most significant one first. The other bits of
+// the bytes are kept.
+static void StoreBits(char* bytes,
+                      unsigned long long bit_index,
+                      unsigned long long value,
+                      int bits) {
+  unsigned char* data = (unsigned char*) bytes + (bit_index >> 3);
+  int skip = (int) (bit_index & 7);
+  int count = (skip + bits + 7) >> 3;
+  int shift = count * 8 - skip - bits;
+  unsigned long long mask = ((1ULL << bits) - 1) << shift;
+  value = (value << shift) & mask;
+  for (int i = count - 1; i >= 0; i--) {
+    data[i] = (unsigned char) ((data[i] & ~mask) | value);
+    mask >>= 8;
+    value >>= 8;
+  }
+}
+
+bool ReadStream::ReadBits(unsigned long long& value, int bits) {
+  if (bits < 0 || bits > STREAM_MAX_BITS) {
+    return false;
+  }
+  value = 0;
+  for (int i = 0; i < bits; i++) {
+    char bit;
+    if (!ReadBit(bit)) {
+      return false;
+    }
+    value = (value << 1) | (bit & 1);
+  }
+  return true;
+}
+
+size_t ReadStream::ReadBytes(char* buffer, size_t bytes) {
+  size_t read = 0;
+  while (read < bytes && ReadByte(buffer[read])) {
+    read++;
+  }
+  return read;
+}
+
+StringReadStream::StringReadStream(const string& byte_string) {
   this->byte_string_ = byte_string;
   this->bit_index_ = 0;
-  this->total_bits_ = (unsigned int) byte_string_.size() * 8;
+  this->total_bits_ = (unsigned long long) byte_string_.size() * 8;
 }
 
 StringReadStream::~StringReadStream() {
@@ -24,49 +85,57 @@ bool StringReadStream::ReadBit(char& bit) {
 }
 
 bool StringReadStream::ReadByte(char& byte) {
-  byte = 0;
-  for (int i = 7; i >= 0; i--) {
-    char bit;
-    if (!ReadBit(bit)) {
-      return false;
-    }
-    if (bit) {
-      byte |= (1 << i);
-    }
+  unsigned long long value;
+  if (!ReadBits(value, 8)) {
+    return false;
   }
+  byte = (char) value;
   return true;
 }
 
 bool StringReadStream::ReadUnsignedInt32(unsigned int& value) {
-  value = 0;
-  for (int i = 0; i < 4; i++) {
-    char byte;
-    if (!ReadByte(byte)) {
-      return false;
-    }
-    value = (value << 8) | ((unsigned char) byte);
+  unsigned long long bits;
+  if (!ReadBits(bits, 32)) {
+    return false;
   }
+  value = (unsigned int) bits;
   return true;
 }
 
-bool StringReadStream::Reset() {
-  bit_index_ = 0;
+bool StringReadStream::ReadBits(unsigned long long& value, int bits) {
+  if (bits < 0 || bits > STREAM_MAX_BITS ||
+      total_bits_ - bit_index_ < (unsigned long long) bits) {
+    return false;
+  }
+  value = LoadBits(byte_string_.data(), bit_index_, bits);
+  bit_index_ += bits;
   return true;
 }
 
-unsigned int StringReadStream::Bytes() {
-  Reset();
-  unsigned int bytes = 0;
-  while (true) {
-    char byte;
-    if (!ReadByte(byte)) {
-      break;
-    }
-    bytes++;
+size_t StringReadStream::ReadBytes(char* buffer, size_t bytes) {
+  if (bit_index_ & 7) {
+    return ReadStream::ReadBytes(buffer, bytes);
   }
+  unsigned long long available = (total_bits_ - bit_index_) >> 3;
+  if (bytes > available) {
+    bytes = (size_t) available;
+  }
+  memcpy(buffer, byte_string_.data() + (bit_index_ >> 3), bytes);
+  bit_index_ += (unsigned long long) bytes * 8;
   return bytes;
 }
 
+bool StringReadStream::Reset() {
+  bit_index_ = 0;
+  return true;
+}
+
+unsigned long long StringReadStream::Bytes() {
+  // Like reading every byte, this leaves the stream at its end.
+  bit_index_ = total_bits_;
+  return total_bits_ >> 3;
+}
+
 FileReadStream::FileReadStream(const string& filename) {
   this->filename= filename;
   this->buffer_ = new char[STREAM_BUFFER_SIZE];
@@ -81,14 +150,16 @@ FileReadStream::~FileReadStream() {
   delete [] buffer_;
 }
 
+bool FileReadStream::FillBuffer() {
+  file_stream_.read(buffer_, STREAM_BUFFER_SIZE);
+  total_bits_ = (unsigned int) file_stream_.gcount() * 8;
+  bit_index_ = 0;
+  return total_bits_ != 0;
+}
+
 bool FileReadStream::ReadBit(char& bit) {
-  if (bit_index_ >= total_bits_) {
-    file_stream_.read(buffer_, STREAM_BUFFER_SIZE);
-    total_bits_ = (unsigned int) file_stream_.gcount() * 8;
-    bit_index_ = 0;
-    if (total_bits_ == 0) {
-      return false;
-    }
+  if (bit_index_ >= total_bits_ && !FillBuffer()) {
+    return false;
   }
   char byte = buffer_[bit_index_ >> 3];
   bit = ((byte >> (7 - (bit_index_ & 7))) & 1);
@@ -97,31 +168,76 @@ bool FileReadStream::ReadBit(char& bit) {
 }
 
 bool FileReadStream::ReadByte(char& byte) {
-  byte = 0;
-  for (int i = 7; i >= 0; i--) {
-    char bit;
-    if (!ReadBit(bit)) {
-      return false;
-    }
-    if (bit) {
-      byte |= (1 << i);
-    }
+  unsigned long long value;
+  if (!ReadBits(value, 8)) {
+    return false;
   }
+  byte = (char) value;
   return true;
 }
 
 bool FileReadStream::ReadUnsignedInt32(unsigned int& value) {
+  unsigned long long bits;
+  if (!ReadBits(bits, 32)) {
+    return false;
+  }
+  value = (unsigned int) bits;
+  return true;
+}
+
+bool FileReadStream::ReadBits(unsigned long long& value, int bits) {
+  if (bits < 0 || bits > STREAM_MAX_BITS) {
+    return false;
+  }
+  // The bits may run past the end of the buffer, in which case the rest of
+  // them comes from the next part of the file.
   value = 0;
-  for (int i = 0; i < 4; i++) {
-    char byte;
-    if (!ReadByte(byte)) {
+  while (bits > 0) {
+    if (bit_index_ >= total_bits_ && !FillBuffer()) {
       return false;
     }
-    value = (value << 8) | ((unsigned char) byte);
+    int available = total_bits_ - bit_index_ < (unsigned int) bits
+                        ? (int) (total_bits_ - bit_index_)
+                        : bits;
+    value = (value << available) | LoadBits(buffer_, bit_index_, available);
+    bit_index_ += available;
+    bits -= available;
   }
   return true;
 }
 
+size_t FileReadStream::ReadBytes(char* buffer, size_t bytes) {
+  if (bit_index_ & 7) {
+    return ReadStream::ReadBytes(buffer, bytes);
+  }
+  size_t read = 0;
+  while (read < bytes) {
+    if (bit_index_ >= total_bits_) {
+      if (bytes - read >= STREAM_BUFFER_SIZE) {
+        // The buffer is empty, so a large read can skip it.
+        file_stream_.read(buffer + read, (std::streamsize) (bytes - read));
+        size_t count = (size_t) file_stream_.gcount();
+        read += count;
+        if (count == 0) {
+          break;
+        }
+        continue;
+      }
+      if (!FillBuffer()) {
+        break;
+      }
+    }
+    size_t count = (total_bits_ - bit_index_) >> 3;
+    if (count > bytes - read) {
+      count = bytes - read;
+    }
+    memcpy(buffer + read, buffer_ + (bit_index_ >> 3), count);
+    bit_index_ += (unsigned int) count * 8;
+    read += count;
+  }
+  return read;
+}
+
 bool FileReadStream::Reset() {
   file_stream_.close();
   file_stream_.clear();
@@ -131,17 +247,33 @@ bool FileReadStream::Reset() {
   return true;
 }
 
-unsigned int FileReadStream::Bytes() {
+unsigned long long FileReadStream::Bytes() {
+  // Like reading every byte, this leaves the stream at its end.
   Reset();
-  unsigned int bytes = 0;
-  while (true) {
-    char byte;
-    if (!ReadByte(byte)) {
-      break;
+  file_stream_.seekg(0, std::ifstream::end);
+  std::streamoff bytes = file_stream_.tellg();
+  return bytes > 0 ? (unsigned long long) bytes : 0;
+}
+
+bool WriteStream::WriteBits(unsigned long long value, int bits) {
+  if (bits < 0 || bits > STREAM_MAX_BITS) {
+    return false;
+  }
+  for (int i = bits - 1; i >= 0; i--) {
+    if (!WriteBit((char) ((value >> i) & 1))) {
+      return false;
     }
-    bytes++;
   }
-  return bytes;
+  return true;
+}
+
+bool WriteStream::WriteBytes(const char* buffer, size_t bytes) {
+  for (size_t i = 0; i < bytes; i++) {
+    if (!WriteByte(buffer[i])) {
+      return false;
+    }
+  }
+  return true;
 }
 
 StringWriteStream::StringWriteStream() {
@@ -153,7 +285,7 @@ StringWriteStream::StringWriteStream() {
 StringWriteStream::~StringWriteStream() {
 }
 
-string StringWriteStream::GetString() {
+const string& StringWriteStream::GetString() {
   return byte_string_;
 }
 
@@ -172,22 +304,39 @@ bool StringWriteStream::WriteBit(char bit) {
 }
 
 bool StringWriteStream::WriteByte(char byte) {
-  for (int i = 7; i >= 0; i--) {
-    char bit = ((byte >> i) & 1);
-    WriteBit(bit);
-  }
-  return true;
+  return WriteBits((unsigned char) byte, 8);
 }
 
 bool StringWriteStream::WriteUnsignedInt32(unsigned int value) {
-  for (int i = 3; i >= 0; i--) {
-    char byte = ((value >> (8 * i)) & 255);
-    WriteByte(byte);
+  return WriteBits(value, 32);
+}
+
+bool StringWriteStream::Flush() {
+  return true;
+}
+
+bool StringWriteStream::WriteBits(unsigned long long value, int bits) {
+  if (bits < 0 || bits > STREAM_MAX_BITS) {
+    return false;
   }
+  unsigned long long end = bit_index_ + bits;
+  if (end > total_bits_) {
+    byte_string_.resize((size_t) ((end + 7) >> 3), (char) 0);
+    total_bits_ = (unsigned long long) byte_string_.size() * 8;
+  }
+  StoreBits(&byte_string_[0], bit_index_, value, bits);
+  bit_index_ = end;
   return true;
 }
 
-bool StringWriteStream::Flush() {
+bool StringWriteStream::WriteBytes(const char* buffer, size_t bytes) {
+  if (bit_index_ & 7) {
+    return WriteStream::WriteBytes(buffer, bytes);
+  }
+  // At the start of a byte, nothing has been written past "bit_index_".
+  byte_string_.append(buffer, bytes);
+  total_bits_ += (unsigned long long) bytes * 8;
+  bit_index_ = total_bits_;
   return true;
 }
 
@@ -219,17 +368,56 @@ bool FileWriteStream::WriteBit(char bit) {
 }
 
 bool FileWriteStream::WriteByte(char byte) {
-  for (int i = 7; i >= 0; i--) {
-    char bit = ((byte >> i) & 1);
-    WriteBit(bit);
+  return WriteBits((unsigned char) byte, 8);
+}
+
+bool FileWriteStream::WriteUnsignedInt32(unsigned int value) {
+  return WriteBits(value, 32);
+}
+
+bool FileWriteStream::WriteBits(unsigned long long value, int bits) {
+  if (bits < 0 || bits > STREAM_MAX_BITS) {
+    return false;
+  }
+  // The bits may run past the end of the buffer, in which case the rest of
+  // them goes to the buffer after it is written.
+  while (bits > 0) {
+    if (bit_index_ >= total_bits_) {
+      file_stream_.write(buffer_, STREAM_BUFFER_SIZE);
+      bit_index_ = 0;
+    }
+    int available = total_bits_ - bit_index_ < (unsigned int) bits
+                        ? (int) (total_bits_ - bit_index_)
+                        : bits;
+    StoreBits(buffer_, bit_index_, value >> (bits - available), available);
+    bit_index_ += available;
+    bits -= available;
   }
   return true;
 }
 
-bool FileWriteStream::WriteUnsignedInt32(unsigned int value) {
-  for (int i = 3; i >= 0; i--) {
-    char byte = ((value >> (8 * i)) & 255);
-    WriteByte(byte);
+bool FileWriteStream::WriteBytes(const char* buffer, size_t bytes) {
+  if (bit_index_ & 7) {
+    return WriteStream::WriteBytes(buffer, bytes);
+  }
+  while (bytes > 0) {
+    if (bit_index_ >= total_bits_) {
+      file_stream_.write(buffer_, STREAM_BUFFER_SIZE);
+      bit_index_ = 0;
+    }
+    if (bit_index_ == 0 && bytes >= STREAM_BUFFER_SIZE) {
+      // The buffer is empty, so a large write can skip it.
+      file_stream_.write(buffer, (std::streamsize) bytes);
+      break;
+    }
+    size_t count = (total_bits_ - bit_index_) >> 3;
+    if (count > bytes) {
+      count = bytes;
+    }
+    memcpy(buffer_ + (bit_index_ >> 3), buffer, count);
+    bit_index_ += (unsigned int) count * 8;
+    buffer += count;
+    bytes -= count;
   }
   return true;
 }
@@ -1,6 +1,7 @@
 #ifndef READ_WRITE_STREAM_H
 #define READ_WRITE_STREAM_H
 
+#include <cstddef>
 #include <fstream>
 #include <string>
 
@@ -10,11 +11,16 @@ using std::ifstream;
 using std::ofstream;
 using std::string;
 
+// The largest number of bits that "ReadBits" and "WriteBits" take at once.
+// Any 57 bits that start within a byte lie within 8 bytes.
+#define STREAM_MAX_BITS 57
+
 // A binary stream of data that can be read bit by bit or byte by byte or
 // 32 bit unsigned integer by 32 bit unsigned integer or by any combination
 // of the above. Concrete stream classes can read data from files, in-memory
 // representations, networks, databases or other sources. The "Read*" methods
-// return true if the read operation is successful or false otherwise.
+// return true if the read operation is successful or false otherwise,
+// except for "ReadBytes", which returns the number of bytes read.
 class ReadStream {
 public:
   virtual ~ReadStream() {}
@@ -22,29 +28,43 @@ public:
   virtual bool ReadByte(char& byte) = 0;
   virtual bool ReadUnsignedInt32(unsigned int& value) = 0;
   virtual bool Reset() = 0; //Resets the stream to it's beginning.
-  virtual unsigned int Bytes() = 0; // The number of bytes in the stream.
+  virtual unsigned long long Bytes() = 0; // The number of bytes in the stream.
+
+  // Reads the next "bits" bits, at most STREAM_MAX_BITS, into the lowest
+  // bits of "value", the first bit being the most significant one. The
+  // default reads them bit by bit.
+  virtual bool ReadBits(unsigned long long& value, int bits);
+
+  // Reads up to "bytes" bytes into "buffer" and returns the number of bytes
+  // read, which is less than "bytes" only at the end of the stream. The
+  // default reads them byte by byte.
+  virtual size_t ReadBytes(char* buffer, size_t bytes);
 };
 
 // A concrete ReadStream that reads binary data stored in-memory and
 // represented as a string. The string is treated as a sequence of bytes
-// with the i-th byte being the i-th character in the string.
+// with the i-th byte being the i-th character in the string. Bytes are
+// copied as a whole while the stream is at the start of a byte.
 class StringReadStream : public ReadStream {
 public:
-  StringReadStream(string byte_string);
+  StringReadStream(const string& byte_string);
   virtual ~StringReadStream();
   virtual bool ReadBit(char& bit);
   virtual bool ReadByte(char& byte);
   virtual bool ReadUnsignedInt32(unsigned int& value);
   virtual bool Reset();
-  virtual unsigned int Bytes();
+  virtual unsigned long long Bytes();
+  virtual bool ReadBits(unsigned long long& value, int bits);
+  virtual size_t ReadBytes(char* buffer, size_t bytes);
 private:
   string byte_string_;
-  unsigned int bit_index_;
-  unsigned int total_bits_;
+  unsigned long long bit_index_;
+  unsigned long long total_bits_;
 };
 
 // A concrete ReadStream that reads binary data stored in a file.
-// Reading data from the file is optimized by buffering.
+// Reading data from the file is optimized by buffering. Large reads of
+// whole bytes go from the file straight into the caller's buffer.
 class FileReadStream : public ReadStream {
 public:
   FileReadStream(const string& filename);
@@ -53,8 +73,14 @@ public:
   virtual bool ReadByte(char& byte);
   virtual bool ReadUnsignedInt32(unsigned int& value);
   virtual bool Reset();
-  virtual unsigned int Bytes();
+  virtual unsigned long long Bytes();
+  virtual bool ReadBits(unsigned long long& value, int bits);
+  virtual size_t ReadBytes(char* buffer, size_t bytes);
 private:
+  // Reads the next part of the file into the buffer. Returns false at the
+  // end of the file.
+  bool FillBuffer();
+
   string filename;
   char* buffer_;
   ifstream file_stream_;
@@ -74,28 +100,40 @@ public:
   virtual bool WriteByte(char byte) = 0;
   virtual bool WriteUnsignedInt32(unsigned int value) = 0;
   virtual bool Flush() = 0; // Forces a write to all written data.
+
+  // Writes the lowest "bits" bits of "value", at most STREAM_MAX_BITS, the
+  // most significant one first. The default writes them bit by bit.
+  virtual bool WriteBits(unsigned long long value, int bits);
+
+  // Writes the "bytes" bytes at "buffer". The default writes them byte by
+  // byte.
+  virtual bool WriteBytes(const char* buffer, size_t bytes);
 };
 
 // A concrete WriteStream that writes binary data to a string stored
 // in-memory. The string is treated as a sequence of bytes with the
-// i-th byte being the i-th character in the string.
+// i-th byte being the i-th character in the string. Bytes are appended as a
+// whole while the stream is at the start of a byte.
 class StringWriteStream : public WriteStream {
 public:
   StringWriteStream();
   virtual ~StringWriteStream();
-  virtual string GetString();
+  virtual const string& GetString();
   virtual bool WriteBit(char bit);
   virtual bool WriteByte(char byte);
   virtual bool WriteUnsignedInt32(unsigned int value);
   virtual bool Flush();
+  virtual bool WriteBits(unsigned long long value, int bits);
+  virtual bool WriteBytes(const char* buffer, size_t bytes);
 private:
   string byte_string_;
-  unsigned int bit_index_;
-  unsigned int total_bits_;
+  unsigned long long bit_index_;
+  unsigned long long total_bits_;
 };
 
 // A concrete WriteStream that writes binary data into a file.
-// Writing data to the file is optimized by buffering.
+// Writing data to the file is optimized by buffering. Large writes of whole
+// bytes go from the caller's buffer straight to the file.
 class FileWriteStream : public WriteStream {
 public:
   FileWriteStream(const string& filename);
@@ -104,6 +142,8 @@ public:
   virtual bool WriteByte(char byte);
   virtual bool WriteUnsignedInt32(unsigned int value);
   virtual bool Flush();
+  virtual bool WriteBits(unsigned long long value, int bits);
+  virtual bool WriteBytes(const char* buffer, size_t bytes);
 private:
   string filename_;
   char* buffer_;
@@ -0,0 +1,207 @@
+// This file contains implementations of the classes and functions in
+// "shared_huffman.h".
+#include "shared_huffman.h"
+
+HuffmanSharedTable::HuffmanSharedTable() {
+  this->id_ = 0;
+  unsigned int frequencies[kSharedHuffmanSymbols];
+  for (int symbol = 0; symbol < kSharedHuffmanSymbols; symbol++) {
+    frequencies[symbol] = 1;
+  }
+  unsigned char lengths[kSharedHuffmanSymbols];
+  BuildLimitedCodeLengths(frequencies, kSharedHuffmanSymbols,
+                          kHuffmanLookupBits, lengths);
+  BuildCodes(lengths);
+}
+
+void HuffmanSharedTable::BuildCodes(const unsigned char* lengths) {
+  for (int symbol = 0; symbol < kSharedHuffmanSymbols; symbol++) {
+    lengths_[symbol] = lengths[symbol];
+  }
+  BuildCanonicalCodes(lengths_, kSharedHuffmanSymbols, codes_);
+  BuildDecodeTable(codes_, lengths_, kSharedHuffmanSymbols, table_);
+}
+
+void HuffmanSharedTable::Train(unsigned int id,
+                               const vector<string>& samples) {
+  // Every symbol is counted once more than it occurs so that it gets a code,
+  // and the end symbol occurs once per sample.
+  unsigned long long counts[kSharedHuffmanSymbols];
+  for (int symbol = 0; symbol < kSharedHuffmanSymbols; symbol++) {
+    counts[symbol] = 1;
+  }
+  counts[kSharedHuffmanEndSymbol] += samples.size();
+  for (size_t i = 0; i < samples.size(); i++) {
+    const unsigned char* bytes = (const unsigned char*) samples[i].data();
+    for (size_t j = 0; j < samples[i].size(); j++) {
+      counts[bytes[j]]++;
+    }
+  }
+
+  // Halve the counts until their total fits in 32 bits.
+  while (true) {
+    unsigned long long total = 0;
+    for (int symbol = 0; symbol < kSharedHuffmanSymbols; symbol++) {
+      total += counts[symbol];
+    }
+    if (total <= 0xffffffffu) {
+      break;
+    }
+    for (int symbol = 0; symbol < kSharedHuffmanSymbols; symbol++) {
+      counts[symbol] = (counts[symbol] + 1) / 2;
+    }
+  }
+  unsigned int frequencies[kSharedHuffmanSymbols];
+  for (int symbol = 0; symbol < kSharedHuffmanSymbols; symbol++) {
+    frequencies[symbol] = (unsigned int) counts[symbol];
+  }
+  unsigned char lengths[kSharedHuffmanSymbols];
+  BuildLimitedCodeLengths(frequencies, kSharedHuffmanSymbols,
+                          kHuffmanLookupBits, lengths);
+  this->id_ = id;
+  BuildCodes(lengths);
+}
+
+void HuffmanSharedTable::Save(string& output) const {
+  size_t start = output.size();
+  size_t id_size = VarintSize(id_);
+  output.resize(start + id_size +
+                CodeLengthsSize(lengths_, kSharedHuffmanSymbols));
+  StoreVarint(id_, &output[start]);
+  BitWriter writer(&output[start + id_size]);
+  EncodeCodeLengths(lengths_, kSharedHuffmanSymbols, writer);
+  writer.Finish();
+}
+
+bool HuffmanSharedTable::Load(const char* data, size_t size) {
+  size_t position = 0;
+  unsigned long long id;
+  if (!LoadVarint(data, size, position, id) || id > 0xffffffffu) {
+    return false;
+  }
+  BitReader reader(data + position, size - position);
+  unsigned char lengths[kSharedHuffmanSymbols];
+  if (!DecodeCodeLengths(reader, lengths, kSharedHuffmanSymbols) ||
+      position + CodeLengthsSize(lengths, kSharedHuffmanSymbols) != size) {
+    return false;
+  }
+  // Every symbol must have a code that is decoded with a single lookup, and
+  // the codes must leave no bit pattern unused.
+  unsigned int code_space = 0;
+  for (int symbol = 0; symbol < kSharedHuffmanSymbols; symbol++) {
+    if (lengths[symbol] == 0 || lengths[symbol] > kHuffmanLookupBits) {
+      return false;
+    }
+    code_space += 1 << (kHuffmanLookupBits - lengths[symbol]);
+  }
+  if (code_space != 1u << kHuffmanLookupBits) {
+    return false;
+  }
+  this->id_ = (unsigned int) id;
+  BuildCodes(lengths);
+  return true;
+}
+
+void HuffmanSharedTable::Encode(const char* data,
+                                size_t size,
+                                string& output) const {
+  // Reserve room for the longest possible codes and cut the message down to
+  // its actual size afterwards.
+  size_t start = output.size();
+  size_t id_size = VarintSize(id_);
+  output.resize(start + id_size +
+                ((size + 1) * kHuffmanLookupBits + 7) / 8);
+  StoreVarint(id_, &output[start]);
+  BitWriter writer(&output[start + id_size]);
+  const unsigned char* bytes = (const unsigned char*) data;
+  for (size_t i = 0; i < size; i++) {
+    writer.WriteBits((unsigned int) codes_[bytes[i]], lengths_[bytes[i]]);
+  }
+  writer.WriteBits((unsigned int) codes_[kSharedHuffmanEndSymbol],
+                   lengths_[kSharedHuffmanEndSymbol]);
+  output.resize(start + id_size + writer.Finish());
+}
+
+bool HuffmanSharedTable::Decode(const char* data,
+                                size_t size,
+                                string& output) const {
+  BitReader reader(data, size);
+  unsigned long long bits = 0;
+  while (true) {
+    reader.Refill();
+    const HuffmanDecodeEntry& entry =
+        table_[reader.PeekBits(kHuffmanLookupBits)];
+    int symbol = entry.symbols & 0xffff;
+    if (entry.count == 2 && symbol != kSharedHuffmanEndSymbol &&
+        (int) (entry.symbols >> 16) != kSharedHuffmanEndSymbol) {
+      output.push_back((char) symbol);
+      output.push_back((char) (entry.symbols >> 16));
+      reader.SkipBits(entry.bits);
+      bits += entry.bits;
+    } else {
+      reader.SkipBits(entry.first_bits);
+      bits += entry.first_bits;
+      if (symbol == kSharedHuffmanEndSymbol) {
+        break;
+      }
+      output.push_back((char) symbol);
+    }
+    // Every code takes at least one bit, so the loop stops at the end of the
+    // data even if the message does not end there.
+    if (reader.Overrun()) {
+      return false;
+    }
+  }
+  // Only the padding of the last byte may follow the end.
+  if (reader.Overrun() || (bits + 7) / 8 != size) {
+    return false;
+  }
+  return bits % 8 == 0 || reader.ReadBits(8 - bits % 8) == 0;
+}
+
+void HuffmanEncodeMessage(const HuffmanSharedTable& table,
+                          const string& message,
+                          string& encoded_message) {
+  encoded_message.clear();
+  table.Encode(message.data(), message.size(), encoded_message);
+}
+
+bool HuffmanDecodeMessage(const HuffmanSharedTables& tables,
+                          const string& encoded_message,
+                          string& message) {
+  message.clear();
+  size_t position = 0;
+  unsigned long long id;
+  if (!LoadVarint(encoded_message.data(), encoded_message.size(), position,
+                  id) || id > 0xffffffffu) {
+    return false;
+  }
+  HuffmanSharedTables::const_iterator table =
+      tables.find((unsigned int) id);
+  if (table == tables.end()) {
+    return false;
+  }
+  return table->second.Decode(encoded_message.data() + position,
+                              encoded_message.size() - position, message);
+}
+
+void HuffmanEncodeMessages(const HuffmanSharedTable& table,
+                           const vector<string>& messages,
+                           vector<string>& encoded_messages) {
+  encoded_messages.resize(messages.size());
+  for (size_t i = 0; i < messages.size(); i++) {
+    HuffmanEncodeMessage(table, messages[i], encoded_messages[i]);
+  }
+}
+
+bool HuffmanDecodeMessages(const HuffmanSharedTables& tables,
+                           const vector<string>& encoded_messages,
+                           vector<string>& messages) {
+  messages.resize(encoded_messages.size());
+  for (size_t i = 0; i < encoded_messages.size(); i++) {
+    if (!HuffmanDecodeMessage(tables, encoded_messages[i], messages[i])) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,105 @@
+// Huffman coding of small messages with tables that are trained in advance
+// and shared between both sides.
+#ifndef SHARED_HUFFMAN_H_
+#define SHARED_HUFFMAN_H_
+
+#include "huffman.h"
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+using std::map;
+using std::string;
+using std::vector;
+
+// The symbol that ends a message encoded with a shared table. Symbols 0 to
+// 255 are bytes.
+const int kSharedHuffmanEndSymbol = 256;
+
+// The number of symbols of a shared table.
+const int kSharedHuffmanSymbols = 257;
+
+// A Huffman code that is built once from sample messages and then used for
+// many messages, so that the messages need not carry their own code.
+//
+// Every symbol has a code, including bytes that did not occur in the
+// samples, and codes are limited to kHuffmanLookupBits bits, so every symbol
+// is decoded with a single table lookup.
+//
+// An encoded message starts with the ID of its table as a variable length
+// integer (see "StoreVarint"), followed by the codes of its bytes and of the
+// end symbol, padded with "0"s to a whole byte. A saved table consists of its
+// ID as a variable length integer followed by the code lengths of its
+// symbols in the format of "EncodeCodeLengths".
+class HuffmanSharedTable {
+public:
+  // Creates a table with ID 0 in which all symbols are equally likely.
+  HuffmanSharedTable();
+
+  // Builds the code from the bytes in "samples", which should resemble the
+  // messages that will be encoded with it, and sets the ID of the table to
+  // "id".
+  void Train(unsigned int id, const vector<string>& samples);
+
+  // Appends the table to "output".
+  void Save(string& output) const;
+
+  // Replaces the table with the table saved in the "size" bytes at "data".
+  // Returns false if they do not hold a valid table, in which case the table
+  // is left unchanged.
+  bool Load(const char* data, size_t size);
+
+  // Encodes the "size" bytes at "data" and appends the encoded message to
+  // "output".
+  void Encode(const char* data, size_t size, string& output) const;
+
+  // Decodes the codes in the "size" bytes at "data", which follow the ID of
+  // an encoded message, and appends the decoded bytes to "output". Returns
+  // false if they are not valid.
+  bool Decode(const char* data, size_t size, string& output) const;
+
+  unsigned int id() const {
+    return id_;
+  }
+
+private:
+  void BuildCodes(const unsigned char* lengths);
+
+  unsigned int id_;
+  unsigned char lengths_[kSharedHuffmanSymbols];
+  unsigned long long codes_[kSharedHuffmanSymbols];
+  HuffmanDecodeTable table_;
+};
+
+// A set of shared tables, indexed by ID.
+typedef map<unsigned int, HuffmanSharedTable> HuffmanSharedTables;
+
+// Encodes "message" with "table" and stores the result in "encoded_message".
+void HuffmanEncodeMessage(const HuffmanSharedTable& table,
+                          const string& message,
+                          string& encoded_message);
+
+// Decodes "encoded_message" with the table from "tables" whose ID it carries
+// and stores the result in "message". Returns false if there is no such
+// table or if "encoded_message" is not valid.
+bool HuffmanDecodeMessage(const HuffmanSharedTables& tables,
+                          const string& encoded_message,
+                          string& message);
+
+// Encodes every message of "messages" with "table" and stores the results in
+// "encoded_messages" in the same order. Each of them can be decoded on its
+// own.
+void HuffmanEncodeMessages(const HuffmanSharedTable& table,
+                           const vector<string>& messages,
+                           vector<string>& encoded_messages);
+
+// Decodes every message of "encoded_messages" as in "HuffmanDecodeMessage"
+// and stores the results in "messages" in the same order. Returns false if
+// some message can not be decoded.
+bool HuffmanDecodeMessages(const HuffmanSharedTables& tables,
+                           const vector<string>& encoded_messages,
+                           vector<string>& messages);
+
+#endif // SHARED_HUFFMAN_H_